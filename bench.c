@@ -0,0 +1,298 @@
+// Microbenchmarks for the hot paths of the interpreter: allocation,
+// collection, interning symbols, looking up variables and reading. Each
+// reports the time per operation, and with `--perf`, hardware counters per
+// operation too (where `perf_event_open` is allowed).
+//
+//   $ make bench && ./bench [--perf] [benchmark...]
+//
+// Only the benchmarks whose names start with one of the arguments are run.
+// The interpreter is compiled into this file, rather than linked from
+// libponyo.a, so that its static functions can be called directly.
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+
+#include "ponyo.c"
+
+// Declared here, as <unistd.h> clashes with the interpreter's `read`.
+long syscall(long number, ...);
+
+/*------------------------------------------------------------------------------
+ | MEASUREMENT
+ -----------------------------------------------------------------------------*/
+
+#define EVENTS 3
+
+static const struct {
+    uint64_t config;
+    const char* name;
+} events[EVENTS] = {
+    { PERF_COUNT_HW_CPU_CYCLES, "cycles" },
+    { PERF_COUNT_HW_INSTRUCTIONS, "instructions" },
+    { PERF_COUNT_HW_CACHE_MISSES, "cache-misses" },
+};
+
+// Counter file descriptors, or -1 for counters that aren't in use.
+static int perf_fds[EVENTS] = { -1, -1, -1 };
+
+static char** filters;
+static int filters_size;
+
+typedef struct Meter {
+    struct timespec start;
+} Meter;
+
+static void perf_open(void) {
+    for (int i = 0; i < EVENTS; i++) {
+        struct perf_event_attr attr = {
+            .type = PERF_TYPE_HARDWARE,
+            .size = sizeof(attr),
+            .config = events[i].config,
+            .disabled = 1,
+            .exclude_kernel = 1,
+            .exclude_hv = 1,
+        };
+        perf_fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (perf_fds[i] < 0) {
+            fprintf(stderr, "bench: %s: counter unavailable\n",
+                    events[i].name);
+        }
+    }
+}
+
+static int selected(const char* name) {
+    if (filters_size == 0) {
+        return 1;
+    }
+    for (int i = 0; i < filters_size; i++) {
+        if (strncmp(name, filters[i], strlen(filters[i])) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void meter_start(Meter* m) {
+    for (int i = 0; i < EVENTS; i++) {
+        if (perf_fds[i] >= 0) {
+            ioctl(perf_fds[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(perf_fds[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &m->start);
+}
+
+// Reports `ops` operations, done since `meter_start`, as benchmark `name`.
+static void meter_stop(Meter* m, const char* name, long ops) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    uint64_t counts[EVENTS] = { 0 };
+    for (int i = 0; i < EVENTS; i++) {
+        if (perf_fds[i] >= 0) {
+            ioctl(perf_fds[i], PERF_EVENT_IOC_DISABLE, 0);
+            if (syscall(SYS_read, perf_fds[i], &counts[i],
+                        sizeof(counts[i])) != sizeof(counts[i])) {
+                counts[i] = 0;
+            }
+        }
+    }
+    double ns = (end.tv_sec - m->start.tv_sec) * 1e9 +
+                (end.tv_nsec - m->start.tv_nsec);
+    printf("%-24s %12.1f", name, ns / ops);
+    for (int i = 0; i < EVENTS; i++) {
+        if (perf_fds[i] >= 0) {
+            printf(" %14.1f", (double)counts[i] / ops);
+        }
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+static Interp* new_interp(int heap_size) {
+    PonyoConfig config = { .heap_size = heap_size };
+    Interp* interp = ponyo_new(&config);
+    assert(interp);
+    return interp;
+}
+
+/*------------------------------------------------------------------------------
+ | BENCHMARKS
+ -----------------------------------------------------------------------------*/
+
+// Allocating garbage, including the collections that reclaim it.
+static void bench_alloc(void) {
+    if (!selected("alloc")) {
+        return;
+    }
+    Interp* interp = new_interp(100000);
+    long ops = 20000000;
+    Meter m;
+    meter_start(&m);
+    for (long i = 0; i < ops; i++) {
+        cons(interp, EMPTY_LIST, EMPTY_LIST);
+    }
+    meter_stop(&m, "alloc", ops);
+    ponyo_free(interp);
+}
+
+// A collection (mark and sweep) with `live` cells reachable.
+static void bench_gc(int live) {
+    char name[64];
+    snprintf(name, sizeof(name), "gc/live=%d", live);
+    if (!selected(name)) {
+        return;
+    }
+    Interp* interp = new_interp(200000);
+    DEF_ROOT1(list);
+    list = EMPTY_LIST;
+    for (int i = 0; i < live; i++) {
+        list = cons(interp, EMPTY_LIST, list);
+    }
+    long ops = 200;
+    Meter m;
+    meter_start(&m);
+    for (long i = 0; i < ops; i++) {
+        collect(interp);
+    }
+    meter_stop(&m, name, ops);
+    POP_ROOT1();
+    ponyo_free(interp);
+}
+
+// Interning a symbol that is already in a table of `n`.
+static void bench_intern(int n) {
+    char name[64];
+    snprintf(name, sizeof(name), "intern/symbols=%d", n);
+    if (!selected(name)) {
+        return;
+    }
+    Interp* interp = new_interp(100000);
+    char** names = malloc(n * sizeof(char*));
+    assert(names);
+    for (int i = 0; i < n; i++) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "symbol-%d", i);
+        names[i] = strdup(buf);
+        intern_symbol(interp, names[i]);
+    }
+    long ops = 20000000 / n;
+    Meter m;
+    meter_start(&m);
+    for (long i = 0; i < ops; i++) {
+        intern_symbol(interp, names[i % n]);
+    }
+    meter_stop(&m, name, ops);
+    for (int i = 0; i < n; i++) {
+        free(names[i]);
+    }
+    free(names);
+    ponyo_free(interp);
+}
+
+// Looking up a variable `depth` frames out, each frame binding 4 variables.
+static void bench_lookup(int depth) {
+    char name[64];
+    snprintf(name, sizeof(name), "lookup/depth=%d", depth);
+    if (!selected(name)) {
+        return;
+    }
+    Interp* interp = new_interp(100000);
+    DEF_ROOT3(env, vars, vals);
+    env = interp->global_env;
+    Val* target = NULL;
+    for (int d = 0; d < depth; d++) {
+        vars = EMPTY_LIST;
+        vals = EMPTY_LIST;
+        for (int i = 0; i < 4; i++) {
+            char buf[32];
+            snprintf(buf, sizeof(buf), "var-%d-%d", d, i);
+            Val* var = intern_symbol(interp, buf);
+            if (!target) {
+                target = var;
+            }
+            vars = cons(interp, var, vars);
+            vals = cons(interp, EMPTY_LIST, vals);
+        }
+        env = extend_env(interp, vars, vals, env);
+    }
+    long ops = 40000000 / depth;
+    Meter m;
+    meter_start(&m);
+    for (long i = 0; i < ops; i++) {
+        lookup_variable(interp, target, env);
+    }
+    meter_stop(&m, name, ops);
+    POP_ROOT3();
+    ponyo_free(interp);
+}
+
+// Reading a typical top-level form (a procedure definition).
+static void bench_read(void) {
+    if (!selected("read")) {
+        return;
+    }
+    Interp* interp = new_interp(100000);
+    const char* form =
+        "(define (fib n) ; Comment.\n"
+        "  (if (< n 2) n\n"
+        "      (+ (fib (- n 1)) (fib (- n 2)) 12345 \"str\" 'sym)))\n";
+    int forms = 100000;
+    size_t size = strlen(form);
+    char* src = malloc(forms * size);
+    assert(src);
+    for (int i = 0; i < forms; i++) {
+        memcpy(src + i * size, form, size);
+    }
+    FILE* fp = fmemopen(src, forms * size, "r");
+    assert(fp);
+    long ops = 0;
+    Meter m;
+    meter_start(&m);
+    while (read(interp, fp)) {
+        ops++;
+    }
+    meter_stop(&m, "read", ops);
+    assert(ops == forms);
+    fclose(fp);
+    free(src);
+    ponyo_free(interp);
+}
+
+int main(int argc, char** argv) {
+    filters = malloc(argc * sizeof(char*));
+    assert(filters);
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--perf") == 0) {
+            perf_open();
+        } else {
+            filters[filters_size++] = argv[i];
+        }
+    }
+
+    printf("%-24s %12s", "benchmark", "ns/op");
+    for (int i = 0; i < EVENTS; i++) {
+        if (perf_fds[i] >= 0) {
+            printf(" %11s/op", events[i].name);
+        }
+    }
+    printf("\n");
+
+    bench_alloc();
+    int lives[] = { 1000, 10000, 100000 };
+    for (int i = 0; i < 3; i++) {
+        bench_gc(lives[i]);
+    }
+    int symbols[] = { 100, 1000, 10000 };
+    for (int i = 0; i < 3; i++) {
+        bench_intern(symbols[i]);
+    }
+    int depths[] = { 1, 4, 16, 64 };
+    for (int i = 0; i < 4; i++) {
+        bench_lookup(depths[i]);
+    }
+    bench_read();
+    free(filters);
+    return 0;
+}
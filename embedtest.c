@@ -0,0 +1,89 @@
+// Exercises the embedding API: several interpreter instances evaluating
+// independent programs concurrently, one per thread.
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ponyo.h"
+
+#define THREADS 4
+
+typedef struct Job {
+    int id;
+    int n;
+    int failed;
+} Job;
+
+static int eval_expect(PonyoInterp* interp, FILE* out, char** buf,
+                       const char* src, int exp_status, const char* exp) {
+    long start = ftell(out);
+    int status = ponyo_eval_string(interp, src);
+    fflush(out);
+    const char* act = *buf + start;
+    if (status != exp_status || strcmp(act, exp) != 0) {
+        fprintf(stderr, "'%s': expected %d '%s', got %d '%s'\n",
+                src, exp_status, exp, status, act);
+        return 1;
+    }
+    return 0;
+}
+
+static void* run_job(void* arg) {
+    Job* job = arg;
+    char* buf = NULL;
+    size_t size = 0;
+    FILE* out = open_memstream(&buf, &size);
+
+    PonyoConfig config = {
+        .heap_size = 5000,
+        .gc_threads = 2,
+        // Half of the instances compile everything they run.
+        .jit_threshold = job->id % 2,
+        .out = out,
+        .prelude = "stdlib.scm",
+    };
+    PonyoInterp* interp = ponyo_new(&config);
+    if (!interp) {
+        job->failed = 1;
+        return NULL;
+    }
+
+    char src[200];
+    char exp[200];
+    job->failed |= eval_expect(interp, out, &buf,
+                               "(define (sum n)"
+                               "  (if (= n 0) 0 (+ n (sum (- n 1)))))", 0, "");
+    for (int i = 0; i < 20; i++) {
+        snprintf(src, sizeof(src), "(map sum '(%d %d))", job->n, job->n / 2);
+        snprintf(exp, sizeof(exp), "(%d %d)\n", job->n * (job->n + 1) / 2,
+                 (job->n / 2) * (job->n / 2 + 1) / 2);
+        job->failed |= eval_expect(interp, out, &buf, src, 0, exp);
+    }
+
+    // Errors unwind to the caller, and leave the instance usable.
+    job->failed |= eval_expect(interp, out, &buf, "(car '())", -1, "");
+    job->failed |= eval_expect(interp, out, &buf, "(sum 3)", 0, "6\n");
+
+    ponyo_free(interp);
+    fclose(out);
+    free(buf);
+    return NULL;
+}
+
+int main(void) {
+    pthread_t threads[THREADS];
+    Job jobs[THREADS];
+    for (int i = 0; i < THREADS; i++) {
+        jobs[i] = (Job){ .id = i, .n = 50 + 10 * i };
+        pthread_create(&threads[i], NULL, run_job, &jobs[i]);
+    }
+    int failed = 0;
+    for (int i = 0; i < THREADS; i++) {
+        pthread_join(threads[i], NULL);
+        failed |= jobs[i].failed;
+    }
+    printf("embedding test result: %s\n", failed ? "failed" : "ok");
+    return failed;
+}
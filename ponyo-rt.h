@@ -0,0 +1,156 @@
+#ifndef PONYO_RT_H
+#define PONYO_RT_H
+
+#include "ponyo.h"
+
+/*------------------------------------------------------------------------------
+ | RUNTIME
+ |
+ | The parts of the interpreter that compiled programs (see `ponyo --emit-c`)
+ | are linked against: the representation of values, and the entry points that
+ | compiled code calls into. The runtime itself is `libponyo.a`.
+ -----------------------------------------------------------------------------*/
+
+typedef enum Type {
+    TY_FALSE      = 1 << 0,
+    TY_TRUE       = 1 << 1,
+    TY_EMPTY_LIST = 1 << 2,
+    TY_COMP_PROC  = 1 << 3,
+    TY_INT        = 1 << 4,
+    TY_PAIR       = 1 << 5,
+    TY_PRIM_PROC  = 1 << 6,
+    TY_STRING     = 1 << 7,
+    TY_SYMBOL     = 1 << 8,
+    TY_VOID       = 1 << 9,
+    TY_MACRO      = 1 << 10,
+    TY_GUARD      = 1 << 11,
+    TY_PORT       = 1 << 12,
+    TY_EOF        = 1 << 13,
+    TY_THREAD     = 1 << 14,
+    TY_CHANNEL    = 1 << 15,
+    TY_FUTURE     = 1 << 16,
+    TY_RECORD     = 1 << 17,
+    TY_BYTEVECTOR = 1 << 18,
+    TY_PROMISE    = 1 << 19,
+} Type;
+
+typedef struct Val Val;
+typedef Val* PrimProc(struct Interp* interp, Val* args, Val* env);
+struct Val {
+    Type ty;
+
+    // Memory management.
+    char marked;
+    // Allocation site, when profiling (see `profile_site`).
+    unsigned short site;
+    Val* next;
+
+    union {
+        // Compound procedure or macro.
+        struct {
+            Val* params;
+            Val* body;
+            Val* env;
+        };
+        // Optimizer guard: `fast` is evaluated in place of `slow` for as long
+        // as each of the bindings in `deps` holds the value it had when the
+        // code was optimized (see `optimize`).
+        struct {
+            Val* deps;
+            Val* fast;
+            Val* slow;
+        };
+        // Int.
+        int num;
+        // Pair.
+        struct {
+            Val* car;
+            Val* cdr;
+        };
+        // Primitive procedure.
+        PrimProc* proc;
+        // String or symbol.
+        char* str;
+        // Input port. `fp` is NULL once the port is closed.
+        struct {
+            FILE* fp;
+            char* buf;
+        };
+        // Green thread.
+        struct Thread* thread;
+        // Channel: a queue of up to `capacity` items, oldest first.
+        struct {
+            Val* items;
+            Val* items_end;
+            int capacity;
+            int count;
+        };
+        // Future.
+        struct Future* future;
+        // Record: an instance of record type `type`, with a slot for each of
+        // its fields. (A record type is itself a record, of a type that
+        // describes record types.)
+        struct {
+            Val* type;
+            Val** slots;
+            int slots_size;
+        };
+        // Bytevector.
+        struct {
+            unsigned char* bytes;
+            int bytes_size;
+        };
+        // Promise: the thunk that computes its value until it is forced, and
+        // the value after.
+        struct {
+            Val* promise;
+            int forced;
+        };
+    };
+};
+
+// Constants, shared by all instances.
+extern Val ponyo_false;
+extern Val ponyo_true;
+extern Val ponyo_empty_list;
+extern Val ponyo_void;
+extern Val ponyo_eof;
+
+// Native code for a procedure body, run in `env` (the procedure's frame).
+// `slots` are GC roots that the code may keep values in.
+typedef Val* PonyoCode(PonyoInterp* interp, Val* env, Val** slots);
+
+Val* ponyo_eval(PonyoInterp* interp, Val* form, Val* env);
+Val* ponyo_lookup(PonyoInterp* interp, Val* var, Val* env);
+// The binding of `var` in the global environment (the value is its `car`),
+// or NULL if there is none.
+Val* ponyo_global(PonyoInterp* interp, Val* var);
+// Applies compound procedure `proc` to `argc` values in `args`. The values
+// must be kept rooted by the caller.
+Val* ponyo_call(PonyoInterp* interp, Val* proc, int argc, Val** args);
+// `car` and `cdr` must be kept rooted by the caller.
+Val* ponyo_cons(PonyoInterp* interp, Val* car, Val* cdr);
+Val* ponyo_make_int(PonyoInterp* interp, int num);
+void ponyo_type_error(PonyoInterp* interp, char* proc)
+    __attribute__((noreturn));
+// The primitive named `name`, or NULL if there is none.
+PrimProc* ponyo_prim(const char* name);
+// Runs `code` (which needs `slots` slots) in place of `body`. If `global` is
+// set, the code assumes the procedure is closed over the global environment.
+void ponyo_register(PonyoInterp* interp, Val* body, PonyoCode* code,
+                    int slots, int global);
+
+// A compiled program: its source, and the native code for its procedures.
+typedef struct PonyoProgram {
+    const char* prelude;
+    const char* source;
+    // Called for each top-level form (counting from the start of `prelude`)
+    // as it is loaded, with every value in the form in preorder, to register
+    // code for the procedure bodies in it.
+    void (*link)(PonyoInterp* interp, int form, Val** nodes);
+} PonyoProgram;
+
+// Runs a program as `ponyo` would run its source from standard input.
+int ponyo_program_main(const PonyoProgram* program, int argc, char** argv);
+
+#endif
@@ -1,93 +1,720 @@
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/sysinfo.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <ucontext.h>
+
+#include "ponyo-rt.h"
+
+// Declared here, as <unistd.h> clashes with the interpreter's `read`.
+pid_t getpid(void);
+pid_t fork(void);
+int close(int fd);
+int dup2(int old_fd, int new_fd);
+int chdir(const char* path);
+char* getcwd(char* buf, size_t size);
 
 /*------------------------------------------------------------------------------
  | ERROR LOGGING
  -----------------------------------------------------------------------------*/
 
-#define ERROR(...) {              \
-    fprintf(stderr, "error: ");   \
-    fprintf(stderr, __VA_ARGS__); \
-    fprintf(stderr, "\n");        \
-    exit(1);                      \
-}
+typedef struct Interp Interp;
+
+// Reports an error. Exits the process, unless the interpreter instance has
+// somewhere to unwind to (see `ponyo_eval_string`).
+static void raise_error(Interp* interp, char* fmt, ...)
+    __attribute__((noreturn, format(printf, 2, 3)));
+
+#define ERROR(...) raise_error(interp, __VA_ARGS__)
 
 /*------------------------------------------------------------------------------
  | SCHEME VALUES
  -----------------------------------------------------------------------------*/
 
-typedef enum Type {
-    TY_FALSE      = 1 << 0,
-    TY_TRUE       = 1 << 1,
-    TY_EMPTY_LIST = 1 << 2,
-    TY_COMP_PROC  = 1 << 3,
-    TY_INT        = 1 << 4,
-    TY_PAIR       = 1 << 5,
-    TY_PRIM_PROC  = 1 << 6,
-    TY_STRING     = 1 << 7,
-    TY_SYMBOL     = 1 << 8,
-    TY_VOID       = 1 << 9,
-} Type;
-
-typedef struct Val Val;
-typedef Val* PrimProc(Val* args, Val* env);
-struct Val {
-    Type ty;
+// Values are represented as in compiled programs (see ponyo-rt.h).
+
+// Constants.
+Val ponyo_false      = { TY_FALSE };
+Val ponyo_true       = { TY_TRUE };
+Val ponyo_empty_list = { TY_EMPTY_LIST };
+Val ponyo_void       = { TY_VOID };
+Val ponyo_eof        = { TY_EOF };
+
+static Val* FALSE      = &ponyo_false;
+static Val* TRUE       = &ponyo_true;
+static Val* EMPTY_LIST = &ponyo_empty_list;
+static Val* VOID       = &ponyo_void;
+static Val* EOF_OBJECT = &ponyo_eof;
+
+/*------------------------------------------------------------------------------
+ | INTERPRETER STATE
+ -----------------------------------------------------------------------------*/
+
+#define HEAP_SIZE 50000
+#define ROOTS_MAX 10000
 
+typedef struct MarkWorker MarkWorker;
+typedef struct JitEntry JitEntry;
+typedef struct Capture Capture;
+typedef struct AllocProfile AllocProfile;
+typedef struct Kont Kont;
+typedef struct Thread Thread;
+typedef struct Future Future;
+typedef struct FuturePool FuturePool;
+typedef struct Reader Reader;
+typedef struct PerfFrame PerfFrame;
+
+typedef struct MarkStack {
+    Val** items;
+    int size;
+    int cap;
+} MarkStack;
+
+// Everything that belongs to one interpreter instance. Instances share no
+// mutable state, so independent instances can run on separate threads.
+struct Interp {
     // Memory management.
-    char marked;
+    Val* heap;
+    int heap_size;
+    Val* free_list;
+    // The immortal region (see `promote`), which has room for as many cells
+    // as the heap, and the cells in it that refer to cells in the heap.
+    Val* immortal;
+    int immortal_size;
+    Val* remembered;
+    // The root stack of the running thread (see `push_root`).
+    Val*** roots;
+    int roots_size;
+    // The cells this thread allocates from, once futures are in use (see
+    // `alloc_val`).
+    Val* tlab;
+    // Cells marked but not yet traced, by a collection on one thread (see
+    // `mark`).
+    MarkStack mark_stack;
+
+    // Parallel marking (see `mark_all_parallel`).
+    int gc_threads;
+    MarkWorker* mark_workers;
+    int mark_pool_started;
+    pthread_mutex_t mark_pool_lock;
+    pthread_cond_t mark_pool_start;
+    pthread_cond_t mark_pool_done;
+    unsigned mark_epoch;
+    int mark_running;
+    int mark_idle;
+    int mark_pool_stopping;
+
+    // A "table" for interned symbols.
+    Val* symbol_list;
+
+    // From SICP: "...we represent an environment as a list of frames. The
+    // enclosing environment of an environment is the `cdr` of the list. The
+    // empty environment is simply the empty list.
+    //
+    // Each frame of an environment is represented as a pair of lists: a list
+    // of the variables bound in that frame and a list of the associated
+    // values."
+    Val* global_env;
+
+    // Primitives that generated code may refer to directly.
+    Val* begin;
+    Val* quote;
+
+    // Whether loaded code is optimized (see `optimize`).
+    int optimize;
+
+    // Native code for hot procedures (see `jit_lookup`), in a hash table
+    // keyed by procedure body. The JIT is disabled if `jit_threshold` is 0.
+    int jit_threshold;
+    JitEntry** jit_entries;
+    int jit_entries_size;
+    int jit_entries_cap;
+    Val* jit_roots;
+
+    // What closures made by each nested `lambda` keep of the environment
+    // they're made in (see `closure_env`), in a hash table keyed by body.
+    Capture** captures;
+    int captures_size;
+    int captures_cap;
+
+    // The compiled program being loaded, if any (see `link_form`).
+    const PonyoProgram* program;
+    FILE* program_fp;
+    int program_forms;
+
+    // The directory files loaded by `load` are cached in (see `load_cached`),
+    // or NULL.
+    char* load_cache;
+    // Whether files are read on a thread of their own as they are loaded
+    // (see `start_reader`).
+    int pipeline;
+
+    // The continuation of the CEK machine (see `cek_eval`), if it is in use.
+    int cek;
+    Kont* kont;
+    int kont_size;
+    int kont_cap;
+
+    // Green threads (see `spawn`). The state of the running thread is kept
+    // in the fields above (`roots`, `kont`, etc.), and saved in its `Thread`
+    // when it is suspended.
+    Thread* thread;
+    Thread* threads;
+    Thread* run_queue;
+    Thread* run_queue_end;
+
+    // Futures (see `prim_future`), or NULL until the first one is made. Each
+    // thread in the pool runs code with an instance of its own, which is a
+    // copy of this one sharing its heap and global environment.
+    int future_threads;
+    FuturePool* futures;
+    // How many futures the running thread is inside (see `run_future`).
+    int future_depth;
+
+    // Allocation profile (see `profile_site`), or NULL if profiling is off.
+    AllocProfile* profile;
+    // The compound procedure whose body is running, if any.
+    Val* running;
+    // The type of record types (see `prim_make_record_type`).
+    Val* record_type;
+    // With `--perf`, the innermost frame of the shadow stack (see `PerfFrame`),
+    // and the symbol map that compiled code is listed in.
+    int perf;
+    PerfFrame* perf_frame;
+    FILE* perf_map;
+
+    // Names bound in the code being expanded (see `expand`).
+    Val** scope;
+    int scope_size;
+    int scope_cap;
+    // The top-level form being optimized (see `optimize`).
+    Val* optimizing;
+
+    // Where `display` and the REPL write to.
+    FILE* out;
+
+    // Where errors unwind to, if anywhere.
+    jmp_buf* on_error;
+    // If set, the message for an error is kept in `error` rather than
+    // reported (see `reader_main`).
+    int defer_errors;
+    char error[256];
+
+    // Limits on what each top-level form may use, 0 for none (see
+    // `budget_step`).
+    long max_steps;
+    long max_cells;
+    int max_depth;
+    long max_time;
+    // Set while a form runs under the limits, with what it has used so far.
+    // `depth` (the nesting of procedure calls) is kept up to date regardless.
+    int budgeted;
+    long steps;
+    long cells;
+    int depth;
+    // When the form's time runs out (see `now_ms`), or 0.
+    long deadline;
+    // Set if a form was abandoned for exceeding a limit since the last call
+    // to `load_protected`.
+    int over_budget;
+};
+
+typedef enum ThreadState {
+    THREAD_RUNNABLE,
+    THREAD_BLOCKED,
+    THREAD_DONE,
+    THREAD_FAILED,
+} ThreadState;
+
+struct Thread {
+    ucontext_t context;
+    // NULL for the thread the instance was created on.
+    void* stack;
+    ThreadState state;
+    Val* thunk;
+    Val* result;
+    // What a blocked thread is waiting for: a channel, or a thread it joins.
+    void* waiting_on;
+    // Set once nothing refers to the thread, so it can be freed when done.
+    int detached;
+    // Set if the thread was woken because every thread was blocked.
+    int deadlocked;
+
+    // The thread's part of the interpreter state, while it is suspended.
+    Val*** roots;
+    int roots_size;
+    jmp_buf* on_error;
+    Val* running;
+    PerfFrame* perf_frame;
+    int depth;
+    Kont* kont;
+    int kont_size;
+    int kont_cap;
+    Val** scope;
+    int scope_size;
+    int scope_cap;
+
+    Thread* next;
+    Thread* next_run;
+};
+
+typedef enum FutureState {
+    FUTURE_QUEUED,
+    FUTURE_RUNNING,
+    FUTURE_DONE,
+    FUTURE_FAILED,
+    // Failed by exceeding a budget (see `budget_step`).
+    FUTURE_OVER_BUDGET,
+} FutureState;
+
+struct Future {
+    FutureState state;
+    Val* thunk;
+    Val* value;
+    // The instance running the thunk, while it runs.
+    Interp* runner;
+    // The next future in the queue, while it is queued.
     Val* next;
+};
 
-    union {
-        // Compound procedure.
-        struct {
-            Val* params;
-            Val* body;
-            Val* env;
-        };
-        // Int.
-        int num;
-        // Pair.
-        struct {
-            Val* car;
-            Val* cdr;
-        };
-        // Primitive procedure.
-        PrimProc* proc;
-        // String or symbol.
-        char* str;
-    };
+// Guarded by `lock`, except that `stopping` may be polled.
+struct FuturePool {
+    // The instance the pool belongs to, which owns the heap.
+    Interp* main;
+    pthread_mutex_t lock;
+    // Signalled when a future finishes, a thread stops at a safepoint, or the
+    // world is resumed.
+    pthread_cond_t changed;
+    // Signalled when a future is queued, or the pool is closing.
+    pthread_cond_t work;
+    int size;
+    pthread_t* threads;
+    Interp** workers;
+    Val* queue;
+    Val* queue_end;
+    // Threads reading files for `load` (see `start_reader`).
+    Reader* readers;
+    // Threads running code in the instance, and how many of them are
+    // stopped (see `stop_world`).
+    int mutators;
+    int parked;
+    int stopping;
+    int closing;
 };
 
-// Constants.
-static Val* FALSE      = &(Val){ TY_FALSE };
-static Val* TRUE       = &(Val){ TY_TRUE };
-static Val* EMPTY_LIST = &(Val){ TY_EMPTY_LIST };
-static Val* VOID       = &(Val){ TY_VOID };
+// A thread that reads forms from a file ahead of the thread loading them
+// (see `start_reader`). Guarded by the lock of the instance's pool.
+struct Reader {
+    // The instance the thread reads with: a copy of the loading one, as the
+    // thread running a future has.
+    Interp* interp;
+    FILE* fp;
+    pthread_t thread;
+    // Forms read but not yet taken, oldest first.
+    Val* forms;
+    Val* forms_end;
+    int count;
+    // Set once the thread stops: at the end of the file, on an error
+    // (`failed`), or when asked to (`closing`).
+    int done;
+    int failed;
+    int closing;
+    Reader* next;
+};
+
+static void raise_error(Interp* interp, char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    if (interp && interp->defer_errors) {
+        vsnprintf(interp->error, sizeof(interp->error), fmt, ap);
+    } else {
+        fprintf(stderr, "error: ");
+        vfprintf(stderr, fmt, ap);
+        fprintf(stderr, "\n");
+    }
+    va_end(ap);
+    if (interp && interp->on_error) {
+        longjmp(*interp->on_error, 1);
+    }
+    exit(1);
+}
 
-// A "table" for interned symbols.
-static Val* symbol_list;
+/*------------------------------------------------------------------------------
+ | BUDGETS
+ |
+ | Limits on what one top-level form may use: evaluation steps, cells
+ | allocated, depth of nested procedure calls and wall-clock time. A form that
+ | exceeds one is abandoned with an error, and loading goes on with the next
+ | form (see `load_form_budgeted`), so that a runaway form in a batch doesn't
+ | take the rest down with it. Use is counted as code runs, and the clock is
+ | only read every `BUDGET_CLOCK_STEPS` steps.
+ -----------------------------------------------------------------------------*/
 
-// From SICP: "...we represent an environment as a list of frames. The enclosing
-// environment of an environment is the `cdr` of the list. The empty environment
-// is simply the empty list.
-//
-// Each frame of an environment is represented as a pair of lists: a list of the
-// variables bound in that frame and a list of the associated values."
-static Val* global_env;
+#define BUDGET_CLOCK_STEPS 4096
+
+// What `setjmp` returns when a form is abandoned for exceeding a limit (and
+// 1 for other errors).
+#define UNWIND_BUDGET 2
+
+static long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int has_budgets(Interp* interp) {
+    return interp->max_steps || interp->max_cells || interp->max_depth ||
+           interp->max_time;
+}
+
+// Starts counting afresh, for a form or future about to run.
+static void budget_reset(Interp* interp) {
+    interp->budgeted = has_budgets(interp);
+    interp->steps = 0;
+    interp->cells = 0;
+    interp->depth = 0;
+    interp->deadline = interp->max_time ? now_ms() + interp->max_time : 0;
+}
+
+static void over_budget(Interp* interp, char* what)
+    __attribute__((noreturn));
+
+static void over_budget(Interp* interp, char* what) {
+    fprintf(stderr, "error: %s budget exceeded\n", what);
+    if (!interp->on_error) {
+        exit(1);
+    }
+    longjmp(*interp->on_error, UNWIND_BUDGET);
+}
+
+// Counts a step taken at a `depth` of nesting. Called only while
+// `interp->budgeted` is set.
+static void budget_step(Interp* interp, int depth) {
+    interp->steps++;
+    if (interp->max_steps && interp->steps > interp->max_steps) {
+        over_budget(interp, "step");
+    }
+    if (interp->max_depth && depth > interp->max_depth) {
+        over_budget(interp, "depth");
+    }
+    if (interp->deadline && interp->steps % BUDGET_CLOCK_STEPS == 0 &&
+        now_ms() > interp->deadline) {
+        over_budget(interp, "time");
+    }
+}
 
 /*------------------------------------------------------------------------------
- | MEMORY MANAGEMENT
+ | PROBES
+ |
+ | Static probes for tracers such as `perf`, `bpftrace` and SystemTap, in the
+ | format of SystemTap's <sys/sdt.h> (which isn't always installed, so the
+ | little of it needed is spelled out here). A probe is a `nop` plus a note
+ | in the binary that says where it is and where its arguments are, so it
+ | costs next to nothing until a tracer attaches to it. Provider `ponyo`:
+ |
+ |   proc__entry(name, depth, frame)   a compound procedure is called
+ |   proc__return(name, depth, frame)  and returns (not when it is unwound)
+ |   gc__start()                       a collection starts
+ |   gc__done(freed)                   and ends, with `freed` cells freed
+ |   load__start(path)                 `load` starts reading a file
+ |   load__done(path)                  and has evaluated all of it
+ |
+ | `name` is what the procedure was defined as (see `proc_name`). With
+ | `--perf`, `frame` is the innermost frame of the shadow stack, a list of
+ | the procedures being called (innermost first) that a tracer can walk where
+ | it can't make sense of the evaluator's own stack, and code the JIT compiles
+ | is listed in the symbol map that `perf` looks for (/tmp/perf-<pid>.map).
  -----------------------------------------------------------------------------*/
 
-#define HEAP_SIZE 50000
-#define ROOTS_MAX 10000
+#if defined(__x86_64__) && defined(__ELF__)
+
+#define PROBE_NOTE(name, args)                                              \
+    "990: nop\n"                                                            \
+    ".pushsection .note.stapsdt, \"?\", \"note\"\n"                         \
+    ".balign 4\n"                                                           \
+    ".4byte 992f - 991f, 994f - 993f, 3\n"                                  \
+    "991: .asciz \"stapsdt\"\n"                                             \
+    "992: .balign 4\n"                                                      \
+    "993: .8byte 990b\n"                                                    \
+    ".8byte _.stapsdt.base\n"                                               \
+    ".8byte 0\n"                                                            \
+    ".asciz \"ponyo\"\n"                                                    \
+    ".asciz \"" #name "\"\n"                                                \
+    ".asciz \"" args "\"\n"                                                 \
+    "994: .balign 4\n"                                                      \
+    ".popsection\n"                                                         \
+    ".ifndef _.stapsdt.base\n"                                              \
+    ".pushsection .stapsdt.base, \"aG\", \"progbits\", .stapsdt.base, comdat\n"\
+    ".weak _.stapsdt.base\n"                                                \
+    ".hidden _.stapsdt.base\n"                                              \
+    "_.stapsdt.base: .space 1\n"                                            \
+    ".size _.stapsdt.base, 1\n"                                             \
+    ".popsection\n"                                                         \
+    ".endif\n"
+
+// Arguments are passed as 8-byte integers (pointers included).
+#define PROBE0(name) __asm__ __volatile__(PROBE_NOTE(name, ""))
+#define PROBE1(name, a)                                                     \
+    __asm__ __volatile__(PROBE_NOTE(name, "8@%0") :: "nor"((long)(a)))
+#define PROBE3(name, a, b, c)                                               \
+    __asm__ __volatile__(PROBE_NOTE(name, "8@%0 8@%1 8@%2")              \
+                         :: "nor"((long)(a)), "nor"((long)(b)),             \
+                            "nor"((long)(c)))
+
+#else
+
+#define PROBE0(name)
+#define PROBE1(name, a)
+#define PROBE3(name, a, b, c)
+
+#endif
+
+// A frame of the shadow stack, kept on the C stack by `run_body`, or
+// allocated by the CEK machine (see `K_RETURN`).
+struct PerfFrame {
+    const char* name;
+    PerfFrame* caller;
+};
+
+// The name of compound procedure `proc`: the variable it was first defined
+// as, which is kept in its `next` (unused by cells in use).
+static const char* proc_name(Val* proc) {
+    return proc->next ? proc->next->str : "lambda";
+}
+
+static void name_proc(Val* proc, Val* name) {
+    if (proc->ty == TY_COMP_PROC && !proc->next) {
+        proc->next = name;
+    }
+}
+
+static void perf_map_open(Interp* interp) {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+    interp->perf_map = fopen(path, "a");
+}
+
+// Lists `size` bytes of compiled code at `code` as procedure `proc`.
+static void perf_map_add(Interp* interp, void* code, size_t size, Val* proc) {
+    if (interp->perf_map) {
+        fprintf(interp->perf_map, "%lx %zx scheme:%s\n", (unsigned long)code,
+                size, proc_name(proc));
+        fflush(interp->perf_map);
+    }
+}
+
+/*------------------------------------------------------------------------------
+ | ALLOCATION PROFILING
+ |
+ | With profiling on, each cell is tagged with the site that allocated it: the
+ | C function that asked for the cell, and the compound procedure that was
+ | running at the time. Every collection counts the cells from each site that
+ | survived it, so the profile shows both what churns the heap and what fills
+ | it.
+ -----------------------------------------------------------------------------*/
+
+// Sites are numbered in 16 bits. Site 0 counts whatever doesn't fit.
+#define PROFILE_SITES_MAX 65536
+
+typedef struct AllocSite {
+    const char* fn;
+    // The procedure, or NULL for top-level code. Kept alive by the profile.
+    Val* params;
+    Val* body;
+    long allocated;
+    // Cells that survived the last collection, and the most that survived
+    // any collection.
+    long live;
+    long peak;
+} AllocSite;
+
+struct AllocProfile {
+    AllocSite* sites;
+    int size;
+    int cap;
+    // Open addressing hash table of indexes into `sites`, keyed by function
+    // and body. 0 marks an empty slot.
+    int* table;
+    int table_cap;
+    int collections;
+};
+
+static void mark(Interp* interp, Val* val);
+static void print(Interp* interp, Val* val);
+
+static AllocProfile* new_profile(void) {
+    AllocProfile* p = calloc(1, sizeof(AllocProfile));
+    assert(p);
+    p->cap = 256;
+    p->sites = calloc(p->cap, sizeof(AllocSite));
+    p->table_cap = 512;
+    p->table = calloc(p->table_cap, sizeof(int));
+    assert(p->sites && p->table);
+    p->sites[0].fn = "(other)";
+    p->size = 1;
+    return p;
+}
+
+static void free_profile(AllocProfile* p) {
+    if (p) {
+        free(p->sites);
+        free(p->table);
+        free(p);
+    }
+}
+
+static int site_slot(AllocProfile* p, const char* fn, Val* body) {
+    uintptr_t h = (uintptr_t)fn * 31 + (uintptr_t)body;
+    h ^= h >> 17;
+    int i = (int)(h & (p->table_cap - 1));
+    while (p->table[i]) {
+        AllocSite* s = &p->sites[p->table[i]];
+        if (s->fn == fn && s->body == body) {
+            break;
+        }
+        i = (i + 1) & (p->table_cap - 1);
+    }
+    return i;
+}
+
+static int add_site(AllocProfile* p, const char* fn, Val* params, Val* body) {
+    if (p->size == p->cap) {
+        p->cap *= 2;
+        p->sites = realloc(p->sites, p->cap * sizeof(AllocSite));
+        assert(p->sites);
+    }
+    int site = p->size++;
+    p->sites[site] = (AllocSite){ .fn = fn, .params = params, .body = body };
+    if (p->size * 2 > p->table_cap) {
+        p->table_cap *= 2;
+        p->table = realloc(p->table, p->table_cap * sizeof(int));
+        assert(p->table);
+        memset(p->table, 0, p->table_cap * sizeof(int));
+        for (int i = 1; i < p->size; i++) {
+            p->table[site_slot(p, p->sites[i].fn, p->sites[i].body)] = i;
+        }
+    } else {
+        p->table[site_slot(p, fn, body)] = site;
+    }
+    return site;
+}
+
+// Returns the site of an allocation requested by the C function `fn`, and
+// counts the allocation against it. (Function names are compared by address,
+// as `fn` is always some function's `__func__`.)
+static int profile_site(Interp* interp, const char* fn) {
+    AllocProfile* p = interp->profile;
+    Val* proc = interp->running;
+    Val* body = proc ? proc->body : NULL;
+    int site = p->table[site_slot(p, fn, body)];
+    if (!site && p->size < PROFILE_SITES_MAX) {
+        site = add_site(p, fn, proc ? proc->params : NULL, body);
+    }
+    p->sites[site].allocated++;
+    return site;
+}
+
+static void profile_mark(Interp* interp) {
+    AllocProfile* p = interp->profile;
+    for (int i = 1; i < p->size; i++) {
+        if (p->sites[i].body) {
+            mark(interp, p->sites[i].params);
+            mark(interp, p->sites[i].body);
+        }
+    }
+}
+
+// Counts the cells left marked by a collection.
+static void profile_census(Interp* interp) {
+    AllocProfile* p = interp->profile;
+    for (int i = 0; i < p->size; i++) {
+        p->sites[i].live = 0;
+    }
+    for (int i = 0; i < interp->heap_size; i++) {
+        if (interp->heap[i].marked) {
+            p->sites[interp->heap[i].site].live++;
+        }
+    }
+    for (int i = 0; i < p->size; i++) {
+        if (p->sites[i].live > p->sites[i].peak) {
+            p->sites[i].peak = p->sites[i].live;
+        }
+    }
+    p->collections++;
+}
+
+// Writes the procedure of `site` as the name it is bound to globally, if any.
+static void print_site_proc(Interp* interp, AllocSite* site) {
+    if (!site->body) {
+        fprintf(interp->out, "top level");
+        return;
+    }
+    Val* frame = interp->global_env->car;
+    Val* vars = frame->car;
+    Val* vals = frame->cdr;
+    for (; vars != EMPTY_LIST; vars = vars->cdr, vals = vals->cdr) {
+        if (vals->car->ty == TY_COMP_PROC && vals->car->body == site->body) {
+            fprintf(interp->out, "%s", vars->car->str);
+            return;
+        }
+    }
+    fprintf(interp->out, "(lambda ");
+    print(interp, site->params);
+    fprintf(interp->out, ")");
+}
+
+static int compare_sites(const void* a, const void* b) {
+    long x = ((const AllocSite*)a)->allocated;
+    long y = ((const AllocSite*)b)->allocated;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+// Writes the profile to `out`, busiest sites first.
+static void profile_report(Interp* interp, FILE* out) {
+    AllocProfile* p = interp->profile;
+    AllocSite* sites = malloc(p->size * sizeof(AllocSite));
+    assert(sites);
+    memcpy(sites, p->sites, p->size * sizeof(AllocSite));
+    qsort(sites, p->size, sizeof(AllocSite), compare_sites);
+
+    FILE* prev = interp->out;
+    interp->out = out;
+    fprintf(out, "allocation profile (%d collections):\n", p->collections);
+    fprintf(out, "%12s %10s %10s  site\n", "allocated", "live", "peak");
+    for (int i = 0; i < p->size && sites[i].allocated > 0; i++) {
+        fprintf(out, "%12ld %10ld %10ld  %s in ", sites[i].allocated,
+                sites[i].live, sites[i].peak, sites[i].fn);
+        print_site_proc(interp, &sites[i]);
+        fprintf(out, "\n");
+    }
+    interp->out = prev;
+    free(sites);
+}
+
+/*------------------------------------------------------------------------------
+ | MEMORY MANAGEMENT
+ -----------------------------------------------------------------------------*/
 
 #define PUSH_ROOT(v)                  \
-    push_root(&v);
+    push_root(interp, &v);
 
 #define DEF_ROOT1(v1)                 \
     Val* v1 = VOID;                   \
@@ -113,1116 +740,7882 @@ static Val* global_env;
     Val* v5 = VOID;                   \
     PUSH_ROOT(v5)
 
-#define POP_ROOT1()             pop_root();
-#define POP_ROOT2() POP_ROOT1() pop_root();
-#define POP_ROOT3() POP_ROOT2() pop_root();
-#define POP_ROOT4() POP_ROOT3() pop_root();
-#define POP_ROOT5() POP_ROOT4() pop_root();
-
-static Val heap[HEAP_SIZE];
-static Val* free_list;
+#define POP_ROOT1()             pop_root(interp);
+#define POP_ROOT2() POP_ROOT1() pop_root(interp);
+#define POP_ROOT3() POP_ROOT2() pop_root(interp);
+#define POP_ROOT4() POP_ROOT3() pop_root(interp);
+#define POP_ROOT5() POP_ROOT4() pop_root(interp);
 
-static Val** roots[ROOTS_MAX];
-static int roots_size;
-
-static void push_root(Val** val) {
-    assert(roots_size < ROOTS_MAX);
-    roots[roots_size++] = val;
+static void push_root(Interp* interp, Val** val) {
+    if (interp->roots_size == ROOTS_MAX) {
+        ERROR("root stack overflow: calls nested too deeply");
+    }
+    interp->roots[interp->roots_size++] = val;
 }
 
-static void pop_root(void) {
-    assert(roots_size > 0);
-    roots[--roots_size] = NULL;
+static void pop_root(Interp* interp) {
+    assert(interp->roots_size > 0);
+    interp->roots[--interp->roots_size] = NULL;
 }
 
-static void mark(Val* val) {
-    if (val->marked) { return; }
-    val->marked = 1;
-    if (val->ty == TY_COMP_PROC) {
-        mark(val->params);
-        mark(val->body);
-        mark(val->env);
-    } else if (val->ty == TY_PAIR) {
-        mark(val->car);
-        mark(val->cdr);
-    }
+// Constants live outside the heap and have no children, so they are never
+// marked. (They are also shared between interpreter instances.)
+static int is_heap_val(Interp* interp, Val* val) {
+    return val >= interp->heap && val < interp->heap + interp->heap_size;
 }
 
-static void mark_all(void) {
-    for (int i = 0; i < roots_size; i++) {
-        mark(*roots[i]);
+static void mark_stack_push(MarkStack* stack, Val* val) {
+    if (stack->size == stack->cap) {
+        stack->cap = stack->cap ? stack->cap * 2 : 1024;
+        stack->items = realloc(stack->items, stack->cap * sizeof(Val*));
+        assert(stack->items);
     }
+    stack->items[stack->size++] = val;
 }
 
-static void free_val(Val* val) {
-    val->next = free_list;
-    free_list = val;
-}
-
-static void sweep(void) {
-    free_list = NULL;
-    for (int i = 0; i < HEAP_SIZE; i++) {
-        Val* val = &heap[i];
-        if (!val->marked) {
-            if (val->ty == TY_STRING || val->ty == TY_SYMBOL) {
-                free(val->str);
-            }
-            free_val(val);
-        } else {
-            val->marked = 0;
+static void mark_push_children(MarkStack* stack, Val* val) {
+    if (val->ty == TY_COMP_PROC || val->ty == TY_MACRO) {
+        mark_stack_push(stack, val->params);
+        mark_stack_push(stack, val->body);
+        mark_stack_push(stack, val->env);
+    } else if (val->ty == TY_GUARD) {
+        mark_stack_push(stack, val->deps);
+        mark_stack_push(stack, val->fast);
+        mark_stack_push(stack, val->slow);
+    } else if (val->ty == TY_PAIR) {
+        mark_stack_push(stack, val->car);
+        mark_stack_push(stack, val->cdr);
+    } else if (val->ty == TY_CHANNEL) {
+        mark_stack_push(stack, val->items);
+    } else if (val->ty == TY_THREAD && val->thread) {
+        mark_stack_push(stack, val->thread->thunk);
+        mark_stack_push(stack, val->thread->result);
+    } else if (val->ty == TY_FUTURE && val->future) {
+        mark_stack_push(stack, val->future->thunk);
+        mark_stack_push(stack, val->future->value);
+    } else if (val->ty == TY_PROMISE) {
+        mark_stack_push(stack, val->promise);
+    } else if (val->ty == TY_RECORD) {
+        mark_stack_push(stack, val->type);
+        for (int i = 0; i < val->slots_size; i++) {
+            mark_stack_push(stack, val->slots[i]);
         }
     }
 }
 
-static Val* alloc_val(Type ty) {
-    if (!free_list) {
-        mark_all();
-        sweep();
-        if (!free_list) {
-            ERROR("heap exhausted");
+// Traces the cells on the mark stack. The stack is explicit, rather than the C
+// stack, so that deeply nested data can be collected too.
+static void mark_stack_drain(Interp* interp) {
+    MarkStack* stack = &interp->mark_stack;
+    while (stack->size > 0) {
+        Val* val = stack->items[--stack->size];
+        if (is_heap_val(interp, val) && !val->marked) {
+            val->marked = 1;
+            mark_push_children(stack, val);
         }
     }
-    Val* val = free_list;
-    free_list = free_list->next;
-    val->ty = ty;
-    val->marked = 0;
-    val->next = NULL;
-    return val;
 }
 
-static void init_heap(void) {
-    free_list = NULL;
-    for (int i = 0; i < HEAP_SIZE; i++) {
-        free_val(&heap[i]);
-    }
+static void mark(Interp* interp, Val* val) {
+    mark_stack_push(&interp->mark_stack, val);
+    mark_stack_drain(interp);
+}
+
+static void mark_children(Interp* interp, Val* val) {
+    mark_push_children(&interp->mark_stack, val);
+    mark_stack_drain(interp);
 }
 
 /*------------------------------------------------------------------------------
- | CONSTRUCTORS
+ | PARALLEL MARKING
+ |
+ | With more than one GC thread, marking is split between a pool of workers
+ | while the mutator is stopped (the mutator thread itself acts as worker 0).
+ | Each worker drains a private mark stack, and periodically spills half of it
+ | to a shared deque so that idle workers have something to steal. Cells are
+ | claimed with an atomic exchange on the mark bit, so each cell is traced by
+ | exactly one worker.
  -----------------------------------------------------------------------------*/
 
-static Val* make_comp_proc(Val* params, Val* body, Val* env) {
-    Val* val = alloc_val(TY_COMP_PROC);
-    val->params = params;
-    val->body = body;
-    val->env = env;
-    return val;
-}
+#define GC_THREADS_MAX 64
+#define MARK_SPILL     256
+
+struct MarkWorker {
+    Interp* interp;
+    int id;
+    pthread_t thread;
+    MarkStack local;
+    // Work that may be stolen by other workers. Guarded by `lock`, except for
+    // `available`, which mirrors `shared.size` so that it can be polled.
+    pthread_mutex_t lock;
+    MarkStack shared;
+    int available;
+};
 
-static Val* make_int(int num) {
-    Val* val = alloc_val(TY_INT);
-    val->num = num;
-    return val;
+// Claims `val` for the calling worker. Returns 1 if the worker is responsible
+// for tracing its children.
+static int mark_claim(Interp* interp, Val* val) {
+    if (!is_heap_val(interp, val) ||
+        __atomic_load_n(&val->marked, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+    return !__atomic_exchange_n(&val->marked, 1, __ATOMIC_ACQ_REL);
 }
 
-static Val* cons(Val* car, Val* cdr) {
-    Val* val = alloc_val(TY_PAIR);
-    val->car = car;
-    val->cdr = cdr;
-    return val;
+// Moves the older half of the local stack to the shared deque.
+static void mark_spill(MarkWorker* w) {
+    int half = w->local.size / 2;
+    pthread_mutex_lock(&w->lock);
+    for (int i = 0; i < half; i++) {
+        mark_stack_push(&w->shared, w->local.items[i]);
+    }
+    __atomic_store_n(&w->available, w->shared.size, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&w->lock);
+    memmove(w->local.items, w->local.items + half,
+            (w->local.size - half) * sizeof(Val*));
+    w->local.size -= half;
 }
 
-static Val* make_prim_proc(PrimProc* proc) {
-    Val* val = alloc_val(TY_PRIM_PROC);
-    val->proc = proc;
-    return val;
+// Takes up to half of the shared work of `victim`. Returns 1 on success.
+static int mark_steal(MarkWorker* self, MarkWorker* victim) {
+    if (__atomic_load_n(&victim->available, __ATOMIC_ACQUIRE) == 0) {
+        return 0;
+    }
+    pthread_mutex_lock(&victim->lock);
+    int n = (victim->shared.size + 1) / 2;
+    for (int i = 0; i < n; i++) {
+        mark_stack_push(&self->local,
+                        victim->shared.items[--victim->shared.size]);
+    }
+    __atomic_store_n(&victim->available, victim->shared.size, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&victim->lock);
+    return n > 0;
 }
 
-static Val* make_string_or_symbol(Type ty, char* str) {
-    assert(ty == TY_STRING || ty == TY_SYMBOL);
-    Val* val = alloc_val(ty);
-    val->str = (char*)malloc(strlen(str) + 1);
-    assert(val->str);
-    strcpy(val->str, str);
-    return val;
+static int mark_find_work(MarkWorker* self) {
+    Interp* interp = self->interp;
+    for (int i = 0; i < interp->gc_threads; i++) {
+        int victim = (self->id + i) % interp->gc_threads;
+        if (mark_steal(self, &interp->mark_workers[victim])) {
+            return 1;
+        }
+    }
+    return 0;
 }
 
-// Returns a symbol if it has already been interned, creates (and interns) it
-// otherwise.
-static Val* intern_symbol(char* str) {
-    for (Val* s = symbol_list; s != EMPTY_LIST; s = s->cdr) {
-        if (strcmp(str, s->car->str) == 0) {
-            return s->car;
+static void mark_drain(MarkWorker* self) {
+    Interp* interp = self->interp;
+    for (;;) {
+        while (self->local.size > 0) {
+            Val* val = self->local.items[--self->local.size];
+            if (mark_claim(interp, val)) {
+                mark_push_children(&self->local, val);
+            }
+            if (self->local.size > MARK_SPILL) {
+                mark_spill(self);
+            }
+        }
+        if (mark_find_work(self)) {
+            continue;
+        }
+        // Out of work. Marking is complete once every worker is idle at the
+        // same time, because only busy workers can produce new work.
+        __atomic_add_fetch(&interp->mark_idle, 1, __ATOMIC_ACQ_REL);
+        for (;;) {
+            int idle = __atomic_load_n(&interp->mark_idle, __ATOMIC_ACQUIRE);
+            if (idle == interp->gc_threads) {
+                return;
+            }
+            int found = 0;
+            for (int i = 0; i < interp->gc_threads && !found; i++) {
+                found = __atomic_load_n(&interp->mark_workers[i].available,
+                                        __ATOMIC_ACQUIRE) > 0;
+            }
+            if (found) {
+                __atomic_sub_fetch(&interp->mark_idle, 1, __ATOMIC_ACQ_REL);
+                break;
+            }
+            sched_yield();
         }
     }
-    DEF_ROOT1(sym);
-    sym = make_string_or_symbol(TY_SYMBOL, str);
-    symbol_list = cons(sym, symbol_list);
-    POP_ROOT1();
-    return sym;
 }
 
-/*------------------------------------------------------------------------------
- | PARSER
- -----------------------------------------------------------------------------*/
-
-#define STRING_MAX_LEN 2000
-#define SYMBOL_MAX_LEN 200
-
-const char extended_symbols[] = "!$%&*+-./:<=>?@^_~";
-
-static Val* read_c(FILE* fp, int c);
-static Val* read(FILE* fp);
+static void* mark_worker_main(void* arg) {
+    MarkWorker* self = arg;
+    Interp* interp = self->interp;
+    unsigned seen = 0;
+    for (;;) {
+        pthread_mutex_lock(&interp->mark_pool_lock);
+        while (interp->mark_epoch == seen && !interp->mark_pool_stopping) {
+            pthread_cond_wait(&interp->mark_pool_start,
+                              &interp->mark_pool_lock);
+        }
+        if (interp->mark_pool_stopping) {
+            pthread_mutex_unlock(&interp->mark_pool_lock);
+            return NULL;
+        }
+        seen = interp->mark_epoch;
+        pthread_mutex_unlock(&interp->mark_pool_lock);
 
-static int peek(FILE* fp) {
-    int c = getc(fp);
-    ungetc(c, fp);
-    return c;
-}
+        mark_drain(self);
 
-static int get_non_whitespace_char(FILE* fp) {
-    for (;;) {
-        int c = getc(fp);
-        if (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
-            continue;
-        } else if (c == ';') {
-            do {
-                c = getc(fp);
-            } while (c != '\n' && c != EOF);
-        } else {
-            return c;
+        pthread_mutex_lock(&interp->mark_pool_lock);
+        if (--interp->mark_running == 0) {
+            pthread_cond_signal(&interp->mark_pool_done);
         }
+        pthread_mutex_unlock(&interp->mark_pool_lock);
     }
 }
 
-// Assumes a '#' has already been read.
-static Val* read_bool(FILE* fp) {
-    int c = getc(fp);
-    switch (c) {
-    case EOF:
-        ERROR("invalid '#' prefix");
-    case 'f':
-        return FALSE;
-    case 't':
-        return TRUE;
-    default:
-        ERROR("invalid '#%c' prefix", c);
+static void start_mark_pool(Interp* interp) {
+    interp->mark_workers = calloc(interp->gc_threads, sizeof(MarkWorker));
+    assert(interp->mark_workers);
+    pthread_mutex_init(&interp->mark_pool_lock, NULL);
+    pthread_cond_init(&interp->mark_pool_start, NULL);
+    pthread_cond_init(&interp->mark_pool_done, NULL);
+    for (int i = 0; i < interp->gc_threads; i++) {
+        MarkWorker* w = &interp->mark_workers[i];
+        w->interp = interp;
+        w->id = i;
+        pthread_mutex_init(&w->lock, NULL);
+    }
+    for (int i = 1; i < interp->gc_threads; i++) {
+        MarkWorker* w = &interp->mark_workers[i];
+        if (pthread_create(&w->thread, NULL, mark_worker_main, w) != 0) {
+            ERROR("could not start GC thread");
+        }
     }
+    interp->mark_pool_started = 1;
 }
 
-static int read_int(FILE* fp, int num) {
-    while (isdigit(peek(fp))) {
-        num = num * 10 + (getc(fp) - '0');
+static void stop_mark_pool(Interp* interp) {
+    if (!interp->mark_pool_started) {
+        return;
     }
-    return num;
+    pthread_mutex_lock(&interp->mark_pool_lock);
+    interp->mark_pool_stopping = 1;
+    pthread_cond_broadcast(&interp->mark_pool_start);
+    pthread_mutex_unlock(&interp->mark_pool_lock);
+    for (int i = 0; i < interp->gc_threads; i++) {
+        MarkWorker* w = &interp->mark_workers[i];
+        if (i > 0) {
+            pthread_join(w->thread, NULL);
+        }
+        pthread_mutex_destroy(&w->lock);
+        free(w->local.items);
+        free(w->shared.items);
+    }
+    free(interp->mark_workers);
+    pthread_mutex_destroy(&interp->mark_pool_lock);
+    pthread_cond_destroy(&interp->mark_pool_start);
+    pthread_cond_destroy(&interp->mark_pool_done);
+    // It's started again by the next parallel collection, with workers that
+    // wait for the epoch to move on from 0.
+    interp->mark_pool_started = 0;
+    interp->mark_pool_stopping = 0;
+    interp->mark_epoch = 0;
+    interp->mark_running = 0;
+    interp->mark_idle = 0;
 }
 
-// Assumes a '(' has already been read, and that `c` is a non-whitespace
-// character.
-static Val* read_pair(FILE* fp, int c) {
-    if (c == EOF) {
-        ERROR("unterminated list");
-    } else if (c == ')') {
-        return EMPTY_LIST;
+static void mark_all_parallel(Interp* interp) {
+    if (!interp->mark_pool_started) {
+        start_mark_pool(interp);
+    }
+    // Distribute the roots round-robin so every worker starts with some work.
+    for (int i = 0; i < interp->roots_size; i++) {
+        MarkWorker* w = &interp->mark_workers[i % interp->gc_threads];
+        mark_stack_push(&w->shared, *interp->roots[i]);
+    }
+    int i = 0;
+    for (Val* r = interp->remembered; r != VOID; r = r->next, i++) {
+        MarkWorker* w = &interp->mark_workers[i % interp->gc_threads];
+        mark_push_children(&w->shared, r);
     }
+    for (int i = 0; i < interp->gc_threads; i++) {
+        MarkWorker* w = &interp->mark_workers[i];
+        w->available = w->shared.size;
+    }
+    interp->mark_idle = 0;
 
-    DEF_ROOT2(car, cdr);
-    // NULL check unnecessary due to earlier EOF check.
-    car = read_c(fp, c);
-    c = get_non_whitespace_char(fp);
-    if (c == '.') {
-        // NULL check unnecessary due to subsequent ')' check.
-        cdr = read(fp);
-        if (get_non_whitespace_char(fp) != ')') {
-            ERROR("expected list terminator");
-        }
-    } else {
-        cdr = read_pair(fp, c);
+    pthread_mutex_lock(&interp->mark_pool_lock);
+    interp->mark_running = interp->gc_threads - 1;
+    interp->mark_epoch++;
+    pthread_cond_broadcast(&interp->mark_pool_start);
+    pthread_mutex_unlock(&interp->mark_pool_lock);
+
+    mark_drain(&interp->mark_workers[0]);
+
+    pthread_mutex_lock(&interp->mark_pool_lock);
+    while (interp->mark_running > 0) {
+        pthread_cond_wait(&interp->mark_pool_done, &interp->mark_pool_lock);
     }
-    Val* pair = cons(car, cdr);
-    POP_ROOT2();
-    return pair;
+    pthread_mutex_unlock(&interp->mark_pool_lock);
 }
 
-static Val* read_quote(FILE* fp) {
-    DEF_ROOT2(sym, quote);
-    sym = intern_symbol("quote");
-    quote = read(fp);
-    if (!quote) {
-        ERROR("unexpected EOF reading quote");
+static void kont_mark(Interp* interp, Kont* kont, int kont_size);
+static void threads_mark(Interp* interp);
+
+static void prune_remembered(Interp* interp);
+
+static void mark_all(Interp* interp) {
+    PROBE0(gc__start);
+    if (interp->profile) {
+        profile_mark(interp);
+    }
+    prune_remembered(interp);
+    if (interp->kont_size > 0) {
+        kont_mark(interp, interp->kont, interp->kont_size);
+    }
+    if (interp->threads) {
+        threads_mark(interp);
+    }
+    if (interp->gc_threads > 1) {
+        mark_all_parallel(interp);
+        return;
+    }
+    for (int i = 0; i < interp->roots_size; i++) {
+        mark(interp, *interp->roots[i]);
+    }
+    for (Val* r = interp->remembered; r != VOID; r = r->next) {
+        mark_children(interp, r);
     }
-    quote = cons(quote, EMPTY_LIST);
-    quote = cons(sym, quote);
-    POP_ROOT2();
-    return quote;
 }
 
-static Val* read_string(FILE* fp) {
-    char buffer[STRING_MAX_LEN + 1];
-    int i = 0;
-    for (int c = getc(fp); c != '"'; c = getc(fp)) {
-        if (c == EOF) {
-            ERROR("unterminated string");
-        } else if (c == '\\') {
-            c = getc(fp);
-            switch (c) {
-            case 't':
-                c = '\t';
-                break;
-            case 'r':
-                c = '\r';
-                break;
-            case 'n':
-                c = '\n';
-                break;
-            default:
-                break;
-            }
-        }
-        if (i < STRING_MAX_LEN) {
-            buffer[i++] = c;
+static void free_val(Interp* interp, Val* val) {
+    val->next = interp->free_list;
+    interp->free_list = val;
+}
+
+static void detach_thread(Thread* t);
+
+static void free_val_data(Val* val) {
+    if (val->ty == TY_STRING || val->ty == TY_SYMBOL) {
+        free(val->str);
+        val->str = NULL;
+    } else if (val->ty == TY_PORT && val->fp) {
+        fclose(val->fp);
+        free(val->buf);
+        val->fp = NULL;
+    } else if (val->ty == TY_THREAD && val->thread) {
+        detach_thread(val->thread);
+        val->thread = NULL;
+    } else if (val->ty == TY_FUTURE) {
+        free(val->future);
+        val->future = NULL;
+    } else if (val->ty == TY_RECORD) {
+        free(val->slots);
+        val->slots = NULL;
+    } else if (val->ty == TY_BYTEVECTOR) {
+        free(val->bytes);
+        val->bytes = NULL;
+    }
+}
+
+static void capture_sweep(Interp* interp);
+
+static void sweep(Interp* interp) {
+    if (interp->profile) {
+        profile_census(interp);
+    }
+    if (interp->captures_size > 0) {
+        capture_sweep(interp);
+    }
+    interp->free_list = NULL;
+    int freed = 0;
+    for (int i = 0; i < interp->heap_size; i++) {
+        Val* val = &interp->heap[i];
+        if (!val->marked) {
+            free_val_data(val);
+            free_val(interp, val);
+            freed++;
         } else {
-            ERROR("string too long");
+            val->marked = 0;
         }
     }
-    buffer[i] = '\0';
-    return make_string_or_symbol(TY_STRING, buffer);
+    PROBE1(gc__done, freed);
 }
 
-static Val* read_symbol(FILE* fp, int c) {
-    char buffer[SYMBOL_MAX_LEN + 1];
-    buffer[0] = c;
-    int i = 1;
-    while (isalnum(peek(fp)) || strchr(extended_symbols, peek(fp))) {
-        if (i < SYMBOL_MAX_LEN) {
-            buffer[i++] = getc(fp);
-        } else {
-            ERROR("identifier too long")
+static void heap_dump(Interp* interp, FILE* out);
+
+/*------------------------------------------------------------------------------
+ | IMMORTAL REGION
+ |
+ | Code that is loaded to stay, the top-level definitions, is copied out of
+ | the heap into a region of its own once it has been expanded and optimized,
+ | along with the constants quoted in it. Nothing in the region is ever marked
+ | or swept (to the collector, its cells are like the constants), so the work
+ | of a collection grows with the data the program has, not with its size.
+ |
+ | Symbols stay in the heap, and are never collected anyway. A cell in the
+ | region that refers to some other cell in the heap (a guard's bindings, a
+ | procedure put in code by a macro, or whatever `set-car!` stores in a quoted
+ | list) is "remembered": kept on a list whose cells' children are marked like
+ | roots. Anything that changes a cell that might be in the region goes
+ | through `write_barrier` to keep the list up to date.
+ -----------------------------------------------------------------------------*/
+
+static int is_immortal(Interp* interp, Val* val) {
+    return val >= interp->immortal &&
+           val < interp->immortal + interp->heap_size;
+}
+
+// Whether `val` (in the region) refers to a cell in the heap other than a
+// symbol.
+static int refers_to_heap(Interp* interp, Val* val) {
+    Val* kids[3];
+    int n = 0;
+    if (val->ty == TY_PAIR) {
+        kids[n++] = val->car;
+        kids[n++] = val->cdr;
+    } else if (val->ty == TY_GUARD) {
+        kids[n++] = val->deps;
+        kids[n++] = val->fast;
+        kids[n++] = val->slow;
+    }
+    for (int i = 0; i < n; i++) {
+        if (is_heap_val(interp, kids[i]) && kids[i]->ty != TY_SYMBOL) {
+            return 1;
         }
     }
-    buffer[i] = '\0';
-    return intern_symbol(buffer);
+    return 0;
 }
 
-static Val* read_c(FILE* fp, int c) {
-    if (c == EOF) {
-        return NULL;
+// Adds `val`, a cell in the region, to the remembered list, which is linked
+// through `next` (otherwise unused there) and ends in VOID.
+static void remember(Interp* interp, Val* val) {
+    FuturePool* pool = interp->futures;
+    Interp* owner = pool ? pool->main : interp;
+    if (pool) {
+        pthread_mutex_lock(&pool->lock);
     }
-    if (c == '#') {
-        return read_bool(fp);
+    if (!val->next) {
+        val->next = owner->remembered;
+        owner->remembered = val;
     }
-    if (c == '"') {
-        return read_string(fp);
+    if (pool) {
+        pthread_mutex_unlock(&pool->lock);
     }
-    if (c == '(') {
-        return read_pair(fp, get_non_whitespace_char(fp));
+}
+
+// Called when `val` is stored in a field of `cell`.
+static void write_barrier(Interp* interp, Val* cell, Val* val) {
+    if (is_immortal(interp, cell) && is_heap_val(interp, val) &&
+        val->ty != TY_SYMBOL && !cell->next) {
+        remember(interp, cell);
     }
-    if (c == '\'') {
-        return read_quote(fp);
+}
+
+// Drops the cells that no longer refer to the heap from the remembered list.
+static void prune_remembered(Interp* interp) {
+    Val** p = &interp->remembered;
+    while (*p != VOID) {
+        Val* r = *p;
+        if (refers_to_heap(interp, r)) {
+            p = &r->next;
+        } else {
+            *p = r->next;
+            r->next = NULL;
+        }
     }
-    if (isdigit(c)) {
-        return make_int(read_int(fp, c - '0'));
+}
+
+typedef struct Promotion {
+    // The heap cells copied, each with `next` pointing to its copy until the
+    // promotion is done.
+    Val** copied;
+    int size;
+    int cap;
+} Promotion;
+
+// The copy of `val` in the region, made if need be. Values that aren't
+// copied (symbols, procedures and the like) are returned as they are.
+static Val* promote_val(Interp* interp, Promotion* p, Val* val) {
+    if (!is_heap_val(interp, val) ||
+        !(val->ty & (TY_PAIR | TY_INT | TY_STRING | TY_GUARD))) {
+        return val;
     }
-    if (c == '-' && isdigit(peek(fp))) {
-        return make_int(-read_int(fp, getc(fp) - '0'));
+    if (val->next) {
+        return val->next;
     }
-    if (isalpha(c) || strchr(extended_symbols, c)) {
-        return read_symbol(fp, c);
+    if (interp->immortal_size == interp->heap_size) {
+        return val;
     }
-    ERROR("unexpected character '%c'", c);
+    Val* copy = &interp->immortal[interp->immortal_size++];
+    *copy = *val;
+    copy->marked = 0;
+    copy->site = 0;
+    copy->next = NULL;
+    if (p->size == p->cap) {
+        p->cap = p->cap ? p->cap * 2 : 256;
+        p->copied = realloc(p->copied, p->cap * sizeof(Val*));
+        assert(p->copied);
+    }
+    p->copied[p->size++] = val;
+    val->next = copy;
+    if (val->ty == TY_STRING) {
+        copy->str = strdup(val->str);
+        assert(copy->str);
+    } else if (val->ty == TY_PAIR) {
+        copy->car = promote_val(interp, p, val->car);
+        copy->cdr = promote_val(interp, p, val->cdr);
+    } else if (val->ty == TY_GUARD) {
+        // The bindings must stay the ones in the environment.
+        copy->fast = promote_val(interp, p, val->fast);
+        copy->slow = promote_val(interp, p, val->slow);
+    }
+    if (refers_to_heap(interp, copy)) {
+        remember(interp, copy);
+    }
+    return copy;
 }
 
-static Val* read(FILE* fp) {
-    int c = get_non_whitespace_char(fp);
-    return read_c(fp, c);
+// Returns `form` (a top-level form, ready to evaluate) copied into the
+// region. The copy is only as deep as the region has room for.
+static Val* promote(Interp* interp, Val* form) {
+    Promotion p = { 0 };
+    Val* copy = promote_val(interp, &p, form);
+    for (int i = 0; i < p.size; i++) {
+        p.copied[i]->next = NULL;
+    }
+    free(p.copied);
+    return copy;
 }
 
-/*------------------------------------------------------------------------------
- | LIST HELPERS
- -----------------------------------------------------------------------------*/
-
-// Returns the length of a proper list. Returns -1 if the argument is not a list
-// or is an improper list.
-static int len(Val* list) {
-    int len = 0;
-    for (; list->ty == TY_PAIR; list = list->cdr) {
-        len++;
+static int init_immortal(Interp* interp) {
+    interp->remembered = VOID;
+    interp->immortal = mmap(NULL, interp->heap_size * sizeof(Val),
+                            PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (interp->immortal == MAP_FAILED) {
+        interp->immortal = NULL;
+        return 0;
     }
-    // -1 if list is improper.
-    return list == EMPTY_LIST ? len : -1;
+    return 1;
 }
 
-// Destructively reverses a list.
-static Val* rev(Val* list) {
-    Val* prev = EMPTY_LIST;
-    while (list != EMPTY_LIST) {
-        Val* next = list->cdr;
-        list->cdr = prev;
-        prev = list;
-        list = next;
+static void free_immortal(Interp* interp) {
+    if (!interp->immortal) {
+        return;
     }
-    return prev;
+    for (int i = 0; i < interp->immortal_size; i++) {
+        if (interp->immortal[i].ty == TY_STRING) {
+            free(interp->immortal[i].str);
+        }
+    }
+    munmap(interp->immortal, interp->heap_size * sizeof(Val));
 }
 
 /*------------------------------------------------------------------------------
- | ENVIRONMENT
+ | SAFEPOINTS
+ |
+ | Once futures are in use (see `prim_future`), several threads allocate from
+ | the heap at once. Each takes cells off the free list a batch at a time, into
+ | a thread-local allocation buffer (`tlab`), so that the lock on the free list
+ | is only taken once per batch. A thread that finds the free list empty stops
+ | the world to collect: it waits until every other thread running code in the
+ | instance has parked at a safepoint (its next allocation, or a wait for a
+ | future), then marks from all of their roots. The cells left in their
+ | buffers are swept back onto the free list with the rest.
  -----------------------------------------------------------------------------*/
 
-static Val* extend_env(Val* vars, Val* vals, Val* env) {
-    assert(len(vars) == len(vals));
-    DEF_ROOT1(ext_env);
-    ext_env = cons(vars, vals);
-    ext_env = cons(ext_env, env);
-    POP_ROOT1();
-    return ext_env;
+#define TLAB_SIZE 256
+
+// Waits for `pool->changed`, as a thread that collections can go ahead
+// without. `pool->lock` must be held.
+static void pool_wait(FuturePool* pool) {
+    pool->parked++;
+    pthread_cond_broadcast(&pool->changed);
+    do {
+        pthread_cond_wait(&pool->changed, &pool->lock);
+    } while (pool->stopping);
+    pool->parked--;
 }
 
-static Val* lookup_variable(Val* var, Val* env) {
-    for (; env != EMPTY_LIST; env = env->cdr) {
-        Val* frame = env->car;
-        Val* vars = frame->car;
-        Val* vals = frame->cdr;
-        for (; vars != EMPTY_LIST; vars = vars->cdr, vals = vals->cdr) {
-            // Note: `strcmp` is unnecessary. Symbols are interned, so
-            // pointer comparison is sufficient.
-            if (var == vars->car) {
-                return vals->car;
-            }
-        }
+// Waits until every other thread running code in the instance has parked.
+// `pool->lock` must be held, and is held until `resume_world`.
+static void stop_world(FuturePool* pool) {
+    while (pool->stopping) {
+        pool_wait(pool);
+    }
+    __atomic_store_n(&pool->stopping, 1, __ATOMIC_RELAXED);
+    pool->parked++;
+    while (pool->parked < pool->mutators) {
+        pthread_cond_wait(&pool->changed, &pool->lock);
     }
-    ERROR("unbound variable: %s", var->str);
 }
 
-static void add_binding(Val* var, Val* val, Val* frame) {
-    frame->car = cons(var, frame->car);
-    frame->cdr = cons(val, frame->cdr);
+static void resume_world(FuturePool* pool) {
+    pool->parked--;
+    __atomic_store_n(&pool->stopping, 0, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&pool->changed);
 }
 
-static void define_variable(Val* var, Val* val, Val* env) {
-    Val* first_frame = env->car;
-    Val* vars = first_frame->car;
-    Val* vals = first_frame->cdr;
-    for (; vars != EMPTY_LIST; vars = vars->cdr, vals = vals->cdr) {
-        if (var == vars->car) {
-            vals->car = val;
-            return;
-        }
+// Marks from the roots of `w`, a copy of `main` on another thread, and takes
+// back its buffer.
+static void mark_worker(Interp* main, Interp* w) {
+    w->tlab = NULL;
+    for (int j = 0; j < w->roots_size; j++) {
+        mark(main, *w->roots[j]);
     }
-    add_binding(var, val, first_frame);
+    kont_mark(main, w->kont, w->kont_size);
 }
 
-static void set_variable(Val* var, Val* val, Val* env) {
-    for (; env != EMPTY_LIST; env = env->cdr) {
-        Val* frame = env->car;
-        Val* vars = frame->car;
-        Val* vals = frame->cdr;
-        for (; vars != EMPTY_LIST; vars = vars->cdr, vals = vals->cdr) {
-            if (var == vars->car) {
-                vals->car = val;
-                return;
-            }
-        }
+// Collects with the world stopped, from the roots of every thread.
+static void collect_stopped(FuturePool* pool) {
+    Interp* main = pool->main;
+    main->tlab = NULL;
+    for (int i = 0; i < pool->size; i++) {
+        mark_worker(main, pool->workers[i]);
     }
-    ERROR("unbound variable: %s", var->str);
+    for (Reader* r = pool->readers; r; r = r->next) {
+        mark_worker(main, r->interp);
+        mark(main, r->forms);
+    }
+    for (Val* f = pool->queue; f; f = f->future->next) {
+        mark(main, f);
+    }
+    mark_all(main);
+    sweep(main);
 }
 
-/*------------------------------------------------------------------------------
- | EVALUATOR
- -----------------------------------------------------------------------------*/
-
-static Val* eval(Val* val, Val* env);
+static void collect(Interp* interp) {
+    FuturePool* pool = interp->futures;
+    if (!pool) {
+        mark_all(interp);
+        sweep(interp);
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    stop_world(pool);
+    collect_stopped(pool);
+    resume_world(pool);
+    pthread_mutex_unlock(&pool->lock);
+}
 
-static Val* apply(Val* proc, Val* args, Val* env) {
-    if (proc->ty == TY_PRIM_PROC) {
-        return proc->proc(args, env);
-    } else if (proc->ty == TY_COMP_PROC) {
-        Val* params = proc->params;
-        DEF_ROOT5(vars, vals, temp, penv, result);
-
-        vars = EMPTY_LIST;
-        vals = EMPTY_LIST;
-        // Extend the base environment carried by the procedure to include a
-        // frame that binds the parameters of the procedure to the arguments
-        // to which the procedure is to be applied.
-        for (; params->ty == TY_PAIR; args = args->cdr, params = params->cdr) {
-            if (args == EMPTY_LIST) {
-                ERROR("too few arguments to procedure");
-            }
-            vars = cons(params->car, vars);
-            temp = eval(args->car, env);
-            vals = cons(temp, vals);
-        }
-        // Handle improper lists (i.e. variable arity procedures).
-        if (params != EMPTY_LIST) {
-            vars = cons(params, vars);
-            vars = rev(vars);
-
-            DEF_ROOT1(varargs);
-            varargs = EMPTY_LIST;
-            for (; args != EMPTY_LIST; args = args->cdr) {
-                temp = eval(args->car, env);
-                varargs = cons(temp, varargs);
-            }
-            varargs = rev(varargs);
-            vals = cons(varargs, vals);
-            vals = rev(vals);
-            POP_ROOT1();
-        } else {
-            if (args != EMPTY_LIST) {
-                ERROR("too many arguments to procedure");
-            }
+// Gives the calling thread a new batch of cells, collecting if the free list
+// is empty. Also where a thread parks if a collection is waiting for it.
+static void refill_tlab(Interp* interp) {
+    FuturePool* pool = interp->futures;
+    Interp* main = pool->main;
+    pthread_mutex_lock(&pool->lock);
+    while (pool->stopping) {
+        pool_wait(pool);
+    }
+    if (!interp->tlab && !main->free_list) {
+        stop_world(pool);
+        collect_stopped(pool);
+        if (!main->free_list) {
+            heap_dump(main, stderr);
+            resume_world(pool);
+            pthread_mutex_unlock(&pool->lock);
+            ERROR("heap exhausted");
         }
+        resume_world(pool);
+    }
+    if (!interp->tlab) {
+        Val* last = main->free_list;
+        for (int i = 1; i < TLAB_SIZE && last->next; i++) {
+            last = last->next;
+        }
+        interp->tlab = main->free_list;
+        main->free_list = last->next;
+        last->next = NULL;
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
 
-        penv = extend_env(vars, vals, proc->env);
-        // Evaluate the expressions in the procedure body, returning the
-        // result of the final expression.
-        for (Val* b = proc->body; b != EMPTY_LIST; b = b->cdr) {
-            result = eval(b->car, penv);
+// `site` is the C function the cell is allocated for.
+static Val* alloc_val(Interp* interp, Type ty, const char* site) {
+    Val* val;
+    if (interp->budgeted && interp->max_cells &&
+        ++interp->cells > interp->max_cells) {
+        over_budget(interp, "allocation");
+    }
+    if (interp->futures) {
+        if (!interp->tlab ||
+            __atomic_load_n(&interp->futures->stopping, __ATOMIC_RELAXED)) {
+            refill_tlab(interp);
         }
-        POP_ROOT5();
-        return result;
+        val = interp->tlab;
+        interp->tlab = val->next;
     } else {
-        ERROR("unknown procedure type");
+        if (!interp->free_list) {
+            mark_all(interp);
+            sweep(interp);
+            if (!interp->free_list) {
+                heap_dump(interp, stderr);
+                ERROR("heap exhausted");
+            }
+        }
+        val = interp->free_list;
+        interp->free_list = val->next;
     }
+    val->ty = ty;
+    val->marked = 0;
+    val->site = interp->profile ? profile_site(interp, site) : 0;
+    val->next = NULL;
+    return val;
 }
 
-static Val* eval(Val* val, Val* env) {
-    switch (val->ty) {
-    case TY_FALSE:
-    case TY_TRUE:
-    case TY_COMP_PROC:
-    case TY_INT:
-    case TY_PRIM_PROC:
-    case TY_STRING:
-    case TY_VOID:
-        return val;
-    case TY_EMPTY_LIST:
-        ERROR("empty application: ()");
-    case TY_PAIR: {
-        DEF_ROOT2(proc, args);
-        proc = eval(val->car, env);
-        args = val->cdr;
-        Val* result = apply(proc, args, env);
-        POP_ROOT2();
-        return result;
+// Assumes `interp->heap` has been allocated.
+static void init_heap(Interp* interp) {
+    interp->free_list = NULL;
+    for (int i = 0; i < interp->heap_size; i++) {
+        free_val(interp, &interp->heap[i]);
     }
-    case TY_SYMBOL:
-        return lookup_variable(val, env);
+}
+
+static void free_heap(Interp* interp) {
+    for (int i = 0; i < interp->heap_size; i++) {
+        free_val_data(&interp->heap[i]);
     }
-    return VOID; // Satisfies GCC. Should never happen.
+    free(interp->heap);
 }
 
 /*------------------------------------------------------------------------------
- | PRIMITIVE PROCEDURES
+ | HEAP DUMPS
+ |
+ | A dump describes what is live and what keeps it alive. Each live cell is
+ | charged to the first root it is reachable from (global bindings first, then
+ | the rest of `roots`), which makes a spanning tree of the live heap: the size
+ | of a root's tree is what it retains, and the heaviest branch of the tree is
+ | a sample of how it retains it.
  -----------------------------------------------------------------------------*/
 
-#define PRIM_ADD     "+"
-#define PRIM_SUB     "-"
-#define PRIM_MUL     "*"
-#define PRIM_DIV     "/"
-#define PRIM_LT      "<"
-#define PRIM_LTE     "<="
-#define PRIM_GT      ">"
-#define PRIM_GTE     ">="
-#define PRIM_NUM_EQ  "="
-#define PRIM_EQ      "eq?"
-#define PRIM_CAR     "car"
-#define PRIM_CDR     "cdr"
-#define PRIM_CONS    "cons"
-#define PRIM_COND    "cond"
-#define PRIM_IF      "if"
-#define PRIM_AND     "and"
-#define PRIM_OR      "or"
-#define PRIM_DEFINE  "define"
-#define PRIM_LAMBDA  "lambda"
-#define PRIM_LET     "let"
-#define PRIM_QUOTE   "quote"
-#define PRIM_SET     "set!"
-#define PRIM_SET_CAR "set-car!"
-#define PRIM_SET_CDR "set-cdr!"
-#define PRIM_IS_INT  "integer?"
-#define PRIM_IS_LIST "list?"
-#define PRIM_IS_PAIR "pair?"
-#define PRIM_IS_PROC "procedure?"
-#define PRIM_IS_STR  "string?"
-#define PRIM_IS_SYM  "symbol?"
-#define PRIM_DISPLAY "display"
-#define PRIM_LOAD    "load"
-#define PRIM_READ    "read"
-#define PRIM_APPLY   "apply"
-
-static char  lt(int a, int b) { return a  < b; }
-static char lte(int a, int b) { return a <= b; }
-static char  gt(int a, int b) { return a  > b; }
-static char gte(int a, int b) { return a >= b; }
-static char  eq(int a, int b) { return a == b; }
-static char neq(int a, int b) { return a != b; }
-
-static void check_len(char* proc, Val* args, char (*op)(int, int), int exp) {
-    if (!op(len(args), exp)) {
-        ERROR("%s: incorrect argument count", proc);
-    }
-}
-
-// Yes, "typ" without the "e" so the function name has the same number of
-// characters as `check_len`. Fight me.
-static void check_typ(char* proc, Val* arg, Type exp) {
-    if (!(arg->ty & exp)) {
-        ERROR("%s: incorrect argument type", proc);
+#define DUMP_ROOTS_SHOWN 10
+#define DUMP_PATHS_SHOWN 5
+#define DUMP_PATH_MAX    12
+// One for each bit a Type could have, so it needn't change as types are added.
+#define DUMP_TYPES       (8 * (int)sizeof(Type))
+
+#define UNVISITED -2
+
+typedef struct DumpRoot {
+    // What holds the root: a kind of root, and the variable for a global.
+    const char* kind;
+    const char* var;
+    int cell;
+    int size;
+} DumpRoot;
+
+typedef struct Dump {
+    Interp* interp;
+    // By cell index: its parent in the tree (-1 for the top of a root), and
+    // the size of its subtree.
+    int* parent;
+    int* size;
+    // Cells in the order they were reached, parents before children.
+    int* order;
+    int order_size;
+    int* stack;
+    DumpRoot* roots;
+    int roots_size;
+} Dump;
+
+static const char* type_name(Type ty) {
+    switch (ty) {
+    case TY_FALSE:      return "false";
+    case TY_TRUE:       return "true";
+    case TY_EMPTY_LIST: return "empty-list";
+    case TY_COMP_PROC:  return "compound-procedure";
+    case TY_INT:        return "integer";
+    case TY_PAIR:       return "pair";
+    case TY_PRIM_PROC:  return "primitive-procedure";
+    case TY_STRING:     return "string";
+    case TY_SYMBOL:     return "symbol";
+    case TY_VOID:       return "void";
+    case TY_MACRO:      return "macro";
+    case TY_GUARD:      return "guard";
+    case TY_PORT:       return "port";
+    case TY_EOF:        return "eof";
+    case TY_THREAD:     return "thread";
+    case TY_CHANNEL:    return "channel";
+    case TY_FUTURE:     return "future";
+    case TY_RECORD:     return "record";
+    case TY_BYTEVECTOR: return "bytevector";
+    case TY_PROMISE:    return "promise";
     }
+    return "?";
 }
 
-static Val* prim_add(Val* args, Val* env) {
-    int sum = 0;
-    for (; args != EMPTY_LIST; args = args->cdr) {
-        Val* num = eval(args->car, env);
-        check_typ(PRIM_ADD, num, TY_INT);
-        sum += num->num;
+// Writes the values `val` refers to to `kids`, and the fields they are held
+// in to `fields`. Returns how many there are.
+static int children(Val* val, Val** kids, const char** fields) {
+    if (val->ty == TY_COMP_PROC || val->ty == TY_MACRO) {
+        kids[0] = val->params; fields[0] = "params";
+        kids[1] = val->body;   fields[1] = "body";
+        kids[2] = val->env;    fields[2] = "env";
+        return 3;
+    } else if (val->ty == TY_GUARD) {
+        kids[0] = val->deps; fields[0] = "deps";
+        kids[1] = val->fast; fields[1] = "fast";
+        kids[2] = val->slow; fields[2] = "slow";
+        return 3;
+    } else if (val->ty == TY_PAIR) {
+        kids[0] = val->car; fields[0] = "car";
+        kids[1] = val->cdr; fields[1] = "cdr";
+        return 2;
+    } else if (val->ty == TY_CHANNEL) {
+        kids[0] = val->items; fields[0] = "items";
+        return 1;
+    } else if (val->ty == TY_THREAD && val->thread) {
+        kids[0] = val->thread->thunk;  fields[0] = "thunk";
+        kids[1] = val->thread->result; fields[1] = "result";
+        return 2;
+    } else if (val->ty == TY_FUTURE && val->future) {
+        kids[0] = val->future->thunk; fields[0] = "thunk";
+        kids[1] = val->future->value; fields[1] = "value";
+        return 2;
+    } else if (val->ty == TY_PROMISE) {
+        kids[0] = val->promise; fields[0] = val->forced ? "value" : "thunk";
+        return 1;
     }
-    return make_int(sum);
+    return 0;
 }
 
-static Val* prim_sub(Val* args, Val* env) {
-    check_len(PRIM_SUB, args, gt, 0);
-    Val* num = eval(args->car, env);
-    check_typ(PRIM_SUB, num, TY_INT);
-    if (args->cdr == EMPTY_LIST) {
-        return make_int(-num->num);
+// Writes the `k`th value `val` refers to to `kid`, and the field it is held
+// in to `field`. Returns 0 if `val` refers to no more than `k` values.
+static int child(Val* val, int k, Val** kid, const char** field) {
+    if (val->ty == TY_RECORD) {
+        if (k > val->slots_size) {
+            return 0;
+        }
+        *kid = k == 0 ? val->type : val->slots[k - 1];
+        *field = k == 0 ? "type" : "slot";
+        return 1;
     }
-    int sum = num->num;
-    for (args = args->cdr; args != EMPTY_LIST; args = args->cdr) {
-        num = eval(args->car, env);
-        check_typ(PRIM_SUB, num, TY_INT);
-        sum -= num->num;
+    Val* kids[3];
+    const char* fields[3];
+    if (k >= children(val, kids, fields)) {
+        return 0;
     }
-    return make_int(sum);
+    *kid = kids[k];
+    *field = fields[k];
+    return 1;
 }
 
-static Val* prim_mul(Val* args, Val* env) {
-    int sum = 1;
-    for (; args != EMPTY_LIST; args = args->cdr) {
-        Val* num = eval(args->car, env);
-        check_typ(PRIM_MUL, num, TY_INT);
-        sum *= num->num;
+// Adds `val` to the tree below `parent` without visiting its children.
+static void dump_claim(Dump* d, Val* val, Val* parent) {
+    int i = val - d->interp->heap;
+    d->parent[i] = parent ? parent - d->interp->heap : -1;
+    d->order[d->order_size++] = i;
+    if (!parent) {
+        d->roots[d->roots_size++] = (DumpRoot){ "global environment", NULL, i };
     }
-    return make_int(sum);
 }
 
-// No support for rational values (yet?).
-static Val* prim_div(Val* args, Val* env) {
-    check_len(PRIM_DIV, args, gt, 0);
-    Val* num = eval(args->car, env);
-    check_typ(PRIM_DIV, num, TY_INT);
-    if (args->cdr == EMPTY_LIST) {
-        return make_int(num->num);
+static void dump_root(Dump* d, const char* kind, const char* var, Val* val) {
+    Interp* interp = d->interp;
+    if (!is_heap_val(interp, val) ||
+        d->parent[val - interp->heap] != UNVISITED) {
+        return;
     }
-    int sum = num->num;
-    for (args = args->cdr; args != EMPTY_LIST; args = args->cdr) {
-        num = eval(args->car, env);
-        check_typ(PRIM_DIV, num, TY_INT);
-        sum /= num->num;
+    int top = val - interp->heap;
+    d->roots[d->roots_size++] = (DumpRoot){ kind, var, top, 0 };
+    d->parent[top] = -1;
+    d->order[d->order_size++] = top;
+    int stack_size = 0;
+    d->stack[stack_size++] = top;
+    while (stack_size > 0) {
+        int i = d->stack[--stack_size];
+        Val* kid;
+        const char* kid_field;
+        for (int k = 0; child(&interp->heap[i], k, &kid, &kid_field); k++) {
+            if (!is_heap_val(interp, kid)) {
+                continue;
+            }
+            int j = kid - interp->heap;
+            if (d->parent[j] == UNVISITED) {
+                d->parent[j] = i;
+                d->order[d->order_size++] = j;
+                d->stack[stack_size++] = j;
+            }
+        }
     }
-    return make_int(sum);
 }
 
-static Val* compare(char* proc, Val* args, Val* env, char (*op)(int, int)) {
-    check_len(proc, args, gt, 0);
-    Val* prev = eval(args->car, env);
-    check_typ(proc, prev, TY_INT);
-    for (args = args->cdr; args != EMPTY_LIST; args = args->cdr) {
-        Val* curr = eval(args->car, env);
-        check_typ(proc, curr, TY_INT);
+static int compare_dump_roots(const void* a, const void* b) {
+    return ((const DumpRoot*)b)->size - ((const DumpRoot*)a)->size;
+}
+
+// Writes the heaviest branch of the tree below `root`, collapsing runs of the
+// same step (as along a list).
+static void dump_path(Dump* d, FILE* out, DumpRoot* root) {
+    Interp* interp = d->interp;
+    fprintf(out, "  %s%s%s (%d cells): ", root->kind, root->var ? " " : "",
+            root->var ? root->var : "", root->size);
+    int i = root->cell;
+    fprintf(out, "%s", type_name(interp->heap[i].ty));
+    const char* prev_field = NULL;
+    Type prev_ty = 0;
+    int run = 0;
+    for (int steps = 0; steps < DUMP_PATH_MAX;) {
+        Val* kid;
+        const char* kid_field;
+        int next = -1;
+        const char* field = NULL;
+        for (int k = 0; child(&interp->heap[i], k, &kid, &kid_field); k++) {
+            if (!is_heap_val(interp, kid)) {
+                continue;
+            }
+            int j = kid - interp->heap;
+            if (d->parent[j] == i && (next < 0 || d->size[j] > d->size[next])) {
+                next = j;
+                field = kid_field;
+            }
+        }
+        Type ty = next >= 0 ? interp->heap[next].ty : 0;
+        if (run > 0 && (next < 0 || field != prev_field || ty != prev_ty)) {
+            fprintf(out, " -%s-> %s", prev_field, type_name(prev_ty));
+            if (run > 1) {
+                fprintf(out, " (x%d)", run);
+            }
+            run = 0;
+            steps++;
+        }
+        if (next < 0) {
+            break;
+        }
+        prev_field = field;
+        prev_ty = ty;
+        run++;
+        i = next;
+    }
+    fprintf(out, "%s\n", run > 0 ? " ..." : "");
+}
+
+static void kont_dump(Dump* d, Kont* kont, int kont_size);
+
+static void write_dump(Dump* d, FILE* out) {
+    Interp* interp = d->interp;
+    for (int i = 0; i < interp->heap_size; i++) {
+        d->parent[i] = UNVISITED;
+        d->size[i] = 1;
+    }
+
+    if (interp->global_env->ty == TY_PAIR) {
+        // The environment itself is claimed first, but not the values in it:
+        // otherwise everything global would be charged to whichever global
+        // procedure (closed over the environment) came first.
+        Val* frame = interp->global_env->car;
+        dump_claim(d, interp->global_env, NULL);
+        dump_claim(d, frame, interp->global_env);
+        for (Val* p = frame->car, *prev = frame; p != EMPTY_LIST;
+             prev = p, p = p->cdr) {
+            dump_claim(d, p, prev);
+        }
+        for (Val* p = frame->cdr, *prev = frame; p != EMPTY_LIST;
+             prev = p, p = p->cdr) {
+            dump_claim(d, p, prev);
+        }
+        Val* vals = frame->cdr;
+        for (Val* v = frame->car; v != EMPTY_LIST; v = v->cdr) {
+            dump_root(d, "global", v->car->str, vals->car);
+            vals = vals->cdr;
+        }
+    }
+    for (int i = 0; i < interp->roots_size; i++) {
+        Val** root = interp->roots[i];
+        const char* kind = root == &interp->global_env ? "global environment"
+                         : root == &interp->symbol_list ? "symbol table"
+                         : root == &interp->jit_roots ? "compiled code"
+                         : "stack";
+        dump_root(d, kind, NULL, *root);
+    }
+    kont_dump(d, interp->kont, interp->kont_size);
+    for (Thread* t = interp->threads; t; t = t->next) {
+        if (t != interp->thread &&
+            (t->state == THREAD_RUNNABLE || t->state == THREAD_BLOCKED)) {
+            dump_root(d, "thread", NULL, t->thunk);
+            for (int i = 0; i < t->roots_size; i++) {
+                dump_root(d, "thread stack", NULL, *t->roots[i]);
+            }
+            kont_dump(d, t->kont, t->kont_size);
+        }
+    }
+    if (interp->futures) {
+        FuturePool* pool = interp->futures;
+        for (Val* f = pool->queue; f; f = f->future->next) {
+            dump_root(d, "future", NULL, f);
+        }
+        for (int i = 0; i < pool->size; i++) {
+            Interp* w = pool->workers[i];
+            for (int j = 0; j < w->roots_size; j++) {
+                dump_root(d, "future stack", NULL, *w->roots[j]);
+            }
+            kont_dump(d, w->kont, w->kont_size);
+        }
+    }
+    for (Val* r = interp->remembered; r != VOID; r = r->next) {
+        Val* kids[3];
+        const char* fields[3];
+        int n = children(r, kids, fields);
+        for (int k = 0; k < n; k++) {
+            dump_root(d, "immortal code", NULL, kids[k]);
+        }
+    }
+    for (int i = d->order_size - 1; i >= 0; i--) {
+        int p = d->parent[d->order[i]];
+        if (p >= 0) {
+            d->size[p] += d->size[d->order[i]];
+        }
+    }
+    for (int i = 0; i < d->roots_size; i++) {
+        d->roots[i].size = d->size[d->roots[i].cell];
+    }
+
+    int census[DUMP_TYPES] = { 0 };
+    for (int i = 0; i < d->order_size; i++) {
+        census[__builtin_ctz(interp->heap[d->order[i]].ty)]++;
+    }
+    fprintf(out, "heap dump: %d of %d cells live\n", d->order_size,
+            interp->heap_size);
+    fprintf(out, "live cells by type:\n");
+    for (int t = 0; t < DUMP_TYPES; t++) {
+        if (census[t] > 0) {
+            fprintf(out, "  %-20s %10d\n", type_name(1 << t), census[t]);
+        }
+    }
+
+    fprintf(out, "retained by kind of root:\n");
+    for (int i = 0; i < d->roots_size; i++) {
+        const char* kind = d->roots[i].kind;
+        int roots = 0;
+        int cells = 0;
+        for (int j = 0; j < d->roots_size; j++) {
+            if (d->roots[j].kind == kind) {
+                if (j < i) {
+                    break;
+                }
+                roots++;
+                cells += d->roots[j].size;
+            }
+        }
+        if (roots > 0) {
+            fprintf(out, "  %-20s %10d cells in %d roots\n", kind, cells,
+                    roots);
+        }
+    }
+
+    qsort(d->roots, d->roots_size, sizeof(DumpRoot), compare_dump_roots);
+    fprintf(out, "largest retained structures:\n");
+    for (int i = 0; i < d->roots_size && i < DUMP_ROOTS_SHOWN; i++) {
+        DumpRoot* r = &d->roots[i];
+        fprintf(out, "  %10d  %s%s%s (%s)\n", r->size, r->kind,
+                r->var ? " " : "", r->var ? r->var : "",
+                type_name(interp->heap[r->cell].ty));
+    }
+    fprintf(out, "retention paths:\n");
+    for (int i = 0; i < d->roots_size && i < DUMP_PATHS_SHOWN; i++) {
+        dump_path(d, out, &d->roots[i]);
+    }
+}
+
+// Writes a census of the live heap and what retains it to `out`.
+static void heap_dump(Interp* interp, FILE* out) {
+    Dump d = { .interp = interp };
+    d.parent = malloc(interp->heap_size * sizeof(int));
+    d.size = malloc(interp->heap_size * sizeof(int));
+    d.order = malloc(interp->heap_size * sizeof(int));
+    d.stack = malloc(interp->heap_size * sizeof(int));
+    int roots_max = interp->heap_size + ROOTS_MAX;
+    for (Thread* t = interp->threads; t; t = t->next) {
+        roots_max += t->roots_size + 1;
+    }
+    d.roots = malloc(roots_max * sizeof(DumpRoot));
+    if (d.parent && d.size && d.order && d.stack && d.roots) {
+        write_dump(&d, out);
+    } else {
+        fprintf(out, "heap dump: out of memory\n");
+    }
+    free(d.parent);
+    free(d.size);
+    free(d.order);
+    free(d.stack);
+    free(d.roots);
+}
+
+/*------------------------------------------------------------------------------
+ | CONSTRUCTORS
+ -----------------------------------------------------------------------------*/
+
+// The constructors most code allocates through charge the cells to their
+// caller, which is more telling in an allocation profile.
+#define make_comp_proc(interp, params, body, env) \
+    make_comp_proc_at(interp, params, body, env, __func__)
+#define make_macro(interp, params, body, env) \
+    make_macro_at(interp, params, body, env, __func__)
+#define make_guard(interp, deps, fast, slow) \
+    make_guard_at(interp, deps, fast, slow, __func__)
+#define make_int(interp, num) make_int_at(interp, num, __func__)
+#define cons(interp, car, cdr) cons_at(interp, car, cdr, __func__)
+#define make_string_or_symbol(interp, ty, str) \
+    make_string_or_symbol_at(interp, ty, str, __func__)
+
+static Val* make_comp_proc_at(Interp* interp, Val* params, Val* body,
+                              Val* env, const char* site) {
+    Val* val = alloc_val(interp, TY_COMP_PROC, site);
+    val->params = params;
+    val->body = body;
+    val->env = env;
+    return val;
+}
+
+static Val* make_macro_at(Interp* interp, Val* params, Val* body, Val* env,
+                          const char* site) {
+    Val* val = make_comp_proc_at(interp, params, body, env, site);
+    val->ty = TY_MACRO;
+    return val;
+}
+
+static Val* make_guard_at(Interp* interp, Val* deps, Val* fast, Val* slow,
+                          const char* site) {
+    Val* val = alloc_val(interp, TY_GUARD, site);
+    val->deps = deps;
+    val->fast = fast;
+    val->slow = slow;
+    return val;
+}
+
+static Val* make_int_at(Interp* interp, int num, const char* site) {
+    Val* val = alloc_val(interp, TY_INT, site);
+    val->num = num;
+    return val;
+}
+
+static Val* cons_at(Interp* interp, Val* car, Val* cdr, const char* site) {
+    Val* val = alloc_val(interp, TY_PAIR, site);
+    val->car = car;
+    val->cdr = cdr;
+    return val;
+}
+
+// Makes a record of `type` with `size` slots, all void.
+static Val* make_record(Interp* interp, Val* type, int size) {
+    Val* val = alloc_val(interp, TY_RECORD, __func__);
+    val->type = type;
+    val->slots = malloc(size * sizeof(Val*));
+    assert(val->slots || size == 0);
+    val->slots_size = size;
+    for (int i = 0; i < size; i++) {
+        val->slots[i] = VOID;
+    }
+    return val;
+}
+
+// Makes a bytevector of `size` bytes, all 0.
+static Val* make_bytevector(Interp* interp, int size) {
+    Val* val = alloc_val(interp, TY_BYTEVECTOR, __func__);
+    val->bytes = calloc(size ? size : 1, 1);
+    assert(val->bytes);
+    val->bytes_size = size;
+    return val;
+}
+
+// Makes a promise of `val`: the value itself if `forced`, otherwise a thunk
+// that computes it.
+static Val* make_promise(Interp* interp, Val* val, int forced) {
+    PUSH_ROOT(val);
+    Val* promise = alloc_val(interp, TY_PROMISE, __func__);
+    promise->promise = val;
+    promise->forced = forced;
+    POP_ROOT1();
+    return promise;
+}
+
+static Val* make_prim_proc(Interp* interp, PrimProc* proc) {
+    Val* val = alloc_val(interp, TY_PRIM_PROC, __func__);
+    val->proc = proc;
+    return val;
+}
+
+static Val* make_string_or_symbol_at(Interp* interp, Type ty, char* str,
+                                     const char* site) {
+    assert(ty == TY_STRING || ty == TY_SYMBOL);
+    Val* val = alloc_val(interp, ty, site);
+    val->str = (char*)malloc(strlen(str) + 1);
+    assert(val->str);
+    strcpy(val->str, str);
+    return val;
+}
+
+// Each port reads through a buffer of its own, so that large inputs can be
+// streamed with few system calls.
+#define PORT_BUFFER_SIZE (1 << 20)
+
+// Makes `port` read from `fp`, taking ownership of it.
+static void port_open(Val* port, FILE* fp) {
+    port->fp = fp;
+    port->buf = malloc(PORT_BUFFER_SIZE);
+    assert(port->buf);
+    setvbuf(fp, port->buf, _IOFBF, PORT_BUFFER_SIZE);
+}
+
+// Takes ownership of `fp`. With NULL, the port is closed until `port_open`
+// is called.
+static Val* make_port(Interp* interp, FILE* fp) {
+    Val* val = alloc_val(interp, TY_PORT, __func__);
+    val->fp = NULL;
+    if (fp) {
+        port_open(val, fp);
+    }
+    return val;
+}
+
+static Val* find_symbol(Val* symbols, char* str) {
+    for (Val* s = symbols; s != EMPTY_LIST; s = s->cdr) {
+        if (strcmp(str, s->car->str) == 0) {
+            return s->car;
+        }
+    }
+    return NULL;
+}
+
+// Returns a symbol if it has already been interned, creates (and interns) it
+// otherwise.
+static Val* intern_symbol(Interp* interp, char* str) {
+    FuturePool* pool = interp->futures;
+    if (!pool) {
+        Val* found = find_symbol(interp->symbol_list, str);
+        if (found) {
+            return found;
+        }
+        DEF_ROOT1(sym);
+        sym = make_string_or_symbol(interp, TY_SYMBOL, str);
+        interp->symbol_list = cons(interp, sym, interp->symbol_list);
+        POP_ROOT1();
+        return sym;
+    }
+
+    // The table belongs to the instance the pool does, and is shared by the
+    // threads running futures. It is only ever added to at the front, and the
+    // new entry is made before the lock is taken, as allocating may have to
+    // wait for a collection.
+    Val** symbols = &pool->main->symbol_list;
+    Val* found = find_symbol(__atomic_load_n(symbols, __ATOMIC_ACQUIRE), str);
+    if (found) {
+        return found;
+    }
+    DEF_ROOT2(sym, entry);
+    sym = make_string_or_symbol(interp, TY_SYMBOL, str);
+    entry = cons(interp, sym, EMPTY_LIST);
+    pthread_mutex_lock(&pool->lock);
+    found = find_symbol(*symbols, str);
+    if (found) {
+        sym = found;
+    } else {
+        entry->cdr = *symbols;
+        __atomic_store_n(symbols, entry, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    POP_ROOT2();
+    return sym;
+}
+
+/*------------------------------------------------------------------------------
+ | PARSER
+ -----------------------------------------------------------------------------*/
+
+#define STRING_MAX_LEN 2000
+#define SYMBOL_MAX_LEN 200
+
+const char extended_symbols[] = "!$%&*+-./:<=>?@^_~";
+
+static Val* read_c(Interp* interp, FILE* fp, int c);
+static Val* read(Interp* interp, FILE* fp);
+
+static int peek(FILE* fp) {
+    int c = getc(fp);
+    ungetc(c, fp);
+    return c;
+}
+
+static int get_non_whitespace_char(FILE* fp) {
+    for (;;) {
+        int c = getc(fp);
+        if (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+            continue;
+        } else if (c == ';') {
+            do {
+                c = getc(fp);
+            } while (c != '\n' && c != EOF);
+        } else {
+            return c;
+        }
+    }
+}
+
+// Assumes a '#' has already been read.
+static Val* read_bool(Interp* interp, FILE* fp) {
+    int c = getc(fp);
+    switch (c) {
+    case EOF:
+        ERROR("invalid '#' prefix");
+    case 'f':
+        return FALSE;
+    case 't':
+        return TRUE;
+    default:
+        ERROR("invalid '#%c' prefix", c);
+    }
+}
+
+static int read_int(FILE* fp, int num) {
+    while (isdigit(peek(fp))) {
+        num = num * 10 + (getc(fp) - '0');
+    }
+    return num;
+}
+
+// Assumes a '(' has already been read, and that `c` is a non-whitespace
+// character.
+static Val* read_pair(Interp* interp, FILE* fp, int c) {
+    if (c == EOF) {
+        ERROR("unterminated list");
+    } else if (c == ')') {
+        return EMPTY_LIST;
+    }
+
+    DEF_ROOT2(car, cdr);
+    // NULL check unnecessary due to earlier EOF check.
+    car = read_c(interp, fp, c);
+    c = get_non_whitespace_char(fp);
+    if (c == '.') {
+        // NULL check unnecessary due to subsequent ')' check.
+        cdr = read(interp, fp);
+        if (get_non_whitespace_char(fp) != ')') {
+            ERROR("expected list terminator");
+        }
+    } else {
+        cdr = read_pair(interp, fp, c);
+    }
+    Val* pair = cons(interp, car, cdr);
+    POP_ROOT2();
+    return pair;
+}
+
+static Val* read_quote(Interp* interp, FILE* fp) {
+    DEF_ROOT2(sym, quote);
+    sym = intern_symbol(interp, "quote");
+    quote = read(interp, fp);
+    if (!quote) {
+        ERROR("unexpected EOF reading quote");
+    }
+    quote = cons(interp, quote, EMPTY_LIST);
+    quote = cons(interp, sym, quote);
+    POP_ROOT2();
+    return quote;
+}
+
+static Val* read_string(Interp* interp, FILE* fp) {
+    char buffer[STRING_MAX_LEN + 1];
+    int i = 0;
+    for (int c = getc(fp); c != '"'; c = getc(fp)) {
+        if (c == EOF) {
+            ERROR("unterminated string");
+        } else if (c == '\\') {
+            c = getc(fp);
+            switch (c) {
+            case 't':
+                c = '\t';
+                break;
+            case 'r':
+                c = '\r';
+                break;
+            case 'n':
+                c = '\n';
+                break;
+            default:
+                break;
+            }
+        }
+        if (i < STRING_MAX_LEN) {
+            buffer[i++] = c;
+        } else {
+            ERROR("string too long");
+        }
+    }
+    buffer[i] = '\0';
+    return make_string_or_symbol(interp, TY_STRING, buffer);
+}
+
+static Val* read_symbol(Interp* interp, FILE* fp, int c) {
+    char buffer[SYMBOL_MAX_LEN + 1];
+    buffer[0] = c;
+    int i = 1;
+    while (isalnum(peek(fp)) || strchr(extended_symbols, peek(fp))) {
+        if (i < SYMBOL_MAX_LEN) {
+            buffer[i++] = getc(fp);
+        } else {
+            ERROR("identifier too long");
+        }
+    }
+    buffer[i] = '\0';
+    return intern_symbol(interp, buffer);
+}
+
+static Val* read_c(Interp* interp, FILE* fp, int c) {
+    if (c == EOF) {
+        return NULL;
+    }
+    if (c == '#') {
+        return read_bool(interp, fp);
+    }
+    if (c == '"') {
+        return read_string(interp, fp);
+    }
+    if (c == '(') {
+        return read_pair(interp, fp, get_non_whitespace_char(fp));
+    }
+    if (c == '\'') {
+        return read_quote(interp, fp);
+    }
+    if (isdigit(c)) {
+        return make_int(interp, read_int(fp, c - '0'));
+    }
+    if (c == '-' && isdigit(peek(fp))) {
+        return make_int(interp, -read_int(fp, getc(fp) - '0'));
+    }
+    if (isalpha(c) || strchr(extended_symbols, c)) {
+        return read_symbol(interp, fp, c);
+    }
+    ERROR("unexpected character '%c'", c);
+}
+
+static Val* read(Interp* interp, FILE* fp) {
+    int c = get_non_whitespace_char(fp);
+    return read_c(interp, fp, c);
+}
+
+/*------------------------------------------------------------------------------
+ | FASL
+ |
+ | A binary format for data that is much quicker to read back than text: each
+ | symbol is interned once, from a table at the start, and everything else is
+ | a tagged record. Integers and lengths are varints (7 bits to a byte, low
+ | bits first), integers zigzag-encoded so that small negative numbers stay
+ | short. Pairs and strings that are referred to more than once are labelled
+ | where they first appear and referred back to after that, so sharing (and
+ | cycles) survive the round trip.
+ |
+ |   fasl   := "PFSL" version count symbol* datum
+ |   symbol := length byte*
+ |   datum  := FALSE | TRUE | EMPTY_LIST | VOID | EOF
+ |           | INT varint | STRING length byte* | SYMBOL index
+ |           | PAIR datum datum | LABEL datum | REF label
+ -----------------------------------------------------------------------------*/
+
+#define FASL_MAGIC   "PFSL"
+#define FASL_VERSION 1
+
+typedef enum FaslTag {
+    FASL_FALSE,
+    FASL_TRUE,
+    FASL_EMPTY_LIST,
+    FASL_VOID,
+    FASL_EOF,
+    FASL_INT,
+    FASL_STRING,
+    FASL_SYMBOL,
+    FASL_PAIR,
+    // The next datum (a pair or string) gets the next label, from 0.
+    FASL_LABEL,
+    FASL_REF,
+} FaslTag;
+
+// For a pair or string, how many times it is referred to (counting up to 2),
+// and then its label plus one once it has one; for a symbol, its index in the
+// table.
+typedef struct FaslEntry {
+    Val* val;
+    int refs;
+    int id;
+} FaslEntry;
+
+typedef struct FaslWriter {
+    Interp* interp;
+    unsigned char* data;
+    size_t size;
+    size_t cap;
+    // Open addressing hash table of the pairs, strings and symbols in the
+    // datum, keyed by address. NULL `val` marks an empty slot.
+    FaslEntry* table;
+    int table_size;
+    int table_cap;
+    Val** symbols;
+    int symbols_size;
+    int labels;
+} FaslWriter;
+
+static void fasl_put(FaslWriter* w, const void* bytes, size_t n) {
+    if (w->size + n > w->cap) {
+        while (w->size + n > w->cap) {
+            w->cap = w->cap ? w->cap * 2 : 4096;
+        }
+        w->data = realloc(w->data, w->cap);
+        assert(w->data);
+    }
+    memcpy(w->data + w->size, bytes, n);
+    w->size += n;
+}
+
+static void fasl_put_byte(FaslWriter* w, unsigned char byte) {
+    fasl_put(w, &byte, 1);
+}
+
+static void fasl_put_varint(FaslWriter* w, unsigned n) {
+    while (n >= 0x80) {
+        fasl_put_byte(w, (n & 0x7f) | 0x80);
+        n >>= 7;
+    }
+    fasl_put_byte(w, n);
+}
+
+static void fasl_put_bytes(FaslWriter* w, const char* str) {
+    size_t n = strlen(str);
+    fasl_put_varint(w, n);
+    fasl_put(w, str, n);
+}
+
+static int fasl_slot(FaslEntry* table, int cap, Val* val) {
+    uintptr_t h = (uintptr_t)val / sizeof(Val);
+    h ^= h >> 17;
+    int i = (int)(h & (cap - 1));
+    while (table[i].val && table[i].val != val) {
+        i = (i + 1) & (cap - 1);
+    }
+    return i;
+}
+
+// Returns the entry for `val`, adding it if it isn't there yet.
+static FaslEntry* fasl_entry(FaslWriter* w, Val* val) {
+    int i = fasl_slot(w->table, w->table_cap, val);
+    if (!w->table[i].val) {
+        if ((w->table_size + 1) * 2 > w->table_cap) {
+            int cap = w->table_cap * 2;
+            FaslEntry* table = calloc(cap, sizeof(FaslEntry));
+            assert(table);
+            for (int j = 0; j < w->table_cap; j++) {
+                if (w->table[j].val) {
+                    table[fasl_slot(table, cap, w->table[j].val)] =
+                        w->table[j];
+                }
+            }
+            free(w->table);
+            w->table = table;
+            w->table_cap = cap;
+            i = fasl_slot(w->table, w->table_cap, val);
+        }
+        w->table[i].val = val;
+        w->table_size++;
+    }
+    return &w->table[i];
+}
+
+// Counts references, and collects the symbols. Returns the first value found
+// that can't be written, if any.
+static Val* fasl_count(FaslWriter* w, Val* val) {
+    for (;;) {
+        if (val->ty & (TY_FALSE | TY_TRUE | TY_EMPTY_LIST | TY_VOID | TY_EOF |
+                       TY_INT)) {
+            return NULL;
+        }
+        if (!(val->ty & (TY_PAIR | TY_STRING | TY_SYMBOL))) {
+            return val;
+        }
+        FaslEntry* entry = fasl_entry(w, val);
+        if (val->ty == TY_SYMBOL) {
+            if (!entry->refs) {
+                entry->refs = 1;
+                entry->id = w->symbols_size;
+                w->symbols = realloc(w->symbols,
+                                     (w->symbols_size + 1) * sizeof(Val*));
+                assert(w->symbols);
+                w->symbols[w->symbols_size++] = val;
+            }
+            return NULL;
+        }
+        if (entry->refs++ > 0 || val->ty == TY_STRING) {
+            entry->refs = entry->refs > 2 ? 2 : entry->refs;
+            return NULL;
+        }
+        Val* bad = fasl_count(w, val->car);
+        if (bad) {
+            return bad;
+        }
+        val = val->cdr;
+    }
+}
+
+static void fasl_put_datum(FaslWriter* w, Val* val) {
+    for (;;) {
+        switch (val->ty) {
+        case TY_FALSE:      fasl_put_byte(w, FASL_FALSE);      return;
+        case TY_TRUE:       fasl_put_byte(w, FASL_TRUE);       return;
+        case TY_EMPTY_LIST: fasl_put_byte(w, FASL_EMPTY_LIST); return;
+        case TY_VOID:       fasl_put_byte(w, FASL_VOID);       return;
+        case TY_EOF:        fasl_put_byte(w, FASL_EOF);        return;
+        case TY_INT:
+            fasl_put_byte(w, FASL_INT);
+            fasl_put_varint(w, ((unsigned)val->num << 1) ^ (val->num >> 31));
+            return;
+        case TY_SYMBOL:
+            fasl_put_byte(w, FASL_SYMBOL);
+            fasl_put_varint(w, fasl_entry(w, val)->id);
+            return;
+        default:
+            break;
+        }
+        FaslEntry* entry = fasl_entry(w, val);
+        if (entry->refs > 1) {
+            if (entry->id) {
+                fasl_put_byte(w, FASL_REF);
+                fasl_put_varint(w, entry->id - 1);
+                return;
+            }
+            entry->id = ++w->labels;
+            fasl_put_byte(w, FASL_LABEL);
+        }
+        if (val->ty == TY_STRING) {
+            fasl_put_byte(w, FASL_STRING);
+            fasl_put_bytes(w, val->str);
+            return;
+        }
+        fasl_put_byte(w, FASL_PAIR);
+        fasl_put_datum(w, val->car);
+        val = val->cdr;
+    }
+}
+
+// Returns `val` encoded (in a buffer the caller frees), or NULL if it holds a
+// value that can't be written, which is stored in `bad`.
+static unsigned char* fasl_encode(Interp* interp, Val* val, size_t* size,
+                                  Val** bad) {
+    FaslWriter w = { .interp = interp };
+    w.table_cap = 64;
+    w.table = calloc(w.table_cap, sizeof(FaslEntry));
+    assert(w.table);
+    *bad = fasl_count(&w, val);
+    if (!*bad) {
+        fasl_put(&w, FASL_MAGIC, strlen(FASL_MAGIC));
+        fasl_put_byte(&w, FASL_VERSION);
+        fasl_put_varint(&w, w.symbols_size);
+        for (int i = 0; i < w.symbols_size; i++) {
+            fasl_put_bytes(&w, w.symbols[i]->str);
+        }
+        fasl_put_datum(&w, val);
+    } else {
+        free(w.data);
+        w.data = NULL;
+    }
+    free(w.table);
+    free(w.symbols);
+    *size = w.size;
+    return w.data;
+}
+
+typedef struct FaslReader {
+    Interp* interp;
+    const unsigned char* pos;
+    const unsigned char* end;
+    // Symbols are kept alive by the symbol table, and labelled values by the
+    // datum they are part of.
+    Val** symbols;
+    int symbols_size;
+    Val** labels;
+    int labels_size;
+    int labels_cap;
+    char* str;
+    size_t str_cap;
+} FaslReader;
+
+// Each of these returns 0 if the data ends too soon.
+static int fasl_get_varint(FaslReader* r, unsigned* n) {
+    *n = 0;
+    for (int shift = 0; r->pos < r->end && shift < 35; shift += 7) {
+        unsigned char byte = *r->pos++;
+        *n |= (unsigned)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Reads a length-prefixed string into `r->str`.
+static int fasl_get_bytes(FaslReader* r) {
+    unsigned n;
+    if (!fasl_get_varint(r, &n) || n > (size_t)(r->end - r->pos)) {
+        return 0;
+    }
+    if (n + 1 > r->str_cap) {
+        r->str_cap = n + 1;
+        r->str = realloc(r->str, r->str_cap);
+        assert(r->str);
+    }
+    memcpy(r->str, r->pos, n);
+    r->str[n] = '\0';
+    r->pos += n;
+    return 1;
+}
+
+// Reads a datum into `slot`, which the caller keeps reachable. Each pair is
+// stored before its contents are read, so that everything read so far is
+// reachable from the first slot.
+static int fasl_get_datum(FaslReader* r, Val** slot) {
+    Interp* interp = r->interp;
+    for (;;) {
+        if (r->pos == r->end) {
+            return 0;
+        }
+        int tag = *r->pos++;
+        int label = -1;
+        if (tag == FASL_LABEL) {
+            if (r->labels_size == r->labels_cap) {
+                r->labels_cap = r->labels_cap ? r->labels_cap * 2 : 64;
+                r->labels = realloc(r->labels, r->labels_cap * sizeof(Val*));
+                assert(r->labels);
+            }
+            label = r->labels_size++;
+            r->labels[label] = NULL;
+            if (r->pos == r->end) {
+                return 0;
+            }
+            tag = *r->pos++;
+            if (tag != FASL_STRING && tag != FASL_PAIR) {
+                return 0;
+            }
+        }
+        unsigned n;
+        switch (tag) {
+        case FASL_FALSE:      *slot = FALSE;      return 1;
+        case FASL_TRUE:       *slot = TRUE;       return 1;
+        case FASL_EMPTY_LIST: *slot = EMPTY_LIST; return 1;
+        case FASL_VOID:       *slot = VOID;       return 1;
+        case FASL_EOF:        *slot = EOF_OBJECT; return 1;
+        case FASL_INT:
+            if (!fasl_get_varint(r, &n)) {
+                return 0;
+            }
+            *slot = make_int(interp, (int)((n >> 1) ^ -(n & 1)));
+            return 1;
+        case FASL_SYMBOL:
+            if (!fasl_get_varint(r, &n) || n >= (unsigned)r->symbols_size) {
+                return 0;
+            }
+            *slot = r->symbols[n];
+            return 1;
+        case FASL_REF:
+            if (!fasl_get_varint(r, &n) || n >= (unsigned)r->labels_size ||
+                !r->labels[n]) {
+                return 0;
+            }
+            *slot = r->labels[n];
+            return 1;
+        case FASL_STRING: {
+            if (!fasl_get_bytes(r)) {
+                return 0;
+            }
+            Val* str = make_string_or_symbol(interp, TY_STRING, r->str);
+            *slot = str;
+            if (label >= 0) {
+                r->labels[label] = str;
+            }
+            return 1;
+        }
+        case FASL_PAIR: {
+            Val* pair = cons(interp, VOID, VOID);
+            *slot = pair;
+            if (label >= 0) {
+                r->labels[label] = pair;
+            }
+            if (!fasl_get_datum(r, &pair->car)) {
+                return 0;
+            }
+            slot = &pair->cdr;
+            break;
+        }
+        default:
+            return 0;
+        }
+    }
+}
+
+// Decodes `size` bytes of `data` into `result`, which the caller keeps
+// rooted. Returns 0 if the data is malformed.
+static int fasl_decode(Interp* interp, const unsigned char* data, size_t size,
+                       Val** result) {
+    size_t magic = strlen(FASL_MAGIC);
+    if (size < magic + 1 || memcmp(data, FASL_MAGIC, magic) != 0 ||
+        data[magic] != FASL_VERSION) {
+        return 0;
+    }
+    FaslReader r = { .interp = interp, .pos = data + magic + 1,
+                     .end = data + size };
+    unsigned n;
+    int ok = fasl_get_varint(&r, &n) && n <= size;
+    if (ok) {
+        r.symbols = malloc((n ? n : 1) * sizeof(Val*));
+        assert(r.symbols);
+    }
+    for (; ok && r.symbols_size < (int)n; r.symbols_size++) {
+        ok = fasl_get_bytes(&r);
+        if (ok) {
+            r.symbols[r.symbols_size] = intern_symbol(interp, r.str);
+        }
+    }
+    ok = ok && fasl_get_datum(&r, result) && r.pos == r.end;
+    free(r.symbols);
+    free(r.labels);
+    free(r.str);
+    return ok;
+}
+
+/*------------------------------------------------------------------------------
+ | LIST HELPERS
+ -----------------------------------------------------------------------------*/
+
+// Returns the length of a proper list. Returns -1 if the argument is not a list
+// or is an improper list.
+static int len(Val* list) {
+    int len = 0;
+    for (; list->ty == TY_PAIR; list = list->cdr) {
+        len++;
+    }
+    // -1 if list is improper.
+    return list == EMPTY_LIST ? len : -1;
+}
+
+// Destructively reverses a list.
+static Val* rev(Val* list) {
+    Val* prev = EMPTY_LIST;
+    while (list != EMPTY_LIST) {
+        Val* next = list->cdr;
+        list->cdr = prev;
+        prev = list;
+        list = next;
+    }
+    return prev;
+}
+
+static Val* copy_list(Interp* interp, Val* list) {
+    DEF_ROOT1(copy);
+    copy = EMPTY_LIST;
+    for (; list->ty == TY_PAIR; list = list->cdr) {
+        copy = cons(interp, list->car, copy);
+    }
+    if (list != EMPTY_LIST) {
+        ERROR("improper list");
+    }
+    copy = rev(copy);
+    POP_ROOT1();
+    return copy;
+}
+
+// Copies the pairs in `tree` (which must not be circular).
+static Val* copy_tree(Interp* interp, Val* tree) {
+    if (tree->ty != TY_PAIR) {
+        return tree;
+    }
+    DEF_ROOT2(copy, car);
+    Val* last = NULL;
+    for (; tree->ty == TY_PAIR; tree = tree->cdr) {
+        car = copy_tree(interp, tree->car);
+        Val* pair = cons(interp, car, EMPTY_LIST);
+        if (last) {
+            last->cdr = pair;
+        } else {
+            copy = pair;
+        }
+        last = pair;
+    }
+    last->cdr = tree;
+    POP_ROOT2();
+    return copy;
+}
+
+/*------------------------------------------------------------------------------
+ | ENVIRONMENT
+ -----------------------------------------------------------------------------*/
+
+static Val* extend_env(Interp* interp, Val* vars, Val* vals, Val* env) {
+    assert(len(vars) == len(vals));
+    DEF_ROOT1(ext_env);
+    ext_env = cons(interp, vars, vals);
+    ext_env = cons(interp, ext_env, env);
+    POP_ROOT1();
+    return ext_env;
+}
+
+static Val* lookup_variable(Interp* interp, Val* var, Val* env) {
+    for (; env != EMPTY_LIST; env = env->cdr) {
+        Val* frame = env->car;
+        Val* vars = frame->car;
+        Val* vals = frame->cdr;
+        for (; vars != EMPTY_LIST; vars = vars->cdr, vals = vals->cdr) {
+            // Note: `strcmp` is unnecessary. Symbols are interned, so
+            // pointer comparison is sufficient.
+            if (var == vars->car) {
+                return vals->car;
+            }
+        }
+    }
+    ERROR("unbound variable: %s", var->str);
+}
+
+// Returns the cell holding the value of `var` in `env` (i.e. its `car`), or
+// NULL if `var` is unbound.
+static Val* find_binding(Val* var, Val* env) {
+    for (; env != EMPTY_LIST; env = env->cdr) {
+        Val* frame = env->car;
+        Val* vars = frame->car;
+        Val* vals = frame->cdr;
+        for (; vars != EMPTY_LIST; vars = vars->cdr, vals = vals->cdr) {
+            if (var == vars->car) {
+                return vals;
+            }
+        }
+    }
+    return NULL;
+}
+
+static void add_binding(Interp* interp, Val* var, Val* val, Val* frame) {
+    frame->car = cons(interp, var, frame->car);
+    frame->cdr = cons(interp, val, frame->cdr);
+}
+
+static void define_variable(Interp* interp, Val* var, Val* val, Val* env) {
+    Val* first_frame = env->car;
+    Val* vars = first_frame->car;
+    Val* vals = first_frame->cdr;
+    for (; vars != EMPTY_LIST; vars = vars->cdr, vals = vals->cdr) {
+        if (var == vars->car) {
+            vals->car = val;
+            return;
+        }
+    }
+    add_binding(interp, var, val, first_frame);
+}
+
+static void set_variable(Interp* interp, Val* var, Val* val, Val* env) {
+    for (; env != EMPTY_LIST; env = env->cdr) {
+        Val* frame = env->car;
+        Val* vars = frame->car;
+        Val* vals = frame->cdr;
+        for (; vars != EMPTY_LIST; vars = vars->cdr, vals = vals->cdr) {
+            if (var == vars->car) {
+                vals->car = val;
+                return;
+            }
+        }
+    }
+    ERROR("unbound variable: %s", var->str);
+}
+
+/*------------------------------------------------------------------------------
+ | EVALUATOR
+ -----------------------------------------------------------------------------*/
+
+static Val* eval(Interp* interp, Val* val, Val* env);
+static void check_lambda(Interp* interp, Val* args);
+static Val* prim_lambda(Interp* interp, Val* args, Val* env);
+
+// Evaluates each of `args` in `env`, returning a fresh list of the results.
+static Val* eval_args(Interp* interp, Val* args, Val* env) {
+    DEF_ROOT2(vals, temp);
+    vals = EMPTY_LIST;
+    for (; args->ty == TY_PAIR; args = args->cdr) {
+        temp = eval(interp, args->car, env);
+        vals = cons(interp, temp, vals);
+    }
+    vals = rev(vals);
+    POP_ROOT2();
+    return vals;
+}
+
+// Extends `env` with a frame that binds `params` to `vals`. The (fresh) list
+// `vals` becomes part of the frame.
+static Val* bind_params(Interp* interp, Val* params, Val* vals, Val* env) {
+    Val* p = params;
+    Val* v = vals;
+    Val* last = NULL;
+    for (; p->ty == TY_PAIR; p = p->cdr, last = v, v = v->cdr) {
+        if (v == EMPTY_LIST) {
+            ERROR("too few arguments to procedure");
+        }
+    }
+    if (p == EMPTY_LIST) {
+        if (v != EMPTY_LIST) {
+            ERROR("too many arguments to procedure");
+        }
+        // The parameter list doubles as the frame's list of variables. This is
+        // safe, as internal definitions only ever prepend to it.
+        return extend_env(interp, params, vals, env);
+    }
+
+    // Handle improper lists (i.e. variable arity procedures): the rest
+    // parameter is bound to a list of the remaining values.
+    DEF_ROOT3(frame_vals, vars, rest);
+    frame_vals = vals;
+    rest = cons(interp, v, EMPTY_LIST);
+    if (last) {
+        last->cdr = rest;
+    } else {
+        frame_vals = rest;
+    }
+    vars = EMPTY_LIST;
+    for (p = params; p->ty == TY_PAIR; p = p->cdr) {
+        vars = cons(interp, p->car, vars);
+    }
+    vars = cons(interp, p, vars);
+    vars = rev(vars);
+    Val* ext_env = extend_env(interp, vars, frame_vals, env);
+    POP_ROOT3();
+    return ext_env;
+}
+
+// Evaluates the expressions in a procedure body, returning the result of the
+// final expression.
+static Val* eval_body(Interp* interp, Val* body, Val* env) {
+    Val* result = VOID;
+    for (; body != EMPTY_LIST; body = body->cdr) {
+        result = eval(interp, body->car, env);
+    }
+    return result;
+}
+
+static JitEntry* jit_lookup(Interp* interp, Val* proc);
+static Val* jit_run(Interp* interp, JitEntry* e, Val* frame);
+
+// Records that compound procedure `proc` has been entered, for allocation
+// profiles and tracers. With `--perf`, `frame` is pushed onto the shadow
+// stack; otherwise it is NULL.
+static void proc_enter(Interp* interp, Val* proc, PerfFrame* frame) {
+    interp->running = proc;
+    interp->depth++;
+    if (frame) {
+        frame->name = proc_name(proc);
+        frame->caller = interp->perf_frame;
+        interp->perf_frame = frame;
+    }
+    PROBE3(proc__entry, proc_name(proc), interp->depth, interp->perf_frame);
+}
+
+// Records that `proc` has returned to `caller` (the procedure that was running
+// when it was entered), popping `frame` if it was pushed.
+static void proc_leave(Interp* interp, Val* proc, Val* caller,
+                       PerfFrame* frame) {
+    PROBE3(proc__return, proc_name(proc), interp->depth, interp->perf_frame);
+    if (frame) {
+        interp->perf_frame = frame->caller;
+    }
+    interp->depth--;
+    interp->running = caller;
+}
+
+// Evaluates the body of compound procedure `proc` in `frame` (which the caller
+// keeps rooted), as native code if the JIT has compiled it.
+static Val* run_body(Interp* interp, Val* proc, Val* frame) {
+    JitEntry* e = NULL;
+    if (interp->jit_threshold > 0 || interp->jit_entries_size > 0) {
+        e = jit_lookup(interp, proc);
+    }
+    Val* caller = interp->running;
+    PerfFrame perf_frame;
+    PerfFrame* perf = interp->perf ? &perf_frame : NULL;
+    proc_enter(interp, proc, perf);
+    if (interp->budgeted) {
+        budget_step(interp, interp->depth);
+    }
+    Val* result = e ? jit_run(interp, e, frame)
+                    : eval_body(interp, proc->body, frame);
+    proc_leave(interp, proc, caller, perf);
+    return result;
+}
+
+// Applies the procedure with parameters `params` and body `body`, closed over
+// `penv`, to `args` (evaluated in `env`).
+static Val* apply_lambda(Interp* interp, Val* params, Val* body, Val* penv,
+                         Val* args, Val* env) {
+    DEF_ROOT1(frame);
+    frame = eval_args(interp, args, env);
+    frame = bind_params(interp, params, frame, penv);
+    Val* result = eval_body(interp, body, frame);
+    POP_ROOT1();
+    return result;
+}
+
+static Val* apply(Interp* interp, Val* proc, Val* args, Val* env) {
+    if (proc->ty == TY_PRIM_PROC) {
+        return proc->proc(interp, args, env);
+    } else if (proc->ty == TY_COMP_PROC) {
+        DEF_ROOT1(frame);
+        frame = eval_args(interp, args, env);
+        frame = bind_params(interp, proc->params, frame, proc->env);
+        Val* result = run_body(interp, proc, frame);
+        POP_ROOT1();
+        return result;
+    } else {
+        ERROR("unknown procedure type");
+    }
+}
+
+// Applies the transformer of `macro` (the value of `op`, the operator of
+// `form`) to the unevaluated operands of `form`, and replaces `form` with the
+// result. Each macro call is therefore only ever expanded once, however many
+// times the code around it runs.
+//
+// Futures may reach the same call at once. The first to finish expanding it
+// replaces it, and the rest find that `op` is no longer its operator.
+static void expand_macro(Interp* interp, Val* macro, Val* op, Val* form) {
+    FuturePool* pool = interp->futures;
+    DEF_ROOT4(operands, frame, expansion, rest);
+    PUSH_ROOT(macro);
+    if (pool) {
+        pthread_mutex_lock(&pool->lock);
+    }
+    operands = form->car == op ? form->cdr : NULL;
+    if (pool) {
+        pthread_mutex_unlock(&pool->lock);
+    }
+    if (!operands) {
+        POP_ROOT5();
+        return;
+    }
+    // The operands are copied, as a frame's values may be modified.
+    frame = copy_list(interp, operands);
+    frame = bind_params(interp, macro->params, frame, macro->env);
+    expansion = eval_body(interp, macro->body, frame);
+    Val* head;
+    if (expansion->ty == TY_PAIR) {
+        head = expansion->car;
+        rest = expansion->cdr;
+    } else {
+        // Something other than a pair can only stand in for a call as
+        // `(begin expansion)`.
+        head = interp->begin;
+        rest = cons(interp, expansion, EMPTY_LIST);
+    }
+    if (pool) {
+        pthread_mutex_lock(&pool->lock);
+    }
+    // The operator is replaced last, so that a thread that sees the new one
+    // also sees the new operands.
+    if (form->car == op && form->cdr == operands) {
+        write_barrier(interp, form, rest);
+        write_barrier(interp, form, head);
+        form->cdr = rest;
+        __atomic_store_n(&form->car, head, __ATOMIC_RELEASE);
+    }
+    if (pool) {
+        pthread_mutex_unlock(&pool->lock);
+    }
+    POP_ROOT5();
+}
+
+// Each dependency is a pair of a binding (see `find_binding`) and the value it
+// is expected to hold.
+static int guard_holds(Val* guard) {
+    for (Val* d = guard->deps; d != EMPTY_LIST; d = d->cdr) {
+        if (d->car->car->car != d->car->cdr) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static Val* cek_eval(Interp* interp, Val* form, Val* env);
+static void kont_unwind(Interp* interp, int kont_size);
+
+static Val* eval(Interp* interp, Val* val, Val* env) {
+    switch (val->ty) {
+    case TY_FALSE:
+    case TY_TRUE:
+    case TY_COMP_PROC:
+    case TY_INT:
+    case TY_MACRO:
+    case TY_PRIM_PROC:
+    case TY_STRING:
+    case TY_VOID:
+    case TY_PORT:
+    case TY_EOF:
+    case TY_THREAD:
+    case TY_CHANNEL:
+    case TY_FUTURE:
+    case TY_RECORD:
+    case TY_BYTEVECTOR:
+    case TY_PROMISE:
+        return val;
+    case TY_EMPTY_LIST:
+        ERROR("empty application: ()");
+    case TY_PAIR: {
+        if (interp->budgeted) {
+            budget_step(interp, interp->depth);
+        }
+        if (interp->cek) {
+            return cek_eval(interp, val, env);
+        }
+        Val* op = val->car;
+        // `((lambda params . body) args...)`, as produced by `let`. Binding
+        // the arguments directly saves allocating a procedure that would be
+        // applied once and then dropped.
+        if (op->ty == TY_PAIR && op->car->ty == TY_PRIM_PROC &&
+            op->car->proc == prim_lambda) {
+            check_lambda(interp, op->cdr);
+            return apply_lambda(interp, op->cdr->car, op->cdr->cdr, env,
+                                val->cdr, env);
+        }
+        DEF_ROOT1(proc);
+        proc = eval(interp, op, env);
+        Val* result;
+        if (proc->ty == TY_MACRO) {
+            expand_macro(interp, proc, op, val);
+            result = eval(interp, val, env);
+        } else {
+            result = apply(interp, proc, val->cdr, env);
+        }
+        POP_ROOT1();
+        return result;
+    }
+    case TY_SYMBOL:
+        return lookup_variable(interp, val, env);
+    case TY_GUARD:
+        return eval(interp, guard_holds(val) ? val->fast : val->slow, env);
+    }
+    return VOID; // Satisfies GCC. Should never happen.
+}
+
+/*------------------------------------------------------------------------------
+ | GREEN THREADS
+ |
+ | `(spawn thunk)` calls `thunk` in a thread of its own: a C stack, root stack,
+ | error handler and continuation of its own, in the same instance (so with
+ | the same heap and global environment). Threads are only switched when the
+ | running thread yields, finishes, or blocks (on a channel, or joining
+ | another thread), so nothing needs to be synchronized. A thread that yields
+ | or is woken goes to the back of the run queue.
+ -----------------------------------------------------------------------------*/
+
+// Stacks are mapped lazily, so this is mostly address space.
+#define THREAD_STACK_SIZE (8 << 20)
+
+static void save_thread(Interp* interp, Thread* t) {
+    t->roots = interp->roots;
+    t->roots_size = interp->roots_size;
+    t->on_error = interp->on_error;
+    t->running = interp->running;
+    t->perf_frame = interp->perf_frame;
+    t->depth = interp->depth;
+    t->kont = interp->kont;
+    t->kont_size = interp->kont_size;
+    t->kont_cap = interp->kont_cap;
+    t->scope = interp->scope;
+    t->scope_size = interp->scope_size;
+    t->scope_cap = interp->scope_cap;
+}
+
+static void restore_thread(Interp* interp, Thread* t) {
+    interp->roots = t->roots;
+    interp->roots_size = t->roots_size;
+    interp->on_error = t->on_error;
+    interp->running = t->running;
+    interp->perf_frame = t->perf_frame;
+    interp->depth = t->depth;
+    interp->kont = t->kont;
+    interp->kont_size = t->kont_size;
+    interp->kont_cap = t->kont_cap;
+    interp->scope = t->scope;
+    interp->scope_size = t->scope_size;
+    interp->scope_cap = t->scope_cap;
+}
+
+// The running thread, creating the record of the instance's own thread when
+// threads are first used.
+static Thread* current_thread(Interp* interp) {
+    if (!interp->thread) {
+        Thread* t = calloc(1, sizeof(Thread));
+        assert(t);
+        t->state = THREAD_RUNNABLE;
+        interp->thread = t;
+        interp->threads = t;
+    }
+    return interp->thread;
+}
+
+static void threads_mark(Interp* interp) {
+    for (Thread* t = interp->threads; t; t = t->next) {
+        if (t == interp->thread ||
+            t->state == THREAD_DONE || t->state == THREAD_FAILED) {
+            continue;
+        }
+        for (int i = 0; i < t->roots_size; i++) {
+            mark(interp, *t->roots[i]);
+        }
+        kont_mark(interp, t->kont, t->kont_size);
+        mark(interp, t->thunk);
+    }
+}
+
+static void enqueue(Interp* interp, Thread* t) {
+    t->next_run = NULL;
+    if (interp->run_queue_end) {
+        interp->run_queue_end->next_run = t;
+    } else {
+        interp->run_queue = t;
+    }
+    interp->run_queue_end = t;
+}
+
+static Thread* dequeue(Interp* interp) {
+    Thread* t = interp->run_queue;
+    if (t) {
+        interp->run_queue = t->next_run;
+        if (!interp->run_queue) {
+            interp->run_queue_end = NULL;
+        }
+    }
+    return t;
+}
+
+// Makes the threads waiting on `on` runnable.
+static void wake(Interp* interp, void* on) {
+    for (Thread* t = interp->threads; t; t = t->next) {
+        if (t->state == THREAD_BLOCKED && t->waiting_on == on) {
+            t->state = THREAD_RUNNABLE;
+            t->waiting_on = NULL;
+            enqueue(interp, t);
+        }
+    }
+}
+
+static void free_thread(Thread* t) {
+    if (t->stack) {
+        munmap(t->stack, THREAD_STACK_SIZE);
+        free(t->roots);
+        free(t->kont);
+        free(t->scope);
+    }
+    free(t);
+}
+
+// Frees what finished threads no longer need. (A thread's stack can't be
+// freed while the thread is still on it, so this is left to whichever thread
+// runs next.)
+static void reap_threads(Interp* interp) {
+    for (Thread** p = &interp->threads; *p;) {
+        Thread* t = *p;
+        int done = t->state == THREAD_DONE || t->state == THREAD_FAILED;
+        if (done && t != interp->thread && t->detached) {
+            *p = t->next;
+            free_thread(t);
+            continue;
+        }
+        if (done && t != interp->thread && t->stack) {
+            munmap(t->stack, THREAD_STACK_SIZE);
+            free(t->roots);
+            free(t->kont);
+            free(t->scope);
+            t->stack = NULL;
+            t->roots = NULL;
+            t->kont = NULL;
+            t->scope = NULL;
+        }
+        p = &t->next;
+    }
+}
+
+static void detach_thread(Thread* t) {
+    t->detached = 1;
+}
+
+// Switches to the next runnable thread. The running thread must already be
+// queued, blocked or finished; it resumes here when it is next scheduled.
+static void schedule(Interp* interp) {
+    Thread* self = interp->thread;
+    Thread* next = dequeue(interp);
+    if (!next) {
+        if (self->state == THREAD_BLOCKED) {
+            self->state = THREAD_RUNNABLE;
+            ERROR("deadlock: every thread is blocked");
+        }
+        // A thread finished with every other thread blocked. Some thread
+        // must report it: the instance's own, which is waiting on the rest.
+        next = interp->threads;
+        while (next->stack || next->state != THREAD_BLOCKED) {
+            next = next->next;
+        }
+        next->state = THREAD_RUNNABLE;
+        next->deadlocked = 1;
+    }
+    if (next == self) {
+        return;
+    }
+    save_thread(interp, self);
+    restore_thread(interp, next);
+    interp->thread = next;
+    swapcontext(&self->context, &next->context);
+    reap_threads(interp);
+}
+
+// Blocks the running thread until something it waits `on` happens.
+static void block_on(Interp* interp, void* on) {
+    Thread* self = current_thread(interp);
+    self->state = THREAD_BLOCKED;
+    self->waiting_on = on;
+    schedule(interp);
+    if (self->deadlocked) {
+        self->deadlocked = 0;
+        ERROR("deadlock: every thread is blocked");
+    }
+}
+
+static void yield(Interp* interp) {
+    Thread* self = current_thread(interp);
+    enqueue(interp, self);
+    schedule(interp);
+}
+
+// Where a thread starts. The instance is passed in two halves, as
+// `makecontext` only passes ints.
+static void thread_main(unsigned hi, unsigned lo) {
+    Interp* interp = (Interp*)(((uintptr_t)hi << 32) | lo);
+    Thread* self = interp->thread;
+    jmp_buf on_error;
+    interp->on_error = &on_error;
+    if (setjmp(on_error) == 0) {
+        self->result = apply(interp, self->thunk, EMPTY_LIST,
+                             interp->global_env);
+        self->state = THREAD_DONE;
+    } else {
+        self->state = THREAD_FAILED;
+    }
+    interp->roots_size = 0;
+    kont_unwind(interp, 0);
+    wake(interp, self);
+    schedule(interp);
+}
+
+// Starts a thread (queued behind those already runnable) that calls `thunk`,
+// and stores it in `val`.
+static void spawn(Interp* interp, Val* val, Val* thunk) {
+    Thread* t = calloc(1, sizeof(Thread));
+    assert(t);
+    t->stack = mmap(NULL, THREAD_STACK_SIZE, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK,
+                    -1, 0);
+    if (t->stack == MAP_FAILED) {
+        free(t);
+        ERROR("spawn: out of memory");
+    }
+    t->roots = calloc(ROOTS_MAX, sizeof(Val**));
+    assert(t->roots);
+    t->state = THREAD_RUNNABLE;
+    t->thunk = thunk;
+    getcontext(&t->context);
+    t->context.uc_stack.ss_sp = t->stack;
+    t->context.uc_stack.ss_size = THREAD_STACK_SIZE;
+    t->context.uc_link = NULL;
+    uintptr_t p = (uintptr_t)interp;
+    makecontext(&t->context, (void (*)(void))thread_main, 2,
+                (unsigned)(p >> 32), (unsigned)p);
+
+    Thread* self = current_thread(interp);
+    t->next = self->next;
+    self->next = t;
+    val->thread = t;
+    enqueue(interp, t);
+}
+
+// Frees every thread. The running thread has no stack of its own (it is the
+// instance's own thread), and its state is freed with the instance.
+static void free_threads(Interp* interp) {
+    while (interp->threads) {
+        Thread* t = interp->threads;
+        interp->threads = t->next;
+        free_thread(t);
+    }
+}
+
+/*------------------------------------------------------------------------------
+ | FUTURES
+ |
+ | `(future thunk)` queues `thunk` to be called by a pool of OS threads, and
+ | `(touch future)` waits for its value. Touching a future that no thread has
+ | started yet runs it there and then, so futures that touch other futures
+ | can't run out of threads. Each thread in the pool runs code with an instance
+ | of its own (see `start_futures`), which shares the heap, symbol table and
+ | global environment of the instance it was made from, and allocates and
+ | collects as described under SAFEPOINTS.
+ |
+ | Futures are meant for code without side effects: nothing stops two of them
+ | from modifying the same data at once. Code in a future is interpreted, and
+ | can't use green threads.
+ -----------------------------------------------------------------------------*/
+
+#define FUTURE_THREADS_MAX 64
+
+// The instance's own thread only counts as running code in it (so that a
+// collection waits for it to park) while it is inside the embedding API.
+static void futures_enter(Interp* interp) {
+    FuturePool* pool = interp->futures;
+    if (!pool) {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    while (pool->stopping) {
+        pthread_cond_wait(&pool->changed, &pool->lock);
+    }
+    pool->mutators++;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void futures_leave(Interp* interp) {
+    FuturePool* pool = interp->futures;
+    if (!pool) {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->mutators--;
+    pthread_cond_broadcast(&pool->changed);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void check_not_future(Interp* interp, char* proc) {
+    if (interp->future_depth > 0) {
+        ERROR("%s: not available in a future", proc);
+    }
+}
+
+// Takes `future` off the queue, to be run by `runner`. `pool->lock` must be
+// held.
+static void take_future(FuturePool* pool, Val* future, Interp* runner) {
+    Val* prev = NULL;
+    Val** p = &pool->queue;
+    while (*p != future) {
+        prev = *p;
+        p = &prev->future->next;
+    }
+    *p = future->future->next;
+    if (pool->queue_end == future) {
+        pool->queue_end = prev;
+    }
+    future->future->next = NULL;
+    future->future->state = FUTURE_RUNNING;
+    future->future->runner = runner;
+}
+
+// Calls the thunk of `future`, which the caller has taken off the queue.
+static void run_future(Interp* interp, Val* future) {
+    FuturePool* pool = interp->futures;
+    Future* f = future->future;
+    PUSH_ROOT(future);
+    jmp_buf on_error;
+    jmp_buf* prev = interp->on_error;
+    int roots_size = interp->roots_size;
+    Val* running = interp->running;
+    PerfFrame* perf_frame = interp->perf_frame;
+    int kont_size = interp->kont_size;
+    FutureState state = FUTURE_DONE;
+    if (interp != pool->main) {
+        // A future has budgets of its own, on whichever thread runs it.
+        budget_reset(interp);
+    }
+    interp->on_error = &on_error;
+    interp->future_depth++;
+    int unwound = setjmp(on_error);
+    if (unwound == 0) {
+        f->value = apply(interp, f->thunk, EMPTY_LIST, interp->global_env);
+    } else {
+        interp->roots_size = roots_size;
+        interp->running = running;
+        interp->perf_frame = perf_frame;
+        kont_unwind(interp, kont_size);
+        state = unwound == UNWIND_BUDGET ? FUTURE_OVER_BUDGET : FUTURE_FAILED;
+    }
+    interp->future_depth--;
+    interp->on_error = prev;
+    pthread_mutex_lock(&pool->lock);
+    f->state = state;
+    f->runner = NULL;
+    pthread_cond_broadcast(&pool->changed);
+    pthread_mutex_unlock(&pool->lock);
+    POP_ROOT1();
+}
+
+static void* future_worker_main(void* arg) {
+    Interp* interp = arg;
+    FuturePool* pool = interp->futures;
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->closing) {
+        if (!pool->queue) {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        } else if (pool->stopping) {
+            pthread_cond_wait(&pool->changed, &pool->lock);
+        } else {
+            // No collection can start between here and `run_future` rooting
+            // the future, as this thread doesn't park until it allocates.
+            Val* future = pool->queue;
+            take_future(pool, future, interp);
+            pool->mutators++;
+            pthread_mutex_unlock(&pool->lock);
+            run_future(interp, future);
+            pthread_mutex_lock(&pool->lock);
+            pool->mutators--;
+            pthread_cond_broadcast(&pool->changed);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static void free_worker(Interp* w) {
+    free(w->roots);
+    free(w->kont);
+    free(w->mark_stack.items);
+    free(w->scope);
+    free(w);
+}
+
+// A copy of `interp` (the instance's own) for another thread in `pool` to
+// run code with.
+static Interp* new_worker(Interp* interp, FuturePool* pool) {
+    // What isn't reset here is either shared, or only used by the instance's
+    // own thread.
+    Interp* w = malloc(sizeof(Interp));
+    assert(w);
+    *w = *interp;
+    w->roots = calloc(ROOTS_MAX, sizeof(Val**));
+    assert(w->roots);
+    w->roots_size = 0;
+    w->free_list = NULL;
+    w->tlab = NULL;
+    w->jit_threshold = 0;
+    w->jit_entries = NULL;
+    w->jit_entries_size = 0;
+    w->jit_entries_cap = 0;
+    w->captures = NULL;
+    w->captures_size = 0;
+    w->captures_cap = 0;
+    w->kont = NULL;
+    w->kont_size = 0;
+    w->kont_cap = 0;
+    w->thread = NULL;
+    w->threads = NULL;
+    w->run_queue = NULL;
+    w->run_queue_end = NULL;
+    w->futures = pool;
+    w->profile = NULL;
+    w->running = NULL;
+    w->perf_frame = NULL;
+    w->perf_map = NULL;
+    w->scope = NULL;
+    w->scope_size = 0;
+    w->scope_cap = 0;
+    w->on_error = NULL;
+    w->future_depth = 0;
+    return w;
+}
+
+// Starts the pool. Called by the instance's own thread, in the middle of
+// running code (see `futures_enter`).
+static void start_futures(Interp* interp) {
+    FuturePool* pool = calloc(1, sizeof(FuturePool));
+    assert(pool);
+    pool->main = interp;
+    pool->size = interp->future_threads;
+    pool->threads = calloc(pool->size, sizeof(pthread_t));
+    pool->workers = calloc(pool->size, sizeof(Interp*));
+    assert(pool->threads && pool->workers);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->changed, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pool->mutators = 1;
+    for (int i = 0; i < pool->size; i++) {
+        pool->workers[i] = new_worker(interp, pool);
+    }
+    interp->futures = pool;
+    for (int i = 0; i < pool->size; i++) {
+        if (pthread_create(&pool->threads[i], NULL, future_worker_main,
+                           pool->workers[i]) != 0) {
+            // Make do with the threads there are. (With none, futures run
+            // when they are touched.)
+            for (int j = i; j < pool->size; j++) {
+                free_worker(pool->workers[j]);
+            }
+            pool->size = i;
+            break;
+        }
+    }
+}
+
+// Stops the pool once the futures that are running have finished. Those
+// that haven't started never will.
+static void free_futures(Interp* interp) {
+    FuturePool* pool = interp->futures;
+    if (!pool) {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->closing = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_cond_broadcast(&pool->changed);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->size; i++) {
+        pthread_join(pool->threads[i], NULL);
+        free_worker(pool->workers[i]);
+    }
+    free(pool->threads);
+    free(pool->workers);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->changed);
+    pthread_cond_destroy(&pool->work);
+    free(pool);
+    interp->futures = NULL;
+}
+
+// Makes `val` a future that calls `thunk`, and queues it.
+static void queue_future(Interp* interp, Val* val, Val* thunk) {
+    Future* f = calloc(1, sizeof(Future));
+    assert(f);
+    f->state = FUTURE_QUEUED;
+    f->thunk = thunk;
+    f->value = VOID;
+    val->future = f;
+    if (!interp->futures) {
+        start_futures(interp);
+    }
+    FuturePool* pool = interp->futures;
+    pthread_mutex_lock(&pool->lock);
+    if (pool->queue_end) {
+        pool->queue_end->future->next = val;
+    } else {
+        pool->queue = val;
+    }
+    pool->queue_end = val;
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Waits for `future` to finish, running it if no thread has started it.
+// Returns 0 if its thunk failed.
+static int touch(Interp* interp, Val* future) {
+    FuturePool* pool = interp->futures;
+    Future* f = future->future;
+    pthread_mutex_lock(&pool->lock);
+    if (f->state == FUTURE_QUEUED) {
+        take_future(pool, future, interp);
+        pthread_mutex_unlock(&pool->lock);
+        run_future(interp, future);
+        pthread_mutex_lock(&pool->lock);
+    } else if (f->state == FUTURE_RUNNING && f->runner == interp) {
+        pthread_mutex_unlock(&pool->lock);
+        ERROR("deadlock: a future is waiting for itself");
+    }
+    while (f->state == FUTURE_RUNNING) {
+        pool_wait(pool);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return f->state == FUTURE_DONE;
+}
+
+/*------------------------------------------------------------------------------
+ | PRIMITIVE PROCEDURES
+ -----------------------------------------------------------------------------*/
+
+#define PRIM_ADD     "+"
+#define PRIM_SUB     "-"
+#define PRIM_MUL     "*"
+#define PRIM_DIV     "/"
+#define PRIM_LT      "<"
+#define PRIM_LTE     "<="
+#define PRIM_GT      ">"
+#define PRIM_GTE     ">="
+#define PRIM_NUM_EQ  "="
+#define PRIM_EQ      "eq?"
+#define PRIM_CAR     "car"
+#define PRIM_CDR     "cdr"
+#define PRIM_CONS    "cons"
+#define PRIM_IF      "if"
+#define PRIM_OR      "or"
+#define PRIM_BEGIN   "begin"
+#define PRIM_DEFINE  "define"
+#define PRIM_DEFINE_MACRO "define-macro"
+#define PRIM_LAMBDA  "lambda"
+#define PRIM_QUOTE   "quote"
+#define PRIM_SET     "set!"
+#define PRIM_SET_CAR "set-car!"
+#define PRIM_SET_CDR "set-cdr!"
+#define PRIM_IS_INT  "integer?"
+#define PRIM_IS_LIST "list?"
+#define PRIM_IS_PAIR "pair?"
+#define PRIM_IS_PROC "procedure?"
+#define PRIM_IS_STR  "string?"
+#define PRIM_IS_SYM  "symbol?"
+#define PRIM_DISPLAY "display"
+#define PRIM_LOAD    "load"
+#define PRIM_READ    "read"
+#define PRIM_OPEN_INPUT_FILE "open-input-file"
+#define PRIM_CLOSE_PORT "close-port"
+#define PRIM_READ_CHAR "read-char"
+#define PRIM_PEEK_CHAR "peek-char"
+#define PRIM_READ_LINE "read-line"
+#define PRIM_IS_EOF  "eof-object?"
+#define PRIM_ALLOC_PROFILE "alloc-profile"
+#define PRIM_HEAP_DUMP "heap-dump"
+#define PRIM_SPAWN   "spawn"
+#define PRIM_YIELD   "yield"
+#define PRIM_JOIN    "join"
+#define PRIM_MAKE_CHANNEL "make-channel"
+#define PRIM_CHANNEL_SEND "channel-send"
+#define PRIM_CHANNEL_RECEIVE "channel-receive"
+#define PRIM_FUTURE  "future"
+#define PRIM_WRITE_FASL "write-fasl"
+#define PRIM_READ_FASL "read-fasl"
+#define PRIM_TOUCH   "touch"
+#define PRIM_APPLY   "apply"
+#define PRIM_ERROR   "error"
+#define PRIM_MAKE_RECORD_TYPE "make-record-type"
+#define PRIM_MAKE_RECORD "make-record"
+#define PRIM_IS_RECORD "record?"
+#define PRIM_RECORD_REF "record-ref"
+#define PRIM_RECORD_SET "record-set!"
+#define PRIM_MAKE_BYTEVECTOR "make-bytevector"
+#define PRIM_BYTEVECTOR "bytevector"
+#define PRIM_IS_BYTEVECTOR "bytevector?"
+#define PRIM_BYTEVECTOR_LENGTH "bytevector-length"
+#define PRIM_BYTEVECTOR_REF "bytevector-u8-ref"
+#define PRIM_BYTEVECTOR_SET "bytevector-u8-set!"
+#define PRIM_BYTEVECTOR_COPY "bytevector-copy"
+#define PRIM_BYTEVECTOR_COPY_TO "bytevector-copy!"
+#define PRIM_BYTEVECTOR_FILL "bytevector-fill!"
+#define PRIM_BYTEVECTOR_EQ "bytevector=?"
+#define PRIM_READ_BYTEVECTOR "read-bytevector"
+#define PRIM_WRITE_BYTEVECTOR "write-bytevector"
+#define PRIM_MAKE_PROMISE "make-promise"
+#define PRIM_MAKE_LAZY_PROMISE "make-lazy-promise"
+#define PRIM_IS_PROMISE "promise?"
+#define PRIM_FORCE   "force"
+
+static char  lt(int a, int b) { return a  < b; }
+static char lte(int a, int b) { return a <= b; }
+static char  gt(int a, int b) { return a  > b; }
+static char gte(int a, int b) { return a >= b; }
+static char  eq(int a, int b) { return a == b; }
+static char neq(int a, int b) { return a != b; }
+
+static void check_len(Interp* interp, char* proc, Val* args,
+                      char (*op)(int, int), int exp) {
+    if (!op(len(args), exp)) {
+        ERROR("%s: incorrect argument count", proc);
+    }
+}
+
+// Yes, "typ" without the "e" so the function name has the same number of
+// characters as `check_len`. Fight me.
+static void check_typ(Interp* interp, char* proc, Val* arg, Type exp) {
+    if (!(arg->ty & exp)) {
+        ERROR("%s: incorrect argument type", proc);
+    }
+}
+
+static Val* prim_add(Interp* interp, Val* args, Val* env) {
+    int sum = 0;
+    for (; args != EMPTY_LIST; args = args->cdr) {
+        Val* num = eval(interp, args->car, env);
+        check_typ(interp, PRIM_ADD, num, TY_INT);
+        sum += num->num;
+    }
+    return make_int(interp, sum);
+}
+
+static Val* prim_sub(Interp* interp, Val* args, Val* env) {
+    check_len(interp, PRIM_SUB, args, gt, 0);
+    Val* num = eval(interp, args->car, env);
+    check_typ(interp, PRIM_SUB, num, TY_INT);
+    if (args->cdr == EMPTY_LIST) {
+        return make_int(interp, -num->num);
+    }
+    int sum = num->num;
+    for (args = args->cdr; args != EMPTY_LIST; args = args->cdr) {
+        num = eval(interp, args->car, env);
+        check_typ(interp, PRIM_SUB, num, TY_INT);
+        sum -= num->num;
+    }
+    return make_int(interp, sum);
+}
+
+static Val* prim_mul(Interp* interp, Val* args, Val* env) {
+    int sum = 1;
+    for (; args != EMPTY_LIST; args = args->cdr) {
+        Val* num = eval(interp, args->car, env);
+        check_typ(interp, PRIM_MUL, num, TY_INT);
+        sum *= num->num;
+    }
+    return make_int(interp, sum);
+}
+
+// No support for rational values (yet?).
+static Val* prim_div(Interp* interp, Val* args, Val* env) {
+    check_len(interp, PRIM_DIV, args, gt, 0);
+    Val* num = eval(interp, args->car, env);
+    check_typ(interp, PRIM_DIV, num, TY_INT);
+    if (args->cdr == EMPTY_LIST) {
+        return make_int(interp, num->num);
+    }
+    int sum = num->num;
+    for (args = args->cdr; args != EMPTY_LIST; args = args->cdr) {
+        num = eval(interp, args->car, env);
+        check_typ(interp, PRIM_DIV, num, TY_INT);
+        sum /= num->num;
+    }
+    return make_int(interp, sum);
+}
+
+static Val* compare(Interp* interp, char* proc, Val* args, Val* env,
+                    char (*op)(int, int)) {
+    check_len(interp, proc, args, gt, 0);
+    Val* prev = eval(interp, args->car, env);
+    check_typ(interp, proc, prev, TY_INT);
+    for (args = args->cdr; args != EMPTY_LIST; args = args->cdr) {
+        Val* curr = eval(interp, args->car, env);
+        check_typ(interp, proc, curr, TY_INT);
         if (op(prev->num, curr->num)) {
             return FALSE;
         }
-        prev = curr;
+        prev = curr;
+    }
+    return TRUE;
+}
+
+static Val* prim_lt(Interp* interp, Val* args, Val* env) {
+    return compare(interp, PRIM_LT, args, env, gte);
+}
+
+static Val* prim_lte(Interp* interp, Val* args, Val* env) {
+    return compare(interp, PRIM_LTE, args, env, gt);
+}
+
+static Val* prim_gt(Interp* interp, Val* args, Val* env) {
+    return compare(interp, PRIM_GT, args, env, lte);
+}
+
+static Val* prim_gte(Interp* interp, Val* args, Val* env) {
+    return compare(interp, PRIM_GTE, args, env, lt);
+}
+
+static Val* prim_num_eq(Interp* interp, Val* args, Val* env) {
+    return compare(interp, PRIM_NUM_EQ, args, env, neq);
+}
+
+static Val* prim_eq(Interp* interp, Val* args, Val* env) {
+    check_len(interp, PRIM_EQ, args, eq, 2);
+    Val* l = eval(interp, args->car, env);
+    Val* r = eval(interp, args->cdr->car, env);
+    if (l->ty == TY_INT && r->ty == TY_INT) {
+        return l->num == r->num ? TRUE : FALSE;
+    } else {
+        return l == r ? TRUE : FALSE;
+    }
+}
+
+static Val* prim_car(Interp* interp, Val* args, Val* env) {
+    check_len(interp, PRIM_CAR, args, eq, 1);
+    Val* list = eval(interp, args->car, env);
+    check_typ(interp, PRIM_CAR, list, TY_PAIR);
+    return list->car;
+}
+
+static Val* prim_cdr(Interp* interp, Val* args, Val* env) {
+    check_len(interp, PRIM_CDR, args, eq, 1);
+    Val* list = eval(interp, args->car, env);
+    check_typ(interp, PRIM_CDR, list, TY_PAIR);
+    return list->cdr;
+}
+
+static Val* prim_cons(Interp* interp, Val* args, Val* env) {
+    check_len(interp, PRIM_CONS, args, eq, 2);
+    DEF_ROOT2(car, cdr);
+    car = eval(interp, args->car, env);
+    cdr = eval(interp, args->cdr->car, env);
+    Val* pair = cons(interp, car, cdr);
+    POP_ROOT2();
+    return pair;
+}
+
+// Note: only `#f` is considered false in conditional expressions.
+static Val* prim_if(Interp* interp, Val* args, Val* env) {
+    check_len(interp, PRIM_IF, args, gt, 1);
+    Val* test = eval(interp, args->car, env);
+    if (test != FALSE) {
+        Val* conseq = args->cdr;
+        return eval(interp, conseq->car, env);
+    } else {
+        // If test yields a false value and no alternate is specified, the
+        // result of the expression is unspecified.
+        Val* altern = args->cdr->cdr;
+        return altern == EMPTY_LIST ? VOID : eval(interp, altern->car, env);
+    }
+}
+
+static Val* prim_or(Interp* interp, Val* args, Val* env) {
+    Val* result = FALSE;
+    for (; args != EMPTY_LIST; args = args->cdr) {
+        result = eval(interp, args->car, env);
+        if (result != FALSE) {
+            break;
+        }
+    }
+    return result;
+}
+
+static Val* prim_begin(Interp* interp, Val* args, Val* env) {
+    return eval_body(interp, args, env);
+}
+
+// Type checks both proper and improper parameter lists.
+static void check_params(Interp* interp, char* proc, Val* params) {
+    Val* p = params;
+    for (; p->ty == TY_PAIR; p = p->cdr) {
+        check_typ(interp, proc, p->car, TY_SYMBOL);
+    }
+    if (p != EMPTY_LIST) {
+        check_typ(interp, proc, p, TY_SYMBOL);
+    }
+}
+
+static Val* closure_env(Interp* interp, Val* body, Val* env);
+
+static void define_proc(Interp* interp, Val* args, Val* env) {
+    Val* name = args->car->car;
+    Val* params = args->car->cdr;
+    Val* body = args->cdr;
+
+    check_typ(interp, PRIM_DEFINE, name, TY_SYMBOL);
+    check_params(interp, PRIM_DEFINE, params);
+
+    DEF_ROOT2(penv, proc);
+    penv = closure_env(interp, body, env);
+    proc = make_comp_proc(interp, params, body, penv);
+    name_proc(proc, name);
+    define_variable(interp, name, proc, env);
+    POP_ROOT2();
+}
+
+static Val* prim_define(Interp* interp, Val* args, Val* env) {
+    check_len(interp, PRIM_DEFINE, args, gt, 1);
+    Val* var = args->car;
+    if (var->ty == TY_SYMBOL) {
+        check_len(interp, PRIM_DEFINE, args->cdr, eq, 1);
+        DEF_ROOT1(val);
+        val = eval(interp, args->cdr->car, env);
+        name_proc(val, var);
+        define_variable(interp, var, val, env);
+        POP_ROOT1();
+    } else if (var->ty == TY_PAIR) {
+        define_proc(interp, args, env);
+    } else {
+        ERROR("%s: argument is not a symbol or a pair", PRIM_DEFINE);
+    }
+    return VOID;
+}
+
+// `(define-macro (name . params) body...)` binds `name` to a macro. Calls to it
+// are replaced by the result of applying the transformer (with the given
+// parameters and body) to the unevaluated operands (see `expand_macro`).
+static Val* prim_define_macro(Interp* interp, Val* args, Val* env) {
+    check_len(interp, PRIM_DEFINE_MACRO, args, gt, 1);
+    check_typ(interp, PRIM_DEFINE_MACRO, args->car, TY_PAIR);
+    Val* name = args->car->car;
+    Val* params = args->car->cdr;
+    check_typ(interp, PRIM_DEFINE_MACRO, name, TY_SYMBOL);
+    check_params(interp, PRIM_DEFINE_MACRO, params);
+
+    DEF_ROOT1(macro);
+    macro = make_macro(interp, params, args->cdr, env);
+    define_variable(interp, name, macro, env);
+    POP_ROOT1();
+    return VOID;
+}
+
+static void check_lambda(Interp* interp, Val* args) {
+    check_len(interp, PRIM_LAMBDA, args, gt, 1);
+    check_params(interp, PRIM_LAMBDA, args->car);
+}
+
+static Val* prim_lambda(Interp* interp, Val* args, Val* env) {
+    check_lambda(interp, args);
+    DEF_ROOT1(penv);
+    penv = closure_env(interp, args->cdr, env);
+    Val* proc = make_comp_proc(interp, args->car, args->cdr, penv);
+    POP_ROOT1();
+    return proc;
+}
+
+static Val* prim_quote(Interp* interp, Val* args, Val* env) {
+    check_len(interp, PRIM_QUOTE, args, eq, 1);
+    return args->car;
+}
+
+static Val* prim_set(Interp* interp, Val* args, Val* env) {
+    check_len(interp, PRIM_SET, args, eq, 2);
+    Val* var = args->car;
+    check_typ(interp, PRIM_SET, var, TY_SYMBOL);
+    Val* val = eval(interp, args->cdr->car, env);
+    set_variable(interp, var, val, env);
+    return VOID;
+}
+
+static Val* prim_set_car(Interp* interp, Val* args, Val* env) {
+    check_len(interp, PRIM_SET_CAR, args, eq, 2);
+    Val* var = eval(interp, args->car, env);
+    check_typ(interp, PRIM_SET_CAR, var, TY_PAIR);
+    Val* val = eval(interp, args->cdr->car, env);
+    write_barrier(interp, var, val);
+    var->car = val;
+    return VOID;
+}
+
+static Val* prim_set_cdr(Interp* interp, Val* args, Val* env) {
+    check_len(interp, PRIM_SET_CDR, args, eq, 2);
+    Val* var = eval(interp, args->car, env);
+    check_typ(interp, PRIM_SET_CDR, var, TY_PAIR);
+    Val* val = eval(interp, args->cdr->car, env);
+    write_barrier(interp, var, val);
+    var->cdr = val;
+    return VOID;
+}
+
+static Val* prim_is_type(Interp* interp, Val* args, Val* env, char* proc,
+                         Type ty) {
+    check_len(interp, proc, args, eq, 1);
+    Val* val = eval(interp, args->car, env);
+    return val->ty & ty ? TRUE : FALSE;
+}
+
+static Val* prim_is_int(Interp* interp, Val* args, Val* env) {
+    return prim_is_type(interp, args, env, PRIM_IS_INT, TY_INT);
+}
+
+static Val* prim_is_list(Interp* interp, Val* args, Val* env) {
+    check_len(interp, PRIM_IS_LIST, args, eq, 1);
+    Val* val = eval(interp, args->car, env);
+    return len(val) < 0 ? FALSE : TRUE;
+}
+
+static Val* prim_is_pair(Interp* interp, Val* args, Val* env) {
+    return prim_is_type(interp, args, env, PRIM_IS_PAIR, TY_PAIR);
+}
+
+static Val* prim_is_proc(Interp* interp, Val* args, Val* env) {
+    return prim_is_type(interp, args, env, PRIM_IS_PROC,
+                        TY_COMP_PROC | TY_PRIM_PROC);
+}
+
+static Val* prim_is_str(Interp* interp, Val* args, Val* env) {
+    return prim_is_type(interp, args, env, PRIM_IS_STR, TY_STRING);
+}
+
+static Val* prim_is_sym(Interp* interp, Val* args, Val* env) {
+    return prim_is_type(interp, args, env, PRIM_IS_SYM, TY_SYMBOL);
+}
+
+static void print(Interp* interp, Val* val);
+
+static Val* prim_display(Interp* interp, Val* args, Val* env) {
+    check_len(interp, PRIM_DISPLAY, args, eq, 1);
+    Val* val = eval(interp, args->car, env);
+    if (val->ty == TY_STRING) {
+        fprintf(interp->out, "%s", val->str);
+    } else {
+        print(interp, val);
+    }
+    return VOID;
+}
+
+static void load_file(Interp* interp, char* path, char print_vals, Val* env);
+
+static Val* prim_load(Interp* interp, Val* args, Val* env) {
+    check_len(interp, PRIM_LOAD, args, eq, 1);
+    check_typ(interp, PRIM_LOAD, args->car, TY_STRING);
+    load_file(interp, args->car->str, 0, env);
+    return VOID;
+}
+
+static Val* prim_open_input_file(Interp* interp, Val* args, Val* env) {
+    check_len(interp, PRIM_OPEN_INPUT_FILE, args, eq, 1);
+    Val* path = eval(interp, args->car, env);
+    check_typ(interp, PRIM_OPEN_INPUT_FILE, path, TY_STRING);
+    // The port is made first, as the file would be left open if that failed.
+    PUSH_ROOT(path);
+    Val* port = make_port(interp, NULL);
+    POP_ROOT1();
+    FILE* fp = fopen(path->str, "r");
+    if (!fp) {
+        ERROR("%s: could not open '%s'", PRIM_OPEN_INPUT_FILE, path->str);
+    }
+    port_open(port, fp);
+    return port;
+}
+
+static Val* prim_close_port(Interp* interp, Val* args, Val* env) {
+    check_len(interp, PRIM_CLOSE_PORT, args, eq, 1);
+    Val* port = eval(interp, args->car, env);
+    check_typ(interp, PRIM_CLOSE_PORT, port, TY_PORT);
+    free_val_data(port);
+    return VOID;
+}
+
+// The port that `proc` was asked to read from: `stdin` if no port was given.
+static FILE* arg_port(Interp* interp, char* proc, Val* args, Val* env) {
+    check_len(interp, proc, args, lte, 1);
+    if (args == EMPTY_LIST) {
+        return stdin;
+    }
+    Val* port = eval(interp, args->car, env);
+    check_typ(interp, proc, port, TY_PORT);
+    if (!port->fp) {
+        ERROR("%s: port is closed", proc);
+    }
+    return port->fp;
+}
+
+static Val* prim_read(Interp* interp, Val* args, Val* env) {
+    FILE* fp = arg_port(interp, PRIM_READ, args, env);
+    Val* val = read(interp, fp);
+    return val ? val : EOF_OBJECT;
+}
+
+// There is no character type, so characters are read as one-character
+// strings.
+static Val* read_char(Interp* interp, char* proc, Val* args, Val* env,
+                      char consume) {
+    FILE* fp = arg_port(interp, proc, args, env);
+    int c = consume ? getc(fp) : peek(fp);
+    if (c == EOF) {
+        return EOF_OBJECT;
+    }
+    char str[2] = { c, '\0' };
+    return make_string_or_symbol(interp, TY_STRING, str);
+}
+
+static Val* prim_read_char(Interp* interp, Val* args, Val* env) {
+    return read_char(interp, PRIM_READ_CHAR, args, env, 1);
+}
+
+static Val* prim_peek_char(Interp* interp, Val* args, Val* env) {
+    return read_char(interp, PRIM_PEEK_CHAR, args, env, 0);
+}
+
+// Lines may be of any length. The newline is not included.
+static Val* prim_read_line(Interp* interp, Val* args, Val* env) {
+    // The string is made first, as the line would be leaked if that failed.
+    DEF_ROOT1(val);
+    val = alloc_val(interp, TY_STRING, __func__);
+    val->str = NULL;
+    FILE* fp = arg_port(interp, PRIM_READ_LINE, args, env);
+    POP_ROOT1();
+    char* line = NULL;
+    size_t cap = 0;
+    ssize_t size = getline(&line, &cap, fp);
+    if (size < 0) {
+        free(line);
+        return EOF_OBJECT;
+    }
+    if (size > 0 && line[size - 1] == '\n') {
+        line[size - 1] = '\0';
+    }
+    val->str = line;
+    return val;
+}
+
+static Val* prim_is_eof(Interp* interp, Val* args, Val* env) {
+    return prim_is_type(interp, args, env, PRIM_IS_EOF, TY_EOF);
+}
+
+// Reads what is left of `fp` into a buffer the caller frees.
+static unsigned char* read_all(FILE* fp, size_t* size) {
+    size_t cap = 1 << 16;
+    unsigned char* data = malloc(cap);
+    assert(data);
+    *size = 0;
+    for (size_t n; (n = fread(data + *size, 1, cap - *size, fp)) > 0;) {
+        *size += n;
+        if (*size == cap) {
+            cap *= 2;
+            data = realloc(data, cap);
+            assert(data);
+        }
+    }
+    return data;
+}
+
+// Writes a datum to a file, in the format described under FASL.
+static Val* prim_write_fasl(Interp* interp, Val* args, Val* env) {
+    check_len(interp, PRIM_WRITE_FASL, args, eq, 2);
+    DEF_ROOT2(val, path);
+    val = eval(interp, args->car, env);
+    path = eval(interp, args->cdr->car, env);
+    check_typ(interp, PRIM_WRITE_FASL, path, TY_STRING);
+    size_t size;
+    Val* bad;
+    unsigned char* data = fasl_encode(interp, val, &size, &bad);
+    if (!data) {
+        ERROR("%s: can't write a %s", PRIM_WRITE_FASL, type_name(bad->ty));
+    }
+    FILE* fp = fopen(path->str, "wb");
+    int ok = fp && fwrite(data, 1, size, fp) == size;
+    ok = fp && fclose(fp) == 0 && ok;
+    free(data);
+    if (!ok) {
+        ERROR("%s: could not write '%s'", PRIM_WRITE_FASL, path->str);
+    }
+    POP_ROOT2();
+    return VOID;
+}
+
+static Val* prim_read_fasl(Interp* interp, Val* args, Val* env) {
+    check_len(interp, PRIM_READ_FASL, args, eq, 1);
+    DEF_ROOT2(path, val);
+    path = eval(interp, args->car, env);
+    check_typ(interp, PRIM_READ_FASL, path, TY_STRING);
+    FILE* fp = fopen(path->str, "rb");
+    if (!fp) {
+        ERROR("%s: could not open '%s'", PRIM_READ_FASL, path->str);
+    }
+    size_t size;
+    unsigned char* data = read_all(fp, &size);
+    fclose(fp);
+    int ok = fasl_decode(interp, data, size, &val);
+    free(data);
+    if (!ok) {
+        ERROR("%s: '%s' is not a valid fasl file", PRIM_READ_FASL,
+              path->str);
+    }
+    POP_ROOT2();
+    return val;
+}
+
+// A record type is a record, of type `interp->record_type`, with two slots:
+// its name and the list of its fields' names. `define-record-type` (in the
+// prelude) is built on these primitives, with each field's index worked out
+// when it is expanded, so an accessor takes no more than a check of the
+// record's type.
+static Val* prim_make_record_type(Interp* interp, Val* args, Val* env) {
+    check_len(interp, PRIM_MAKE_RECORD_TYPE, args, eq, 2);
+    DEF_ROOT3(name, fields, type);
+    name = eval(interp, args->car, env);
+    check_typ(interp, PRIM_MAKE_RECORD_TYPE, name, TY_SYMBOL);
+    fields = eval(interp, args->cdr->car, env);
+    check_typ(interp, PRIM_MAKE_RECORD_TYPE, fields, TY_EMPTY_LIST | TY_PAIR);
+    for (Val* f = fields; f != EMPTY_LIST; f = f->cdr) {
+        check_typ(interp, PRIM_MAKE_RECORD_TYPE, f, TY_PAIR);
+        check_typ(interp, PRIM_MAKE_RECORD_TYPE, f->car, TY_SYMBOL);
+    }
+    type = make_record(interp, interp->record_type, 2);
+    type->slots[0] = name;
+    type->slots[1] = fields;
+    POP_ROOT3();
+    return type;
+}
+
+// Evaluates the first two of `args`, a record and its type, raising an error
+// unless the record is of that type.
+static Val* arg_record(Interp* interp, char* proc, Val* args, Val* env) {
+    DEF_ROOT2(rec, type);
+    rec = eval(interp, args->car, env);
+    type = eval(interp, args->cdr->car, env);
+    if (type->ty != TY_RECORD || type->type != interp->record_type) {
+        ERROR("%s: incorrect argument type", proc);
+    }
+    if (rec->ty != TY_RECORD || rec->type != type) {
+        ERROR("%s: argument is not a %s record", proc, type->slots[0]->str);
+    }
+    POP_ROOT2();
+    return rec;
+}
+
+// Evaluates `arg`, an index into the slots of `rec`.
+static int arg_slot(Interp* interp, char* proc, Val* rec, Val* arg, Val* env) {
+    PUSH_ROOT(rec);
+    Val* i = eval(interp, arg, env);
+    check_typ(interp, proc, i, TY_INT);
+    if (i->num < 0 || i->num >= rec->slots_size) {
+        ERROR("%s: index %d out of range", proc, i->num);
+    }
+    POP_ROOT1();
+    return i->num;
+}
+
+// `(make-record type vals...)` makes a record with a value for each field.
+static Val* prim_make_record(Interp* interp, Val* args, Val* env) {
+    check_len(interp, PRIM_MAKE_RECORD, args, gt, 0);
+    DEF_ROOT2(type, rec);
+    type = eval(interp, args->car, env);
+    if (type->ty != TY_RECORD || type->type != interp->record_type) {
+        ERROR("%s: incorrect argument type", PRIM_MAKE_RECORD);
+    }
+    int size = len(type->slots[1]);
+    check_len(interp, PRIM_MAKE_RECORD, args->cdr, eq, size);
+    rec = make_record(interp, type, size);
+    int i = 0;
+    for (args = args->cdr; args != EMPTY_LIST; args = args->cdr) {
+        rec->slots[i++] = eval(interp, args->car, env);
+    }
+    POP_ROOT2();
+    return rec;
+}
+
+static Val* prim_is_record(Interp* interp, Val* args, Val* env) {
+    check_len(interp, PRIM_IS_RECORD, args, eq, 2);
+    DEF_ROOT1(rec);
+    rec = eval(interp, args->car, env);
+    Val* type = eval(interp, args->cdr->car, env);
+    POP_ROOT1();
+    return rec->ty == TY_RECORD && rec->type == type ? TRUE : FALSE;
+}
+
+static Val* prim_record_ref(Interp* interp, Val* args, Val* env) {
+    check_len(interp, PRIM_RECORD_REF, args, eq, 3);
+    Val* rec = arg_record(interp, PRIM_RECORD_REF, args, env);
+    int i = arg_slot(interp, PRIM_RECORD_REF, rec, args->cdr->cdr->car, env);
+    return rec->slots[i];
+}
+
+// Records are never moved to the immortal region, so this needs no write
+// barrier.
+static Val* prim_record_set(Interp* interp, Val* args, Val* env) {
+    check_len(interp, PRIM_RECORD_SET, args, eq, 4);
+    DEF_ROOT1(rec);
+    rec = arg_record(interp, PRIM_RECORD_SET, args, env);
+    int i = arg_slot(interp, PRIM_RECORD_SET, rec, args->cdr->cdr->car, env);
+    rec->slots[i] = eval(interp, args->cdr->cdr->cdr->car, env);
+    POP_ROOT1();
+    return VOID;
+}
+
+// Bytevectors hold bytes unboxed, so that binary data takes a byte per byte
+// rather than a cell, and the bulk operations are done with memcpy and the
+// like.
+
+static int arg_byte(Interp* interp, char* proc, Val* arg, Val* env) {
+    Val* byte = eval(interp, arg, env);
+    check_typ(interp, proc, byte, TY_INT);
+    if (byte->num < 0 || byte->num > 255) {
+        ERROR("%s: %d is not a byte", proc, byte->num);
+    }
+    return byte->num;
+}
+
+static Val* arg_bytevector(Interp* interp, char* proc, Val* arg, Val* env) {
+    Val* bv = eval(interp, arg, env);
+    check_typ(interp, proc, bv, TY_BYTEVECTOR);
+    return bv;
+}
+
+// Evaluates `arg`, an index into `bv` no greater than `max`.
+static int arg_index(Interp* interp, char* proc, Val* bv, Val* arg, int max,
+                     Val* env) {
+    PUSH_ROOT(bv);
+    Val* i = eval(interp, arg, env);
+    check_typ(interp, proc, i, TY_INT);
+    if (i->num < 0 || i->num > max) {
+        ERROR("%s: index %d out of range", proc, i->num);
+    }
+    POP_ROOT1();
+    return i->num;
+}
+
+// Evaluates the optional `start` and `end` of a range of `bv` in `args`, which
+// default to all of it.
+static void arg_range(Interp* interp, char* proc, Val* bv, Val* args,
+                      Val* env, int* start, int* end) {
+    *start = 0;
+    *end = bv->bytes_size;
+    if (args != EMPTY_LIST) {
+        *start = arg_index(interp, proc, bv, args->car, bv->bytes_size, env);
+        args = args->cdr;
+    }
+    if (args != EMPTY_LIST) {
+        *end = arg_index(interp, proc, bv, args->car, bv->bytes_size, env);
+    }
+    if (*start > *end) {
+        ERROR("%s: range %d to %d is backwards", proc, *start, *end);
+    }
+}
+
+// `(make-bytevector k fill)`, where `fill` defaults to 0.
+static Val* prim_make_bytevector(Interp* interp, Val* args, Val* env) {
+    check_len(interp, PRIM_MAKE_BYTEVECTOR, args, gt, 0);
+    check_len(interp, PRIM_MAKE_BYTEVECTOR, args, lte, 2);
+    Val* size = eval(interp, args->car, env);
+    check_typ(interp, PRIM_MAKE_BYTEVECTOR, size, TY_INT);
+    if (size->num < 0) {
+        ERROR("%s: size must not be negative", PRIM_MAKE_BYTEVECTOR);
+    }
+    int n = size->num;
+    int fill = 0;
+    if (args->cdr != EMPTY_LIST) {
+        fill = arg_byte(interp, PRIM_MAKE_BYTEVECTOR, args->cdr->car, env);
+    }
+    Val* bv = make_bytevector(interp, n);
+    memset(bv->bytes, fill, n);
+    return bv;
+}
+
+static Val* prim_bytevector(Interp* interp, Val* args, Val* env) {
+    check_len(interp, PRIM_BYTEVECTOR, args, gte, 0);
+    DEF_ROOT1(bv);
+    bv = make_bytevector(interp, len(args));
+    for (int i = 0; args != EMPTY_LIST; args = args->cdr) {
+        bv->bytes[i++] = arg_byte(interp, PRIM_BYTEVECTOR, args->car, env);
+    }
+    POP_ROOT1();
+    return bv;
+}
+
+static Val* prim_is_bytevector(Interp* interp, Val* args, Val* env) {
+    return prim_is_type(interp, args, env, PRIM_IS_BYTEVECTOR, TY_BYTEVECTOR);
+}
+
+static Val* prim_bytevector_length(Interp* interp, Val* args, Val* env) {
+    check_len(interp, PRIM_BYTEVECTOR_LENGTH, args, eq, 1);
+    Val* bv = arg_bytevector(interp, PRIM_BYTEVECTOR_LENGTH, args->car, env);
+    return make_int(interp, bv->bytes_size);
+}
+
+static Val* prim_bytevector_ref(Interp* interp, Val* args, Val* env) {
+    check_len(interp, PRIM_BYTEVECTOR_REF, args, eq, 2);
+    Val* bv = arg_bytevector(interp, PRIM_BYTEVECTOR_REF, args->car, env);
+    int i = arg_index(interp, PRIM_BYTEVECTOR_REF, bv, args->cdr->car,
+                      bv->bytes_size - 1, env);
+    return make_int(interp, bv->bytes[i]);
+}
+
+static Val* prim_bytevector_set(Interp* interp, Val* args, Val* env) {
+    check_len(interp, PRIM_BYTEVECTOR_SET, args, eq, 3);
+    DEF_ROOT1(bv);
+    bv = arg_bytevector(interp, PRIM_BYTEVECTOR_SET, args->car, env);
+    int i = arg_index(interp, PRIM_BYTEVECTOR_SET, bv, args->cdr->car,
+                      bv->bytes_size - 1, env);
+    bv->bytes[i] = arg_byte(interp, PRIM_BYTEVECTOR_SET, args->cdr->cdr->car,
+                            env);
+    POP_ROOT1();
+    return VOID;
+}
+
+// `(bytevector-copy bv start end)` returns a new bytevector holding bytes
+// `start` up to `end` of `bv`.
+static Val* prim_bytevector_copy(Interp* interp, Val* args, Val* env) {
+    check_len(interp, PRIM_BYTEVECTOR_COPY, args, gt, 0);
+    check_len(interp, PRIM_BYTEVECTOR_COPY, args, lte, 3);
+    DEF_ROOT1(bv);
+    bv = arg_bytevector(interp, PRIM_BYTEVECTOR_COPY, args->car, env);
+    int start, end;
+    arg_range(interp, PRIM_BYTEVECTOR_COPY, bv, args->cdr, env, &start, &end);
+    Val* copy = make_bytevector(interp, end - start);
+    memcpy(copy->bytes, bv->bytes + start, end - start);
+    POP_ROOT1();
+    return copy;
+}
+
+// `(bytevector-copy! to at from start end)` copies bytes `start` up to `end`
+// of `from` into `to`, starting at `at`. The two may overlap.
+static Val* prim_bytevector_copy_to(Interp* interp, Val* args, Val* env) {
+    check_len(interp, PRIM_BYTEVECTOR_COPY_TO, args, gte, 3);
+    check_len(interp, PRIM_BYTEVECTOR_COPY_TO, args, lte, 5);
+    DEF_ROOT2(to, from);
+    to = arg_bytevector(interp, PRIM_BYTEVECTOR_COPY_TO, args->car, env);
+    int at = arg_index(interp, PRIM_BYTEVECTOR_COPY_TO, to, args->cdr->car,
+                       to->bytes_size, env);
+    from = arg_bytevector(interp, PRIM_BYTEVECTOR_COPY_TO,
+                          args->cdr->cdr->car, env);
+    int start, end;
+    arg_range(interp, PRIM_BYTEVECTOR_COPY_TO, from, args->cdr->cdr->cdr, env,
+              &start, &end);
+    if (end - start > to->bytes_size - at) {
+        ERROR("%s: %d bytes don't fit at index %d", PRIM_BYTEVECTOR_COPY_TO,
+              end - start, at);
+    }
+    memmove(to->bytes + at, from->bytes + start, end - start);
+    POP_ROOT2();
+    return VOID;
+}
+
+// `(bytevector-fill! bv fill start end)`.
+static Val* prim_bytevector_fill(Interp* interp, Val* args, Val* env) {
+    check_len(interp, PRIM_BYTEVECTOR_FILL, args, gte, 2);
+    check_len(interp, PRIM_BYTEVECTOR_FILL, args, lte, 4);
+    DEF_ROOT1(bv);
+    bv = arg_bytevector(interp, PRIM_BYTEVECTOR_FILL, args->car, env);
+    int fill = arg_byte(interp, PRIM_BYTEVECTOR_FILL, args->cdr->car, env);
+    int start, end;
+    arg_range(interp, PRIM_BYTEVECTOR_FILL, bv, args->cdr->cdr, env, &start,
+              &end);
+    memset(bv->bytes + start, fill, end - start);
+    POP_ROOT1();
+    return VOID;
+}
+
+static Val* prim_bytevector_eq(Interp* interp, Val* args, Val* env) {
+    check_len(interp, PRIM_BYTEVECTOR_EQ, args, eq, 2);
+    DEF_ROOT1(a);
+    a = arg_bytevector(interp, PRIM_BYTEVECTOR_EQ, args->car, env);
+    Val* b = arg_bytevector(interp, PRIM_BYTEVECTOR_EQ, args->cdr->car, env);
+    POP_ROOT1();
+    return a->bytes_size == b->bytes_size &&
+           memcmp(a->bytes, b->bytes, a->bytes_size) == 0 ? TRUE : FALSE;
+}
+
+// `(read-bytevector "file")` returns the whole file.
+static Val* prim_read_bytevector(Interp* interp, Val* args, Val* env) {
+    check_len(interp, PRIM_READ_BYTEVECTOR, args, eq, 1);
+    Val* path = eval(interp, args->car, env);
+    check_typ(interp, PRIM_READ_BYTEVECTOR, path, TY_STRING);
+    PUSH_ROOT(path);
+    Val* bv = make_bytevector(interp, 0);
+    POP_ROOT1();
+    FILE* fp = fopen(path->str, "rb");
+    if (!fp) {
+        ERROR("%s: could not open '%s'", PRIM_READ_BYTEVECTOR, path->str);
+    }
+    size_t size;
+    unsigned char* data = read_all(fp, &size);
+    int ok = !ferror(fp);
+    fclose(fp);
+    if (!ok || size > INT_MAX) {
+        free(data);
+        ERROR("%s: could not read '%s'", PRIM_READ_BYTEVECTOR, path->str);
+    }
+    free(bv->bytes);
+    bv->bytes = data;
+    bv->bytes_size = size;
+    return bv;
+}
+
+// `(write-bytevector bv "file" start end)` replaces the file with bytes
+// `start` up to `end` of `bv`.
+static Val* prim_write_bytevector(Interp* interp, Val* args, Val* env) {
+    check_len(interp, PRIM_WRITE_BYTEVECTOR, args, gte, 2);
+    check_len(interp, PRIM_WRITE_BYTEVECTOR, args, lte, 4);
+    DEF_ROOT2(bv, path);
+    bv = arg_bytevector(interp, PRIM_WRITE_BYTEVECTOR, args->car, env);
+    path = eval(interp, args->cdr->car, env);
+    check_typ(interp, PRIM_WRITE_BYTEVECTOR, path, TY_STRING);
+    int start, end;
+    arg_range(interp, PRIM_WRITE_BYTEVECTOR, bv, args->cdr->cdr, env, &start,
+              &end);
+    FILE* fp = fopen(path->str, "wb");
+    size_t size = end - start;
+    int ok = fp && fwrite(bv->bytes + start, 1, size, fp) == size;
+    ok = fp && fclose(fp) == 0 && ok;
+    if (!ok) {
+        ERROR("%s: could not write '%s'", PRIM_WRITE_BYTEVECTOR, path->str);
+    }
+    POP_ROOT2();
+    return VOID;
+}
+
+// `delay` (in the prelude) makes a promise of a thunk with
+// `make-lazy-promise`. Once the promise is forced, it holds the value in place
+// of the thunk, so whatever the thunk closed over can be collected.
+
+// `(make-promise obj)` returns `obj` if it is a promise, otherwise a promise
+// already forced to it.
+static Val* prim_make_promise(Interp* interp, Val* args, Val* env) {
+    check_len(interp, PRIM_MAKE_PROMISE, args, eq, 1);
+    Val* val = eval(interp, args->car, env);
+    return val->ty == TY_PROMISE ? val : make_promise(interp, val, 1);
+}
+
+static Val* prim_make_lazy_promise(Interp* interp, Val* args, Val* env) {
+    check_len(interp, PRIM_MAKE_LAZY_PROMISE, args, eq, 1);
+    Val* thunk = eval(interp, args->car, env);
+    check_typ(interp, PRIM_MAKE_LAZY_PROMISE, thunk,
+              TY_COMP_PROC | TY_PRIM_PROC);
+    return make_promise(interp, thunk, 0);
+}
+
+static Val* prim_is_promise(Interp* interp, Val* args, Val* env) {
+    return prim_is_type(interp, args, env, PRIM_IS_PROMISE, TY_PROMISE);
+}
+
+// Values other than promises are returned as they are. If forcing a promise
+// forces it again, the value of whichever finishes first is kept.
+static Val* prim_force(Interp* interp, Val* args, Val* env) {
+    check_len(interp, PRIM_FORCE, args, eq, 1);
+    DEF_ROOT1(promise);
+    promise = eval(interp, args->car, env);
+    if (promise->ty == TY_PROMISE && !promise->forced) {
+        Val* val = apply(interp, promise->promise, EMPTY_LIST, env);
+        if (!promise->forced) {
+            promise->promise = val;
+            promise->forced = 1;
+        }
+    }
+    POP_ROOT1();
+    return promise->ty == TY_PROMISE ? promise->promise : promise;
+}
+
+static Val* collect_operands(Interp* interp, Val* args, Val* env) {
+    DEF_ROOT3(sym, operands, quoted);
+    sym = intern_symbol(interp, "quote");
+
+    operands = EMPTY_LIST;
+    for (; args->cdr != EMPTY_LIST; args = args->cdr) {
+        operands = cons(interp, args->car, operands);
+    }
+    // Quote the elements of the (unwrapped) list. This is to inhibit their
+    // evaluation when they are passed in as arguments to the procedure that
+    // is invoked by `apply`. Feels rather janky.
+    Val* end_list = eval(interp, args->car, env);
+    check_typ(interp, PRIM_APPLY, end_list, TY_EMPTY_LIST | TY_PAIR);
+    for (; end_list != EMPTY_LIST; end_list = end_list->cdr) {
+        quoted = cons(interp, end_list->car, EMPTY_LIST);
+        quoted = cons(interp, sym, quoted);
+        operands = cons(interp, quoted, operands);
+    }
+    operands = rev(operands);
+    POP_ROOT3();
+    return operands;
+}
+
+static Val* prim_apply(Interp* interp, Val* args, Val* env) {
+    check_len(interp, PRIM_APPLY, args, gt, 1);
+    DEF_ROOT2(proc, operands);
+    proc = eval(interp, args->car, env);
+    check_typ(interp, PRIM_APPLY, proc, TY_COMP_PROC | TY_PRIM_PROC);
+    operands = collect_operands(interp, args->cdr, env);
+    Val* result = apply(interp, proc, operands, env);
+    POP_ROOT2();
+    return result;
+}
+
+// `(error message irritants...)` reports `message` (displayed) followed by the
+// irritants (printed).
+static Val* prim_error(Interp* interp, Val* args, Val* env) {
+    check_len(interp, PRIM_ERROR, args, gt, 0);
+    Val* vals = eval_args(interp, args, env);
+    char* msg;
+    size_t size;
+    FILE* out = interp->out;
+    interp->out = open_memstream(&msg, &size);
+    assert(interp->out);
+    for (Val* v = vals; v != EMPTY_LIST; v = v->cdr) {
+        if (v != vals) {
+            fprintf(interp->out, " ");
+        }
+        if (v == vals && v->car->ty == TY_STRING) {
+            fprintf(interp->out, "%s", v->car->str);
+        } else {
+            print(interp, v->car);
+        }
+    }
+    fclose(interp->out);
+    interp->out = out;
+
+    char buffer[STRING_MAX_LEN + 1];
+    snprintf(buffer, sizeof(buffer), "%s", msg);
+    free(msg);
+    ERROR("%s", buffer);
+}
+
+// Collects, then writes the allocation profile so far.
+static Val* prim_alloc_profile(Interp* interp, Val* args, Val* env) {
+    check_len(interp, PRIM_ALLOC_PROFILE, args, eq, 0);
+    check_not_future(interp, PRIM_ALLOC_PROFILE);
+    if (!interp->profile) {
+        ERROR("%s: profiling is off (see --profile-alloc)", PRIM_ALLOC_PROFILE);
+    }
+    collect(interp);
+    profile_report(interp, interp->out);
+    return VOID;
+}
+
+static Val* prim_heap_dump(Interp* interp, Val* args, Val* env) {
+    check_len(interp, PRIM_HEAP_DUMP, args, eq, 1);
+    Val* path = eval(interp, args->car, env);
+    check_typ(interp, PRIM_HEAP_DUMP, path, TY_STRING);
+    check_not_future(interp, PRIM_HEAP_DUMP);
+    FILE* fp = fopen(path->str, "w");
+    if (!fp) {
+        ERROR("%s: could not open '%s'", PRIM_HEAP_DUMP, path->str);
+    }
+    FuturePool* pool = interp->futures;
+    if (pool) {
+        pthread_mutex_lock(&pool->lock);
+        stop_world(pool);
+    }
+    heap_dump(interp, fp);
+    if (pool) {
+        resume_world(pool);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    fclose(fp);
+    return VOID;
+}
+
+static Val* prim_spawn(Interp* interp, Val* args, Val* env) {
+    check_len(interp, PRIM_SPAWN, args, eq, 1);
+    check_not_future(interp, PRIM_SPAWN);
+    DEF_ROOT2(thunk, thread);
+    thunk = eval(interp, args->car, env);
+    check_typ(interp, PRIM_SPAWN, thunk, TY_COMP_PROC | TY_PRIM_PROC);
+    thread = alloc_val(interp, TY_THREAD, __func__);
+    thread->thread = NULL;
+    spawn(interp, thread, thunk);
+    POP_ROOT2();
+    return thread;
+}
+
+static Val* prim_yield(Interp* interp, Val* args, Val* env) {
+    check_len(interp, PRIM_YIELD, args, eq, 0);
+    check_not_future(interp, PRIM_YIELD);
+    yield(interp);
+    return VOID;
+}
+
+// Waits for a thread to finish, returning the value of its thunk.
+static Val* prim_join(Interp* interp, Val* args, Val* env) {
+    check_len(interp, PRIM_JOIN, args, eq, 1);
+    check_not_future(interp, PRIM_JOIN);
+    DEF_ROOT1(thread);
+    thread = eval(interp, args->car, env);
+    check_typ(interp, PRIM_JOIN, thread, TY_THREAD);
+    Thread* t = thread->thread;
+    if (t == interp->thread) {
+        ERROR("%s: a thread can't join itself", PRIM_JOIN);
+    }
+    while (t->state == THREAD_RUNNABLE || t->state == THREAD_BLOCKED) {
+        block_on(interp, t);
+    }
+    if (t->state == THREAD_FAILED) {
+        ERROR("%s: thread failed", PRIM_JOIN);
+    }
+    POP_ROOT1();
+    return t->result;
+}
+
+static Val* prim_make_channel(Interp* interp, Val* args, Val* env) {
+    check_len(interp, PRIM_MAKE_CHANNEL, args, eq, 1);
+    Val* capacity = eval(interp, args->car, env);
+    check_typ(interp, PRIM_MAKE_CHANNEL, capacity, TY_INT);
+    if (capacity->num < 1) {
+        ERROR("%s: capacity must be positive", PRIM_MAKE_CHANNEL);
+    }
+    Val* channel = alloc_val(interp, TY_CHANNEL, __func__);
+    channel->items = EMPTY_LIST;
+    channel->items_end = EMPTY_LIST;
+    channel->capacity = capacity->num;
+    channel->count = 0;
+    return channel;
+}
+
+// Blocks while the channel is full.
+static Val* prim_channel_send(Interp* interp, Val* args, Val* env) {
+    check_len(interp, PRIM_CHANNEL_SEND, args, eq, 2);
+    check_not_future(interp, PRIM_CHANNEL_SEND);
+    DEF_ROOT3(channel, val, item);
+    channel = eval(interp, args->car, env);
+    check_typ(interp, PRIM_CHANNEL_SEND, channel, TY_CHANNEL);
+    val = eval(interp, args->cdr->car, env);
+    while (channel->count == channel->capacity) {
+        block_on(interp, channel);
+    }
+    item = cons(interp, val, EMPTY_LIST);
+    if (channel->items == EMPTY_LIST) {
+        channel->items = item;
+    } else {
+        channel->items_end->cdr = item;
+    }
+    channel->items_end = item;
+    channel->count++;
+    wake(interp, channel);
+    POP_ROOT3();
+    return VOID;
+}
+
+// Blocks while the channel is empty.
+static Val* prim_channel_receive(Interp* interp, Val* args, Val* env) {
+    check_len(interp, PRIM_CHANNEL_RECEIVE, args, eq, 1);
+    check_not_future(interp, PRIM_CHANNEL_RECEIVE);
+    DEF_ROOT1(channel);
+    channel = eval(interp, args->car, env);
+    check_typ(interp, PRIM_CHANNEL_RECEIVE, channel, TY_CHANNEL);
+    while (channel->count == 0) {
+        block_on(interp, channel);
+    }
+    Val* val = channel->items->car;
+    channel->items = channel->items->cdr;
+    if (channel->items == EMPTY_LIST) {
+        channel->items_end = EMPTY_LIST;
+    }
+    channel->count--;
+    wake(interp, channel);
+    POP_ROOT1();
+    return val;
+}
+
+static Val* prim_future(Interp* interp, Val* args, Val* env) {
+    check_len(interp, PRIM_FUTURE, args, eq, 1);
+    DEF_ROOT2(thunk, future);
+    thunk = eval(interp, args->car, env);
+    check_typ(interp, PRIM_FUTURE, thunk, TY_COMP_PROC | TY_PRIM_PROC);
+    future = alloc_val(interp, TY_FUTURE, __func__);
+    future->future = NULL;
+    queue_future(interp, future, thunk);
+    POP_ROOT2();
+    return future;
+}
+
+// Waits for a future to finish, returning the value of its thunk.
+static Val* prim_touch(Interp* interp, Val* args, Val* env) {
+    check_len(interp, PRIM_TOUCH, args, eq, 1);
+    DEF_ROOT1(future);
+    future = eval(interp, args->car, env);
+    check_typ(interp, PRIM_TOUCH, future, TY_FUTURE);
+    if (!touch(interp, future)) {
+        if (future->future->state == FUTURE_OVER_BUDGET) {
+            // The form that touched it is over budget too.
+            over_budget(interp, "future");
+        }
+        ERROR("%s: future failed", PRIM_TOUCH);
+    }
+    POP_ROOT1();
+    return future->future->value;
+}
+
+static void add_prim_proc(Interp* interp, char* name, PrimProc* p, Val* env) {
+    DEF_ROOT2(sym, proc);
+    sym = intern_symbol(interp, name);
+    proc = make_prim_proc(interp, p);
+    define_variable(interp, sym, proc, env);
+    POP_ROOT2();
+}
+
+static const struct {
+    char* name;
+    PrimProc* proc;
+} prim_procs[] = {
+    { PRIM_ADD, prim_add },
+    { PRIM_SUB, prim_sub },
+    { PRIM_MUL, prim_mul },
+    { PRIM_DIV, prim_div },
+
+    { PRIM_LT, prim_lt },
+    { PRIM_LTE, prim_lte },
+    { PRIM_GT, prim_gt },
+    { PRIM_GTE, prim_gte },
+    { PRIM_NUM_EQ, prim_num_eq },
+    { PRIM_EQ, prim_eq },
+
+    { PRIM_CAR, prim_car },
+    { PRIM_CDR, prim_cdr },
+    { PRIM_CONS, prim_cons },
+
+    { PRIM_IF, prim_if },
+    { PRIM_OR, prim_or },
+
+    { PRIM_BEGIN, prim_begin },
+    { PRIM_DEFINE, prim_define },
+    { PRIM_DEFINE_MACRO, prim_define_macro },
+    { PRIM_LAMBDA, prim_lambda },
+    { PRIM_QUOTE, prim_quote },
+
+    { PRIM_SET, prim_set },
+    { PRIM_SET_CAR, prim_set_car },
+    { PRIM_SET_CDR, prim_set_cdr },
+
+    { PRIM_IS_INT, prim_is_int },
+    { PRIM_IS_LIST, prim_is_list },
+    { PRIM_IS_PAIR, prim_is_pair },
+    { PRIM_IS_PROC, prim_is_proc },
+    { PRIM_IS_STR, prim_is_str },
+    { PRIM_IS_SYM, prim_is_sym },
+
+    { PRIM_DISPLAY, prim_display },
+
+    { PRIM_LOAD, prim_load },
+    { PRIM_READ, prim_read },
+    { PRIM_OPEN_INPUT_FILE, prim_open_input_file },
+    { PRIM_CLOSE_PORT, prim_close_port },
+    { PRIM_READ_CHAR, prim_read_char },
+    { PRIM_PEEK_CHAR, prim_peek_char },
+    { PRIM_READ_LINE, prim_read_line },
+    { PRIM_IS_EOF, prim_is_eof },
+
+    { PRIM_APPLY, prim_apply },
+    { PRIM_ERROR, prim_error },
+    { PRIM_ALLOC_PROFILE, prim_alloc_profile },
+    { PRIM_HEAP_DUMP, prim_heap_dump },
+
+    { PRIM_SPAWN, prim_spawn },
+    { PRIM_YIELD, prim_yield },
+    { PRIM_JOIN, prim_join },
+    { PRIM_MAKE_CHANNEL, prim_make_channel },
+    { PRIM_CHANNEL_SEND, prim_channel_send },
+    { PRIM_CHANNEL_RECEIVE, prim_channel_receive },
+    { PRIM_FUTURE, prim_future },
+    { PRIM_TOUCH, prim_touch },
+    { PRIM_WRITE_FASL, prim_write_fasl },
+    { PRIM_READ_FASL, prim_read_fasl },
+
+    { PRIM_MAKE_RECORD_TYPE, prim_make_record_type },
+    { PRIM_MAKE_RECORD, prim_make_record },
+    { PRIM_IS_RECORD, prim_is_record },
+    { PRIM_RECORD_REF, prim_record_ref },
+    { PRIM_RECORD_SET, prim_record_set },
+
+    { PRIM_MAKE_BYTEVECTOR, prim_make_bytevector },
+    { PRIM_BYTEVECTOR, prim_bytevector },
+    { PRIM_IS_BYTEVECTOR, prim_is_bytevector },
+    { PRIM_BYTEVECTOR_LENGTH, prim_bytevector_length },
+    { PRIM_BYTEVECTOR_REF, prim_bytevector_ref },
+    { PRIM_BYTEVECTOR_SET, prim_bytevector_set },
+    { PRIM_BYTEVECTOR_COPY, prim_bytevector_copy },
+    { PRIM_BYTEVECTOR_COPY_TO, prim_bytevector_copy_to },
+    { PRIM_BYTEVECTOR_FILL, prim_bytevector_fill },
+    { PRIM_BYTEVECTOR_EQ, prim_bytevector_eq },
+    { PRIM_READ_BYTEVECTOR, prim_read_bytevector },
+    { PRIM_WRITE_BYTEVECTOR, prim_write_bytevector },
+
+    { PRIM_MAKE_PROMISE, prim_make_promise },
+    { PRIM_MAKE_LAZY_PROMISE, prim_make_lazy_promise },
+    { PRIM_IS_PROMISE, prim_is_promise },
+    { PRIM_FORCE, prim_force },
+};
+
+#define PRIM_PROCS_SIZE (int)(sizeof(prim_procs) / sizeof(prim_procs[0]))
+
+static void define_prim_procs(Interp* interp, Val* env) {
+    for (int i = 0; i < PRIM_PROCS_SIZE; i++) {
+        add_prim_proc(interp, prim_procs[i].name, prim_procs[i].proc, env);
+    }
+}
+
+/*------------------------------------------------------------------------------
+ | MACRO EXPANSION
+ |
+ | Macro calls are expanded when the form containing them is loaded, so that
+ | procedure bodies are already expanded by the time they run. Calls that
+ | can't be found this way (e.g. to macros defined later, or locally) are
+ | expanded when they are first evaluated instead (see `eval`).
+ -----------------------------------------------------------------------------*/
+
+static int scope_has(Interp* interp, Val* sym) {
+    for (int i = interp->scope_size - 1; i >= 0; i--) {
+        if (interp->scope[i] == sym) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void scope_push(Interp* interp, Val* sym) {
+    if (sym->ty != TY_SYMBOL) {
+        return;
+    }
+    if (interp->scope_size == interp->scope_cap) {
+        interp->scope_cap = interp->scope_cap ? interp->scope_cap * 2 : 64;
+        interp->scope = realloc(interp->scope,
+                                interp->scope_cap * sizeof(Val*));
+        assert(interp->scope);
+    }
+    interp->scope[interp->scope_size++] = sym;
+}
+
+static void scope_push_params(Interp* interp, Val* params) {
+    for (; params->ty == TY_PAIR; params = params->cdr) {
+        scope_push(interp, params->car);
+    }
+    scope_push(interp, params);
+}
+
+// Internal definitions are in scope throughout the body they appear in.
+static void scope_push_defines(Interp* interp, Val* body);
+
+// The global binding of `sym`, unless it is shadowed by a local binding.
+static Val* global_binding(Interp* interp, Val* sym) {
+    if (sym->ty != TY_SYMBOL || scope_has(interp, sym)) {
+        return NULL;
+    }
+    return find_binding(sym, interp->global_env);
+}
+
+// The global value of `op` in operator position, unless it is shadowed by a
+// local binding. Primitives (e.g. `if`) may also appear as operators directly.
+static Val* operator_value(Interp* interp, Val* op) {
+    if (op->ty == TY_PRIM_PROC || op->ty == TY_MACRO) {
+        return op;
+    }
+    Val* binding = global_binding(interp, op);
+    return binding ? binding->car : NULL;
+}
+
+static int is_syntax(Val* op, PrimProc* proc) {
+    return op && op->ty == TY_PRIM_PROC && op->proc == proc;
+}
+
+static void expand_form(Interp* interp, Val* form);
+
+static void expand_each(Interp* interp, Val* forms) {
+    for (; forms->ty == TY_PAIR; forms = forms->cdr) {
+        expand_form(interp, forms->car);
+    }
+}
+
+static void scope_push_defines(Interp* interp, Val* body) {
+    for (Val* b = body; b->ty == TY_PAIR; b = b->cdr) {
+        Val* form = b->car;
+        if (form->ty == TY_PAIR && form->cdr->ty == TY_PAIR &&
+            is_syntax(operator_value(interp, form->car), prim_define)) {
+            Val* var = form->cdr->car;
+            scope_push(interp, var->ty == TY_PAIR ? var->car : var);
+        }
+    }
+}
+
+static void expand_body(Interp* interp, Val* params, Val* body) {
+    int scope_size = interp->scope_size;
+    scope_push_params(interp, params);
+    scope_push_defines(interp, body);
+    expand_each(interp, body);
+    interp->scope_size = scope_size;
+}
+
+static void expand_form(Interp* interp, Val* form) {
+    while (form->ty == TY_PAIR) {
+        Val* op = operator_value(interp, form->car);
+        Val* rest = form->cdr;
+        if (op && op->ty == TY_MACRO) {
+            expand_macro(interp, op, form->car, form);
+            continue;
+        }
+        if (is_syntax(op, prim_quote) || is_syntax(op, prim_define_macro) ||
+            rest->ty != TY_PAIR) {
+            return;
+        }
+        if (is_syntax(op, prim_lambda)) {
+            expand_body(interp, rest->car, rest->cdr);
+        } else if (is_syntax(op, prim_define) && rest->car->ty == TY_PAIR) {
+            expand_body(interp, rest->car->cdr, rest->cdr);
+        } else if (is_syntax(op, prim_define) || is_syntax(op, prim_set)) {
+            expand_each(interp, rest->cdr);
+        } else {
+            expand_each(interp, form);
+        }
+        return;
+    }
+}
+
+// Expands the macro calls in a top-level form, in place.
+static void expand(Interp* interp, Val* form) {
+    interp->scope_size = 0;
+    expand_form(interp, form);
+}
+
+/*------------------------------------------------------------------------------
+ | OPTIMIZER
+ |
+ | An optional pass over loaded (and expanded) code. Calls refer to primitives
+ | and global procedures directly instead of looking them up; arithmetic and
+ | comparisons on constants are folded; `if`s with constant tests are reduced to
+ | one branch; and calls to small, non-recursive global procedures are replaced
+ | by their bodies.
+ |
+ | Each rewrite assumes that some global bindings keep the values they had when
+ | the code was optimized, so rewritten code is wrapped in a guard that falls
+ | back to the original code once any of them change (see `guard_holds`).
+ -----------------------------------------------------------------------------*/
+
+#define INLINE_MAX_SIZE  16
+#define INLINE_MAX_DEPTH 4
+
+static Val* optimize_form(Interp* interp, Val* form, int depth);
+
+static Val* add_dep(Interp* interp, Val* deps, Val* binding) {
+    DEF_ROOT1(dep);
+    dep = cons(interp, binding, binding->car);
+    dep = cons(interp, dep, deps);
+    POP_ROOT1();
+    return dep;
+}
+
+// Adds the dependencies of the guards wrapping `form` to `*deps`.
+static void collect_deps(Interp* interp, Val* form, Val** deps) {
+    for (; form->ty == TY_GUARD; form = form->fast) {
+        for (Val* d = form->deps; d != EMPTY_LIST; d = d->cdr) {
+            *deps = cons(interp, d->car, *deps);
+        }
+    }
+}
+
+// If `form` (as optimized) always evaluates to the same value, returns that
+// value. Otherwise returns NULL.
+static Val* constant_of(Val* form) {
+    switch (form->ty) {
+    case TY_FALSE:
+    case TY_TRUE:
+    case TY_INT:
+    case TY_STRING:
+    case TY_VOID:
+        return form;
+    case TY_GUARD:
+        return constant_of(form->fast);
+    case TY_PAIR:
+        if (is_syntax(form->car, prim_quote) && form->cdr->ty == TY_PAIR &&
+            form->cdr->cdr == EMPTY_LIST) {
+            return form->cdr->car;
+        }
+        return NULL;
+    default:
+        return NULL;
+    }
+}
+
+// Returns code that evaluates to `val`.
+static Val* make_literal(Interp* interp, Val* val) {
+    if (val->ty & (TY_FALSE | TY_TRUE | TY_INT | TY_STRING | TY_VOID)) {
+        return val;
+    }
+    DEF_ROOT1(lit);
+    lit = cons(interp, val, EMPTY_LIST);
+    lit = cons(interp, interp->quote, lit);
+    POP_ROOT1();
+    return lit;
+}
+
+static int is_identity_comparable(Val* val) {
+    return val->ty & (TY_FALSE | TY_TRUE | TY_EMPTY_LIST | TY_SYMBOL);
+}
+
+// Folds a call to an arithmetic or comparison primitive on constant operands.
+// Returns NULL if the call can't be folded (including calls that would fail,
+// which are left to fail at runtime).
+static Val* fold_call(Interp* interp, PrimProc* proc, Val* args) {
+    int n = len(args);
+    for (Val* a = args; a != EMPTY_LIST; a = a->cdr) {
+        if (!constant_of(a->car)) {
+            return NULL;
+        }
+    }
+    if (proc == prim_eq) {
+        if (n != 2) {
+            return NULL;
+        }
+        Val* l = constant_of(args->car);
+        Val* r = constant_of(args->cdr->car);
+        if (l->ty == TY_INT && r->ty == TY_INT) {
+            return l->num == r->num ? TRUE : FALSE;
+        }
+        if (is_identity_comparable(l) && is_identity_comparable(r)) {
+            return l == r ? TRUE : FALSE;
+        }
+        return NULL;
+    }
+    for (Val* a = args; a != EMPTY_LIST; a = a->cdr) {
+        if (constant_of(a->car)->ty != TY_INT) {
+            return NULL;
+        }
+    }
+    int first = n > 0 ? constant_of(args->car)->num : 0;
+    Val* rest = n > 0 ? args->cdr : EMPTY_LIST;
+    if (proc == prim_add || proc == prim_mul) {
+        int acc = proc == prim_add ? 0 : 1;
+        for (Val* a = args; a != EMPTY_LIST; a = a->cdr) {
+            int num = constant_of(a->car)->num;
+            acc = proc == prim_add ? acc + num : acc * num;
+        }
+        return make_int(interp, acc);
+    }
+    if (n == 0) {
+        return NULL;
+    }
+    if (proc == prim_sub || proc == prim_div) {
+        if (proc == prim_sub && n == 1) {
+            return make_int(interp, -first);
+        }
+        int acc = first;
+        for (Val* a = rest; a != EMPTY_LIST; a = a->cdr) {
+            int num = constant_of(a->car)->num;
+            if (proc == prim_div && num == 0) {
+                return NULL;
+            }
+            acc = proc == prim_sub ? acc - num : acc / num;
+        }
+        return make_int(interp, acc);
+    }
+    // As in `compare`, `op` is the negation of the comparison.
+    char (*op)(int, int) = proc == prim_lt  ? gte
+                         : proc == prim_lte ? gt
+                         : proc == prim_gt  ? lte
+                         : proc == prim_gte ? lt
+                         : proc == prim_num_eq ? neq
+                         : NULL;
+    if (!op) {
+        return NULL;
+    }
+    int prev = first;
+    for (Val* a = rest; a != EMPTY_LIST; a = a->cdr) {
+        int curr = constant_of(a->car)->num;
+        if (op(prev, curr)) {
+            return FALSE;
+        }
+        prev = curr;
+    }
+    return TRUE;
+}
+
+// Returns the branch of `(if test conseq altern)` (with operands `args`) that
+// is always taken, or NULL if the test isn't constant.
+static Val* fold_if(Interp* interp, Val* args, Val** deps) {
+    int n = len(args);
+    if (n != 2 && n != 3) {
+        return NULL;
+    }
+    Val* test = constant_of(args->car);
+    if (!test) {
+        return NULL;
+    }
+    collect_deps(interp, args->car, deps);
+    if (test != FALSE) {
+        return args->cdr->car;
+    }
+    return n == 3 ? args->cdr->cdr->car : VOID;
+}
+
+// The original code of an optimized form.
+static Val* unoptimized(Val* form) {
+    while (form->ty == TY_GUARD) {
+        form = form->slow;
+    }
+    return form;
+}
+
+// Whether `form` might assign `var`. Shadowing is ignored, so this errs on
+// the side of yes.
+static int assigns(Interp* interp, Val* form, Val* var) {
+    if (form->ty == TY_GUARD) {
+        return assigns(interp, form->slow, var) ||
+               assigns(interp, form->fast, var);
+    }
+    if (form->ty != TY_PAIR) {
+        return 0;
+    }
+    Val* op = form->car;
+    if (op->ty == TY_SYMBOL) {
+        Val* binding = find_binding(op, interp->global_env);
+        op = binding ? binding->car : op;
+    }
+    if ((is_syntax(op, prim_set) || is_syntax(op, prim_define)) &&
+        form->cdr->ty == TY_PAIR) {
+        Val* target = form->cdr->car;
+        if (target == var || (target->ty == TY_PAIR && target->car == var)) {
+            return 1;
+        }
+    }
+    for (; form->ty == TY_PAIR; form = form->cdr) {
+        if (assigns(interp, form->car, var)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Checks that `form`, the body of procedure `name` with parameters `params`,
+// can be moved to a call site: it must be small, must not bind variables, must
+// not refer to `name`, and its free variables must not be shadowed where the
+// call is.
+static int inlinable_body(Interp* interp, Val* form, Val* name, Val* params,
+                          int* size) {
+    form = unoptimized(form);
+    if (++*size > INLINE_MAX_SIZE) {
+        return 0;
+    }
+    if (form->ty == TY_SYMBOL) {
+        for (Val* p = params; p != EMPTY_LIST; p = p->cdr) {
+            if (p->car == form) {
+                return 1;
+            }
+        }
+        return form != name && global_binding(interp, form);
+    }
+    if (form->ty != TY_PAIR) {
+        return 1;
+    }
+    if (len(form) < 0) {
+        return 0;
+    }
+    Val* op = unoptimized(form->car);
+    Val* opv = op->ty == TY_PRIM_PROC ? op : NULL;
+    if (op->ty == TY_SYMBOL && find_binding(op, interp->global_env)) {
+        opv = find_binding(op, interp->global_env)->car;
+    }
+    if (is_syntax(opv, prim_quote)) {
+        return 1;
+    }
+    if (opv && opv->ty == TY_PRIM_PROC &&
+        (opv->proc == prim_lambda || opv->proc == prim_define ||
+         opv->proc == prim_set || opv->proc == prim_define_macro)) {
+        return 0;
+    }
+    if (opv && opv->ty == TY_MACRO) {
+        return 0;
+    }
+    for (; form != EMPTY_LIST; form = form->cdr) {
+        if (!inlinable_body(interp, form->car, name, params, size)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Replaces the parameters in (the original code of) `form` with `args`.
+static Val* substitute(Interp* interp, Val* form, Val* params, Val* args) {
+    form = unoptimized(form);
+    if (form->ty == TY_SYMBOL) {
+        for (; params != EMPTY_LIST; params = params->cdr, args = args->cdr) {
+            if (params->car == form) {
+                return args->car;
+            }
+        }
+        return form;
+    }
+    if (form->ty != TY_PAIR) {
+        return form;
+    }
+    Val* op = unoptimized(form->car);
+    if (is_syntax(op, prim_quote) ||
+        (op->ty == TY_SYMBOL && find_binding(op, interp->global_env) &&
+         is_syntax(find_binding(op, interp->global_env)->car, prim_quote))) {
+        return form;
+    }
+    DEF_ROOT2(result, temp);
+    result = EMPTY_LIST;
+    for (; form != EMPTY_LIST; form = form->cdr) {
+        temp = substitute(interp, form->car, params, args);
+        result = cons(interp, temp, result);
+    }
+    result = rev(result);
+    POP_ROOT2();
+    return result;
+}
+
+// Counts the references to `var` in (the original code of) `form`.
+static int uses(Interp* interp, Val* form, Val* var) {
+    form = unoptimized(form);
+    if (form->ty != TY_PAIR) {
+        return form == var;
+    }
+    Val* op = unoptimized(form->car);
+    if (is_syntax(op, prim_quote) ||
+        (op->ty == TY_SYMBOL && find_binding(op, interp->global_env) &&
+         is_syntax(find_binding(op, interp->global_env)->car, prim_quote))) {
+        return 0;
+    }
+    int n = 0;
+    for (; form != EMPTY_LIST; form = form->cdr) {
+        n += uses(interp, form->car, var);
+    }
+    return n;
+}
+
+// Checks that `var` is the first thing evaluated when (the original code of)
+// `form` is, before anything that could have effects. Operators are evaluated
+// before their operands, and operands from left to right.
+static int evaluated_first(Interp* interp, Val* form, Val* var) {
+    for (;;) {
+        form = unoptimized(form);
+        if (form->ty != TY_PAIR) {
+            return form == var;
+        }
+        Val* op = unoptimized(form->car);
+        if (op->ty == TY_PAIR) {
+            form = op;
+            continue;
+        }
+        if (op == var) {
+            return 1;
+        }
+        Val* opv = op->ty == TY_PRIM_PROC ? op : NULL;
+        if (op->ty == TY_SYMBOL && find_binding(op, interp->global_env)) {
+            opv = find_binding(op, interp->global_env)->car;
+        }
+        if (is_syntax(opv, prim_quote) || is_syntax(opv, prim_lambda) ||
+            is_syntax(opv, prim_define) || is_syntax(opv, prim_set) ||
+            is_syntax(opv, prim_define_macro) || form->cdr == EMPTY_LIST) {
+            return 0;
+        }
+        form = form->cdr->car;
+    }
+}
+
+// Returns the body of global procedure `proc` (named `name`) with its
+// parameters replaced by `args`, or NULL if the call shouldn't be inlined.
+static Val* inline_call(Interp* interp, Val* name, Val* proc, Val* args,
+                        int depth) {
+    if (depth >= INLINE_MAX_DEPTH || proc->env != interp->global_env ||
+        proc->body->cdr != EMPTY_LIST) {
+        return NULL;
+    }
+    int n = len(proc->params);
+    if (n < 0 || n != len(args) || n > INLINE_MAX_SIZE) {
+        return NULL;
+    }
+    int size = 0;
+    if (!inlinable_body(interp, proc->body->car, name, proc->params, &size)) {
+        return NULL;
+    }
+    // Arguments are evaluated where their parameters are used, instead of all
+    // up front. Those that have the same value whenever (and however often)
+    // they are evaluated can be substituted anywhere: constants, and local
+    // variables that nothing assigns. Any other argument might have effects,
+    // or see those of the body, so its parameter must be used once, and
+    // before the body does anything else (as in `(not (null? x))`): it is
+    // then still evaluated once, and in the same order.
+    Val* p = proc->params;
+    for (Val* a = args; a != EMPTY_LIST; a = a->cdr, p = p->cdr) {
+        if (!constant_of(a->car) &&
+            (a->car->ty != TY_SYMBOL || !scope_has(interp, a->car) ||
+             assigns(interp, interp->optimizing, a->car)) &&
+            (uses(interp, proc->body->car, p->car) != 1 ||
+             !evaluated_first(interp, proc->body->car, p->car))) {
+            return NULL;
+        }
+    }
+    DEF_ROOT1(body);
+    body = substitute(interp, proc->body->car, proc->params, args);
+    body = optimize_form(interp, body, depth + 1);
+    POP_ROOT1();
+    return body;
+}
+
+// Optimizes each form in a list, returning a new list.
+static Val* optimize_each(Interp* interp, Val* forms, int depth) {
+    DEF_ROOT2(result, temp);
+    result = EMPTY_LIST;
+    for (; forms->ty == TY_PAIR; forms = forms->cdr) {
+        temp = optimize_form(interp, forms->car, depth);
+        result = cons(interp, temp, result);
+    }
+    result = rev(result);
+    POP_ROOT2();
+    return result;
+}
+
+static Val* optimize_body(Interp* interp, Val* params, Val* body, int depth) {
+    int scope_size = interp->scope_size;
+    scope_push_params(interp, params);
+    scope_push_defines(interp, body);
+    Val* result = optimize_each(interp, body, depth);
+    interp->scope_size = scope_size;
+    return result;
+}
+
+static Val* optimize_form(Interp* interp, Val* form, int depth) {
+    // Improper forms are left to fail at runtime.
+    if (form->ty != TY_PAIR || len(form) < 0) {
+        return form;
+    }
+    Val* binding = global_binding(interp, form->car);
+    Val* opv = binding ? binding->car : operator_value(interp, form->car);
+    Val* rest = form->cdr;
+    if (opv && opv->ty == TY_MACRO) {
+        return form;
+    }
+
+    DEF_ROOT5(op, args, deps, fast, slow);
+    op = form->car;
+    if (op->ty == TY_PAIR) {
+        op = optimize_form(interp, op, depth);
+    }
+    if (is_syntax(opv, prim_quote) || is_syntax(opv, prim_define_macro)) {
+        args = rest;
+    } else if (is_syntax(opv, prim_lambda) && rest != EMPTY_LIST) {
+        args = optimize_body(interp, rest->car, rest->cdr, depth);
+        args = cons(interp, rest->car, args);
+    } else if (is_syntax(opv, prim_define) && rest != EMPTY_LIST &&
+               rest->car->ty == TY_PAIR) {
+        args = optimize_body(interp, rest->car->cdr, rest->cdr, depth);
+        args = cons(interp, rest->car, args);
+    } else if ((is_syntax(opv, prim_define) || is_syntax(opv, prim_set)) &&
+               rest != EMPTY_LIST) {
+        args = optimize_each(interp, rest->cdr, depth);
+        args = cons(interp, rest->car, args);
+    } else {
+        args = optimize_each(interp, rest, depth);
+    }
+    slow = cons(interp, op, args);
+
+    deps = EMPTY_LIST;
+    if (binding) {
+        deps = add_dep(interp, deps, binding);
+    }
+    if (is_syntax(opv, prim_if)) {
+        fast = fold_if(interp, args, &deps);
+    } else if (opv && opv->ty == TY_PRIM_PROC) {
+        fast = fold_call(interp, opv->proc, args);
+        if (fast) {
+            for (Val* a = args; a != EMPTY_LIST; a = a->cdr) {
+                collect_deps(interp, a->car, &deps);
+            }
+            fast = make_literal(interp, fast);
+        }
+    } else if (binding && opv->ty == TY_COMP_PROC) {
+        fast = inline_call(interp, form->car, opv, args, depth);
+    } else {
+        fast = NULL;
+    }
+    if (!fast && binding && (opv->ty & (TY_PRIM_PROC | TY_COMP_PROC))) {
+        fast = cons(interp, opv, args);
+    }
+
+    Val* result = slow;
+    if (fast) {
+        result = deps == EMPTY_LIST
+               ? fast
+               : make_guard(interp, deps, fast, slow);
+    }
+    POP_ROOT5();
+    return result;
+}
+
+// Optimizes a (top-level, expanded) form.
+static Val* optimize(Interp* interp, Val* form) {
+    interp->scope_size = 0;
+    interp->optimizing = form;
+    return optimize_form(interp, form, 0);
+}
+
+/*------------------------------------------------------------------------------
+ | CLOSURE CONVERSION
+ |
+ | A closure made by a nested `lambda` keeps only what it refers to of the
+ | environment it is made in. Each (top-level, expanded) form is analysed as it
+ | is loaded: for each `lambda` in it, which frame binds each of its free
+ | variables, and whether anything assigns the variable (with `set!`, or an
+ | internal `define`). When a closure is made (see `closure_env`):
+ |
+ | - Variables that are never assigned are copied into a fresh frame, in place
+ |   of the frame that binds them.
+ | - A frame that binds an assigned variable is kept as it is. It is the box
+ |   that the closure shares with the code that assigns the variable.
+ | - Frames the closure doesn't refer to are left empty, or dropped if they
+ |   come after the last one it does. A closure that only refers to globals is
+ |   therefore closed over the global environment itself.
+ |
+ | Frames keep their place in the environment, so the frames of the closures
+ | made inside a closure are where the analysis expects them.
+ |
+ | A `lambda` might contain macro calls that haven't been expanded yet (e.g.
+ | calls to macros that are defined later, or locally). Once expanded, such a
+ | call could refer to any variable, so the closures of that `lambda` keep the
+ | whole environment. So do closures made in futures, and closures made by
+ | code loaded into anything but the global environment.
+ -----------------------------------------------------------------------------*/
+
+// The frames kept by the closures of one `lambda`, innermost first.
+// `counts[i]` is how many of `vars` are copied from frame i, or -1 if the
+// frame is kept as it is.
+struct Capture {
+    Val* body;
+    int frames;
+    int* counts;
+    Val** vars;
+};
+
+// A `lambda` being analysed. Its variables (parameters and internal
+// definitions) are `interp->scope[base]` to `interp->scope[end - 1]`.
+typedef struct Level {
+    struct Level* up;
+    Val* body;
+    int depth;
+    int base;
+    int end;
+    // Set if its closures must keep the whole environment.
+    int whole;
+    // Its free variables that enclosing `lambda`s bind, and the frame each
+    // is bound in (0 for the innermost).
+    Val** free;
+    int* frame;
+    int free_size;
+    int free_cap;
+} Level;
+
+static Capture* capture_find(Interp* interp, Val* body) {
+    if (interp->captures_size == 0) {
+        return NULL;
+    }
+    int mask = interp->captures_cap - 1;
+    int i = ((uintptr_t)body / sizeof(Val)) & mask;
+    for (; interp->captures[i]; i = (i + 1) & mask) {
+        if (interp->captures[i]->body == body) {
+            return interp->captures[i];
+        }
+    }
+    return NULL;
+}
+
+static void capture_put(Capture** table, int cap, Capture* c) {
+    int i = ((uintptr_t)c->body / sizeof(Val)) & (cap - 1);
+    while (table[i]) {
+        i = (i + 1) & (cap - 1);
+    }
+    table[i] = c;
+}
+
+static void capture_add(Interp* interp, Capture* c) {
+    if (2 * (interp->captures_size + 1) > interp->captures_cap) {
+        int cap = interp->captures_cap ? 2 * interp->captures_cap : 64;
+        Capture** table = calloc(cap, sizeof(Capture*));
+        assert(table);
+        for (int i = 0; i < interp->captures_cap; i++) {
+            if (interp->captures[i]) {
+                capture_put(table, cap, interp->captures[i]);
+            }
+        }
+        free(interp->captures);
+        interp->captures = table;
+        interp->captures_cap = cap;
+    }
+    capture_put(interp->captures, interp->captures_cap, c);
+    interp->captures_size++;
+}
+
+// Drops the entries for bodies that are about to be swept, so that code
+// allocated in the same cells later doesn't inherit them. Called between
+// marking and sweeping.
+static void capture_sweep(Interp* interp) {
+    Capture** old = interp->captures;
+    interp->captures = calloc(interp->captures_cap, sizeof(Capture*));
+    assert(interp->captures);
+    interp->captures_size = 0;
+    for (int i = 0; i < interp->captures_cap; i++) {
+        Capture* c = old[i];
+        if (c && (c->body->marked || !is_heap_val(interp, c->body))) {
+            capture_put(interp->captures, interp->captures_cap, c);
+            interp->captures_size++;
+        } else {
+            free(c);
+        }
+    }
+    free(old);
+}
+
+static void capture_free(Interp* interp) {
+    for (int i = 0; i < interp->captures_cap; i++) {
+        free(interp->captures[i]);
+    }
+    free(interp->captures);
+}
+
+static void capture_whole(Level* level) {
+    for (; level; level = level->up) {
+        level->whole = 1;
+    }
+}
+
+// Records that `var` is referred to in `level`, and so is free in each
+// `lambda` between it and the one that binds `var` (if any does).
+static void capture_var(Interp* interp, Level* level, Val* var) {
+    Level* binder = level;
+    for (; binder; binder = binder->up) {
+        int i = binder->base;
+        while (i < binder->end && interp->scope[i] != var) {
+            i++;
+        }
+        if (i < binder->end) {
+            break;
+        }
+    }
+    if (!binder) {
+        return;
+    }
+    for (Level* l = level; l != binder; l = l->up) {
+        int i = 0;
+        while (i < l->free_size && l->free[i] != var) {
+            i++;
+        }
+        if (i < l->free_size) {
+            continue;
+        }
+        if (l->free_size == l->free_cap) {
+            l->free_cap = l->free_cap ? 2 * l->free_cap : 8;
+            l->free = realloc(l->free, l->free_cap * sizeof(Val*));
+            l->frame = realloc(l->frame, l->free_cap * sizeof(int));
+            assert(l->free && l->frame);
+        }
+        l->free[l->free_size] = var;
+        l->frame[l->free_size] = l->depth - binder->depth - 1;
+        l->free_size++;
+    }
+}
+
+// Adds the variables that `form` defines in the frame it runs in to the
+// scope. These may be anywhere in it, not just at the start of a body.
+static void capture_defines(Interp* interp, Val* form) {
+    if (form->ty == TY_GUARD) {
+        capture_defines(interp, form->slow);
+        capture_defines(interp, form->fast);
+        return;
+    }
+    if (form->ty != TY_PAIR) {
+        return;
+    }
+    Val* op = operator_value(interp, form->car);
+    Val* rest = form->cdr;
+    if (is_syntax(op, prim_quote) || is_syntax(op, prim_lambda) ||
+        is_syntax(op, prim_define_macro)) {
+        return;
+    }
+    if (is_syntax(op, prim_define) && rest->ty == TY_PAIR) {
+        if (rest->car->ty == TY_PAIR) {
+            scope_push(interp, rest->car->car);
+            return;
+        }
+        scope_push(interp, rest->car);
+    }
+    for (; form->ty == TY_PAIR; form = form->cdr) {
+        capture_defines(interp, form->car);
+    }
+}
+
+static Capture* capture_make(Interp* interp, Level* level) {
+    int frames = 0;
+    for (int i = 0; i < level->free_size; i++) {
+        if (level->frame[i] >= frames) {
+            frames = level->frame[i] + 1;
+        }
+    }
+    Capture* c = malloc(sizeof(Capture) + level->free_size * sizeof(Val*) +
+                        frames * sizeof(int));
+    assert(c);
+    c->body = level->body;
+    c->frames = frames;
+    c->vars = (Val**)(c + 1);
+    c->counts = (int*)(c->vars + level->free_size);
+    int n = 0;
+    Level* binder = level->up;
+    for (int f = 0; f < frames; f++, binder = binder->up) {
+        c->counts[f] = 0;
+        for (int i = 0; i < level->free_size; i++) {
+            if (level->frame[i] != f) {
+                continue;
+            }
+            if (assigns(interp, binder->body, level->free[i])) {
+                c->counts[f] = -1;
+                break;
+            }
+            c->vars[n + c->counts[f]++] = level->free[i];
+        }
+        if (c->counts[f] > 0) {
+            n += c->counts[f];
+        }
+    }
+    return c;
+}
+
+static void capture_lambda(Interp* interp, Level* up, Val* params,
+                           Val* body);
+
+static void capture_form(Interp* interp, Level* level, Val* form) {
+    if (form->ty == TY_SYMBOL) {
+        capture_var(interp, level, form);
+        return;
+    }
+    if (form->ty == TY_GUARD) {
+        capture_form(interp, level, form->slow);
+        capture_form(interp, level, form->fast);
+        return;
+    }
+    if (form->ty != TY_PAIR) {
+        return;
+    }
+    Val* op = operator_value(interp, form->car);
+    Val* rest = form->cdr;
+    if ((op && op->ty == TY_MACRO) || is_syntax(op, prim_define_macro) ||
+        (!op && form->car->ty == TY_SYMBOL && !scope_has(interp, form->car))) {
+        // Once expanded, the call could be anything (and its operands could
+        // end up anywhere).
+        capture_whole(level);
+        return;
+    }
+    if (is_syntax(op, prim_quote)) {
+        return;
+    }
+    if (is_syntax(op, prim_lambda) && rest->ty == TY_PAIR) {
+        capture_lambda(interp, level, rest->car, rest->cdr);
+        return;
+    }
+    if (is_syntax(op, prim_define) && rest->ty == TY_PAIR &&
+        rest->car->ty == TY_PAIR) {
+        capture_form(interp, level, rest->car->car);
+        capture_lambda(interp, level, rest->car->cdr, rest->cdr);
+        return;
+    }
+    for (; form->ty == TY_PAIR; form = form->cdr) {
+        capture_form(interp, level, form->car);
+    }
+}
+
+static void capture_lambda(Interp* interp, Level* up, Val* params,
+                           Val* body) {
+    Level level = { .up = up, .body = body, .depth = up ? up->depth + 1 : 0 };
+    int scope_size = interp->scope_size;
+    level.base = scope_size;
+    scope_push_params(interp, params);
+    for (Val* b = body; b->ty == TY_PAIR; b = b->cdr) {
+        capture_defines(interp, b->car);
+    }
+    level.end = interp->scope_size;
+    for (Val* b = body; b->ty == TY_PAIR; b = b->cdr) {
+        capture_form(interp, &level, b->car);
+    }
+    interp->scope_size = scope_size;
+    // Closures made at the top level are closed over the global environment
+    // anyway.
+    if (up && !level.whole && !capture_find(interp, body)) {
+        capture_add(interp, capture_make(interp, &level));
+    }
+    free(level.free);
+    free(level.frame);
+}
+
+// Analyses the `lambda`s in a (top-level, expanded) form.
+static void capture(Interp* interp, Val* form) {
+    if (interp->future_depth > 0) {
+        return;
+    }
+    interp->scope_size = 0;
+    capture_form(interp, NULL, form);
+}
+
+// The environment for a closure over `env` made by the `lambda` with body
+// `body`: a copy of `env` with only what the closure refers to.
+static Val* closure_env(Interp* interp, Val* body, Val* env) {
+    Capture* c = capture_find(interp, body);
+    if (!c) {
+        return env;
+    }
+    Val* frames[c->frames + 1];
+    int n = 0;
+    Val* e = env;
+    for (int f = 0; f < c->frames; f++, e = e->cdr) {
+        // Shouldn't happen, but code made to run somewhere other than where
+        // it was analysed is better off keeping everything.
+        if (e == interp->global_env || e->ty != TY_PAIR) {
+            return env;
+        }
+        frames[f] = e->car;
+        if (c->counts[f] > 0) {
+            n += c->counts[f];
+        }
+    }
+    DEF_ROOT4(result, frame, vars, vals);
+    result = interp->global_env;
+    for (int f = c->frames - 1; f >= 0; f--) {
+        if (c->counts[f] < 0) {
+            frame = frames[f];
+        } else {
+            n -= c->counts[f];
+            vars = EMPTY_LIST;
+            vals = EMPTY_LIST;
+            for (int i = n; i < n + c->counts[f]; i++) {
+                Val* v = frames[f]->car;
+                Val* x = frames[f]->cdr;
+                for (; v != EMPTY_LIST && v->car != c->vars[i];
+                     v = v->cdr, x = x->cdr) {
+                }
+                if (v == EMPTY_LIST) {
+                    POP_ROOT4();
+                    return env;
+                }
+                vars = cons(interp, c->vars[i], vars);
+                vals = cons(interp, x->car, vals);
+            }
+            frame = cons(interp, vars, vals);
+        }
+        result = cons(interp, frame, result);
+    }
+    POP_ROOT4();
+    return result;
+}
+
+/*------------------------------------------------------------------------------
+ | CEK MACHINE
+ |
+ | With `--cek`, code is evaluated by a machine whose state is a control (the
+ | form being evaluated, or the value being returned), an environment, and a
+ | continuation: a stack of frames, each saying what to do with the value of a
+ | subform. The stack is GC traced and grows as needed, so unlike `eval`, which
+ | recurses on the C stack, the depth of recursion is limited only by memory.
+ | Calls in tail position push nothing.
+ |
+ | Special forms are run by the machine itself. Primitives that take evaluated
+ | arguments are called with each value quoted (see `make_literal`), so that
+ | their evaluation of the arguments is trivial.
+ -----------------------------------------------------------------------------*/
+
+typedef enum KontOp {
+    // The operator of `form` is being evaluated.
+    K_COMBINATION,
+    // An operand is being evaluated: `form` holds those still to evaluate,
+    // and `vals` the values so far (reversed), for a call to `proc`.
+    K_OPERAND,
+    // The test of `(if . form)` is being evaluated.
+    K_IF,
+    // An operand of `or` is being evaluated, with `form` still to come.
+    K_OR,
+    // A body is being evaluated, with the forms in `form` still to come.
+    K_BODY,
+    // The value of `(define form ...)` or `(set! form ...)` is being
+    // evaluated.
+    K_DEFINE,
+    K_SET,
+    // Compound procedure `proc` is running, called while `vals` was (see
+    // `proc_enter`). With `--perf`, `perf` is its frame of the shadow stack.
+    // A call in tail position takes over the frame of the procedure it
+    // replaces.
+    K_RETURN,
+} KontOp;
+
+struct Kont {
+    KontOp op;
+    Val* form;
+    Val* vals;
+    Val* proc;
+    Val* env;
+    PerfFrame* perf;
+};
+
+static void kont_push(Interp* interp, KontOp op, Val* form, Val* vals,
+                      Val* proc, Val* env) {
+    if (interp->kont_size == interp->kont_cap) {
+        interp->kont_cap = interp->kont_cap ? interp->kont_cap * 2 : 256;
+        interp->kont = realloc(interp->kont, interp->kont_cap * sizeof(Kont));
+        assert(interp->kont);
+    }
+    interp->kont[interp->kont_size++] = (Kont){ op, form, vals, proc, env,
+                                                NULL };
+}
+
+// Drops the frames above `kont_size`, as an error unwinds them.
+static void kont_unwind(Interp* interp, int kont_size) {
+    for (int i = kont_size; i < interp->kont_size; i++) {
+        free(interp->kont[i].perf);
+    }
+    interp->kont_size = kont_size;
+}
+
+static void kont_mark(Interp* interp, Kont* kont, int kont_size) {
+    for (int i = 0; i < kont_size; i++) {
+        Kont* k = &kont[i];
+        mark(interp, k->form);
+        mark(interp, k->vals);
+        mark(interp, k->proc);
+        mark(interp, k->env);
+    }
+}
+
+static void kont_dump(Dump* d, Kont* kont, int kont_size) {
+    for (int i = 0; i < kont_size; i++) {
+        Kont* k = &kont[i];
+        dump_root(d, "continuation", NULL, k->form);
+        dump_root(d, "continuation", NULL, k->vals);
+        dump_root(d, "continuation", NULL, k->proc);
+        dump_root(d, "continuation", NULL, k->env);
+    }
+}
+
+// Returns the first of the forms of a body to evaluate, having pushed the
+// rest, or NULL if there are none.
+static Val* kont_body(Interp* interp, Val* forms, Val* env) {
+    if (forms == EMPTY_LIST) {
+        return NULL;
+    }
+    if (forms->cdr != EMPTY_LIST) {
+        kont_push(interp, K_BODY, forms->cdr, NULL, NULL, env);
+    }
+    return forms->car;
+}
+
+// The arguments of `(apply proc args... list)` (without `proc`), as a fresh
+// list.
+static Val* spread_args(Interp* interp, Val* vals) {
+    DEF_ROOT1(spread);
+    spread = EMPTY_LIST;
+    for (; vals->cdr != EMPTY_LIST; vals = vals->cdr) {
+        spread = cons(interp, vals->car, spread);
+    }
+    check_typ(interp, PRIM_APPLY, vals->car, TY_EMPTY_LIST | TY_PAIR);
+    for (Val* v = vals->car; v->ty == TY_PAIR; v = v->cdr) {
+        spread = cons(interp, v->car, spread);
+    }
+    spread = rev(spread);
+    POP_ROOT1();
+    return spread;
+}
+
+// Comparisons stop evaluating their operands at the first comparison that
+// fails (see `compare`).
+static const struct {
+    PrimProc* proc;
+    char* name;
+    char (*fails)(int, int);
+} comparisons[] = {
+    { prim_lt, PRIM_LT, gte },
+    { prim_lte, PRIM_LTE, gt },
+    { prim_gt, PRIM_GT, lte },
+    { prim_gte, PRIM_GTE, lt },
+    { prim_num_eq, PRIM_NUM_EQ, neq },
+};
+
+// Whether a call to `proc` has failed, given the values of its operands so
+// far (newest first).
+static int comparison_fails(Interp* interp, Val* proc, Val* vals) {
+    for (int i = 0; i < (int)(sizeof(comparisons) / sizeof(comparisons[0]));
+         i++) {
+        if (proc->ty == TY_PRIM_PROC && proc->proc == comparisons[i].proc) {
+            check_typ(interp, comparisons[i].name, vals->car, TY_INT);
+            return vals->cdr != EMPTY_LIST &&
+                   comparisons[i].fails(vals->cdr->car->num, vals->car->num);
+        }
+    }
+    return 0;
+}
+
+typedef enum CekMode { CEK_EVAL, CEK_RETURN, CEK_APPLY } CekMode;
+
+static Val* cek_eval(Interp* interp, Val* form, Val* env) {
+    // Frames below `base` belong to whoever (further up the C stack) is
+    // waiting for this evaluation.
+    int base = interp->kont_size;
+    // `c` is the form to evaluate, `v` the value to return, and `proc` and
+    // `vals` the procedure to apply and its arguments.
+    DEF_ROOT5(c, e, v, proc, vals);
+    DEF_ROOT1(f);
+    c = form;
+    e = env;
+    CekMode mode = CEK_EVAL;
+    for (;;) {
+        if (mode == CEK_EVAL) {
+            mode = CEK_RETURN;
+            switch (c->ty) {
+            case TY_SYMBOL:
+                v = lookup_variable(interp, c, e);
+                break;
+            case TY_GUARD:
+                c = guard_holds(c) ? c->fast : c->slow;
+                mode = CEK_EVAL;
+                break;
+            case TY_EMPTY_LIST:
+                ERROR("empty application: ()");
+            case TY_PAIR:
+                // The continuation stands in for the C stack here.
+                if (interp->budgeted) {
+                    budget_step(interp, interp->kont_size);
+                }
+                kont_push(interp, K_COMBINATION, c, NULL, c->car, e);
+                c = c->car;
+                mode = CEK_EVAL;
+                break;
+            default:
+                v = c;
+                break;
+            }
+        } else if (mode == CEK_APPLY) {
+            if (proc->ty == TY_COMP_PROC) {
+                e = bind_params(interp, proc->params, vals, proc->env);
+                Kont* top = interp->kont_size > base
+                          ? &interp->kont[interp->kont_size - 1] : NULL;
+                if (top && top->op == K_RETURN) {
+                    proc_leave(interp, top->proc, top->vals, top->perf);
+                    top->proc = proc;
+                    proc_enter(interp, proc, top->perf);
+                } else {
+                    PerfFrame* frame = NULL;
+                    if (interp->perf) {
+                        frame = malloc(sizeof(PerfFrame));
+                        assert(frame);
+                    }
+                    kont_push(interp, K_RETURN, NULL, interp->running, proc,
+                              NULL);
+                    interp->kont[interp->kont_size - 1].perf = frame;
+                    proc_enter(interp, proc, frame);
+                }
+                c = kont_body(interp, proc->body, e);
+                mode = c ? CEK_EVAL : CEK_RETURN;
+                v = VOID;
+            } else if (proc->ty == TY_PRIM_PROC && proc->proc == prim_apply) {
+                check_len(interp, PRIM_APPLY, vals, gt, 1);
+                check_typ(interp, PRIM_APPLY, vals->car,
+                          TY_COMP_PROC | TY_PRIM_PROC);
+                proc = vals->car;
+                vals = spread_args(interp, vals->cdr);
+            } else if (proc->ty == TY_PRIM_PROC) {
+                for (Val* a = vals; a != EMPTY_LIST; a = a->cdr) {
+                    a->car = make_literal(interp, a->car);
+                }
+                v = proc->proc(interp, vals, e);
+                mode = CEK_RETURN;
+            } else {
+                ERROR("unknown procedure type");
+            }
+        } else if (interp->kont_size == base) {
+            break;
+        } else {
+            Kont k = interp->kont[--interp->kont_size];
+            f = k.form;
+            e = k.env;
+            switch (k.op) {
+            case K_COMBINATION: {
+                proc = v;
+                Val* args = f->cdr;
+                PrimProc* p = proc->ty == TY_PRIM_PROC ? proc->proc : NULL;
+                if (proc->ty == TY_MACRO) {
+                    expand_macro(interp, proc, k.proc, f);
+                    c = f;
+                    mode = CEK_EVAL;
+                } else if (p == prim_if) {
+                    check_len(interp, PRIM_IF, args, gt, 1);
+                    kont_push(interp, K_IF, args, NULL, NULL, e);
+                    c = args->car;
+                    mode = CEK_EVAL;
+                } else if (p == prim_or) {
+                    v = FALSE;
+                    if (args != EMPTY_LIST) {
+                        if (args->cdr != EMPTY_LIST) {
+                            kont_push(interp, K_OR, args->cdr, NULL, NULL, e);
+                        }
+                        c = args->car;
+                        mode = CEK_EVAL;
+                    }
+                } else if (p == prim_begin) {
+                    c = kont_body(interp, args, e);
+                    mode = c ? CEK_EVAL : CEK_RETURN;
+                    v = VOID;
+                } else if ((p == prim_define || p == prim_set) &&
+                           len(args) == 2 && args->car->ty == TY_SYMBOL) {
+                    kont_push(interp, p == prim_define ? K_DEFINE : K_SET,
+                              args->car, NULL, NULL, e);
+                    c = args->cdr->car;
+                    mode = CEK_EVAL;
+                } else if (p == prim_quote || p == prim_lambda ||
+                           p == prim_define || p == prim_set ||
+                           p == prim_define_macro) {
+                    // Nothing (more) to evaluate.
+                    v = p(interp, args, e);
+                } else if (args->ty == TY_PAIR) {
+                    kont_push(interp, K_OPERAND, args->cdr, EMPTY_LIST, proc,
+                              e);
+                    c = args->car;
+                    mode = CEK_EVAL;
+                } else if (args == EMPTY_LIST) {
+                    vals = EMPTY_LIST;
+                    mode = CEK_APPLY;
+                } else {
+                    ERROR("improper list of operands");
+                }
+                break;
+            }
+            case K_OPERAND:
+                proc = k.proc;
+                vals = k.vals;
+                vals = cons(interp, v, vals);
+                if (comparison_fails(interp, proc, vals)) {
+                    v = FALSE;
+                } else if (f->ty == TY_PAIR) {
+                    kont_push(interp, K_OPERAND, f->cdr, vals, proc, e);
+                    c = f->car;
+                    mode = CEK_EVAL;
+                } else if (f == EMPTY_LIST) {
+                    vals = rev(vals);
+                    mode = CEK_APPLY;
+                } else {
+                    ERROR("improper list of operands");
+                }
+                break;
+            case K_IF:
+                if (v != FALSE) {
+                    c = f->cdr->car;
+                    mode = CEK_EVAL;
+                } else if (f->cdr->cdr != EMPTY_LIST) {
+                    c = f->cdr->cdr->car;
+                    mode = CEK_EVAL;
+                } else {
+                    v = VOID;
+                }
+                break;
+            case K_OR:
+                if (v == FALSE) {
+                    if (f->cdr != EMPTY_LIST) {
+                        kont_push(interp, K_OR, f->cdr, NULL, NULL, e);
+                    }
+                    c = f->car;
+                    mode = CEK_EVAL;
+                }
+                break;
+            case K_BODY:
+                c = kont_body(interp, f, e);
+                mode = CEK_EVAL;
+                break;
+            case K_DEFINE:
+                define_variable(interp, f, v, e);
+                v = VOID;
+                break;
+            case K_SET:
+                set_variable(interp, f, v, e);
+                v = VOID;
+                break;
+            case K_RETURN:
+                proc_leave(interp, k.proc, k.vals, k.perf);
+                free(k.perf);
+                break;
+            }
+        }
+    }
+    POP_ROOT5();
+    POP_ROOT1();
+    return v;
+}
+
+/*------------------------------------------------------------------------------
+ | JIT
+ |
+ | With the JIT enabled, the body of a compound procedure is compiled to x86-64
+ | code on its `jit_threshold`th call. Compiled code evaluates
+ | variables, `if`, `begin`, `or`, `quote`, integer arithmetic and comparisons,
+ | `car`, `cdr`, `cons`, `eq?` and calls to compound procedures itself. Any
+ | other form is handed back to `eval`.
+ |
+ | Code is compiled against the bindings that operators had at the time, and
+ | checks each of them before running the form that depends on it. If one has
+ | changed (or a variable lookup can't take the fast path), the form falls
+ | back to `eval`, so compiled code always behaves like the interpreter.
+ |
+ | Compiled code keeps every value it still needs in a slot array registered
+ | as GC roots (see `jit_run`), and untagged integers in its native stack
+ | frame, where the GC never looks.
+ -----------------------------------------------------------------------------*/
+
+#define JIT_THRESHOLD 100
+#define JIT_DEPTH_MAX 64
+
+// Compiled code (or the call count so far) for one procedure body, shared by
+// all procedures created from the same `lambda`.
+struct JitEntry {
+    Val* body;
+    int calls;
+    int failed;
+    // Whether the code assumes that the procedure is closed over the global
+    // environment (i.e. that variables not in its frame are global).
+    int global;
+    int slots;
+    PonyoCode* code;
+    size_t code_size;
+};
+
+// Returns the entry for `body`, or NULL if it has none.
+static JitEntry* jit_find(Interp* interp, Val* body) {
+    if (interp->jit_entries_size == 0) {
+        return NULL;
+    }
+    int mask = interp->jit_entries_cap - 1;
+    int i = ((uintptr_t)body / sizeof(Val)) & mask;
+    for (; interp->jit_entries[i]; i = (i + 1) & mask) {
+        if (interp->jit_entries[i]->body == body) {
+            return interp->jit_entries[i];
+        }
+    }
+    return NULL;
+}
+
+// Returns the entry for `body`, creating it if necessary.
+static JitEntry* jit_entry(Interp* interp, Val* body) {
+    JitEntry* e = jit_find(interp, body);
+    if (e) {
+        return e;
+    }
+    if (2 * (interp->jit_entries_size + 1) > interp->jit_entries_cap) {
+        int cap = interp->jit_entries_cap ? 2 * interp->jit_entries_cap : 64;
+        JitEntry** entries = calloc(cap, sizeof(JitEntry*));
+        assert(entries);
+        for (int i = 0; i < interp->jit_entries_cap; i++) {
+            JitEntry* e = interp->jit_entries[i];
+            if (e) {
+                int j = ((uintptr_t)e->body / sizeof(Val)) & (cap - 1);
+                while (entries[j]) {
+                    j = (j + 1) & (cap - 1);
+                }
+                entries[j] = e;
+            }
+        }
+        free(interp->jit_entries);
+        interp->jit_entries = entries;
+        interp->jit_entries_cap = cap;
+    }
+    int mask = interp->jit_entries_cap - 1;
+    int i = ((uintptr_t)body / sizeof(Val)) & mask;
+    while (interp->jit_entries[i]) {
+        i = (i + 1) & mask;
+    }
+    e = calloc(1, sizeof(JitEntry));
+    assert(e);
+    e->body = body;
+    interp->jit_entries[i] = e;
+    interp->jit_entries_size++;
+    // Compiled code refers to the body (and the values it quotes), so bodies
+    // with entries are kept alive for the lifetime of the instance.
+    interp->jit_roots = cons(interp, body, interp->jit_roots);
+    return e;
+}
+
+// Keeps `val`, which compiled code refers to, alive.
+static void jit_keep(Interp* interp, Val* val) {
+    interp->jit_roots = cons(interp, val, interp->jit_roots);
+}
+
+static Val* jit_call(Interp* interp, Val* proc, int argc, Val** args);
+
+static void jit_type_error(Interp* interp, char* proc) {
+    ERROR("%s: incorrect argument type", proc);
+}
+
+// Whether compiled code evaluates calls to primitive `proc` with `n` operands
+// itself (rather than through `eval`).
+static int is_compiled_prim(PrimProc* proc, int n) {
+    if (proc == prim_quote || proc == prim_car || proc == prim_cdr) {
+        return n == 1;
+    } else if (proc == prim_if) {
+        return n == 2 || n == 3;
+    } else if (proc == prim_begin) {
+        return 1;
+    } else if (proc == prim_or) {
+        return n <= JIT_DEPTH_MAX;
+    } else if (proc == prim_cons || proc == prim_eq) {
+        return n == 2;
+    } else if (proc == prim_add || proc == prim_sub || proc == prim_mul ||
+               proc == prim_lt || proc == prim_lte || proc == prim_gt ||
+               proc == prim_gte || proc == prim_num_eq) {
+        return n > 0;
+    }
+    return 0;
+}
+
+static Val* jit_eq(Val* l, Val* r) {
+    if (l->ty == TY_INT && r->ty == TY_INT) {
+        return l->num == r->num ? TRUE : FALSE;
+    }
+    return l == r ? TRUE : FALSE;
+}
+
+// Allocations made by compiled code.
+static Val* jit_cons(Interp* interp, Val* car, Val* cdr) {
+    return cons(interp, car, cdr);
+}
+
+static Val* jit_make_int(Interp* interp, int num) {
+    return make_int(interp, num);
+}
+
+#if defined(__x86_64__)
+
+// A minimal x86-64 assembler, covering the instructions the compiler needs.
+
+enum { RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7,
+       R12 = 12, R13 = 13, R14 = 14 };
+
+// Condition codes.
+enum { CC_E = 0x4, CC_NE = 0x5, CC_L = 0xc, CC_GE = 0xd, CC_LE = 0xe,
+       CC_G = 0xf };
+
+typedef struct Asm {
+    unsigned char* buf;
+    size_t size;
+    size_t cap;
+} Asm;
+
+static void emit(Asm* a, int byte) {
+    if (a->size == a->cap) {
+        a->cap = a->cap ? 2 * a->cap : 1024;
+        a->buf = realloc(a->buf, a->cap);
+        assert(a->buf);
+    }
+    a->buf[a->size++] = byte;
+}
+
+static void emit32(Asm* a, uint32_t v) {
+    for (int i = 0; i < 4; i++) {
+        emit(a, (v >> (8 * i)) & 0xff);
+    }
+}
+
+static void emit64(Asm* a, uint64_t v) {
+    emit32(a, v);
+    emit32(a, v >> 32);
+}
+
+static void emit_rex(Asm* a, int w, int reg, int base) {
+    int rex = 0x40 | (w << 3) | ((reg >> 3) << 2) | (base >> 3);
+    if (rex != 0x40) {
+        emit(a, rex);
+    }
+}
+
+// ModRM (and SIB) for `[base + disp]`.
+static void emit_mem(Asm* a, int reg, int base, int disp) {
+    emit(a, 0x80 | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == RSP) {
+        emit(a, 0x24);
+    }
+    emit32(a, disp);
+}
+
+// `op reg, [base + disp]` (or the reverse, depending on `op`).
+static void asm_op_mem(Asm* a, int w, int op, int reg, int base, int disp) {
+    emit_rex(a, w, reg, base);
+    if (op > 0xff) {
+        emit(a, op >> 8);
+    }
+    emit(a, op & 0xff);
+    emit_mem(a, reg, base, disp);
+}
+
+static void asm_load(Asm* a, int dst, int base, int disp) {
+    asm_op_mem(a, 1, 0x8b, dst, base, disp);
+}
+
+static void asm_store(Asm* a, int base, int disp, int src) {
+    asm_op_mem(a, 1, 0x89, src, base, disp);
+}
+
+static void asm_load32(Asm* a, int dst, int base, int disp) {
+    asm_op_mem(a, 0, 0x8b, dst, base, disp);
+}
+
+static void asm_store32(Asm* a, int base, int disp, int src) {
+    asm_op_mem(a, 0, 0x89, src, base, disp);
+}
+
+static void asm_mov_imm(Asm* a, int reg, const void* imm) {
+    emit_rex(a, 1, 0, reg);
+    emit(a, 0xb8 + (reg & 7));
+    emit64(a, (uintptr_t)imm);
+}
+
+static void asm_mov_imm32(Asm* a, int reg, int imm) {
+    emit_rex(a, 0, 0, reg);
+    emit(a, 0xb8 + (reg & 7));
+    emit32(a, imm);
+}
+
+static void asm_mov(Asm* a, int dst, int src) {
+    emit_rex(a, 1, src, dst);
+    emit(a, 0x89);
+    emit(a, 0xc0 | ((src & 7) << 3) | (dst & 7));
+}
+
+// Sets flags for `l - r`.
+static void asm_cmp(Asm* a, int w, int l, int r) {
+    emit_rex(a, w, r, l);
+    emit(a, 0x39);
+    emit(a, 0xc0 | ((r & 7) << 3) | (l & 7));
+}
+
+static void asm_cmp_mem(Asm* a, int base, int disp, int reg) {
+    asm_op_mem(a, 1, 0x39, reg, base, disp);
+}
+
+static void asm_cmp_mem_imm32(Asm* a, int base, int disp, int imm) {
+    asm_op_mem(a, 0, 0x81, 7, base, disp);
+    emit32(a, imm);
+}
+
+static void asm_call(Asm* a, const void* fn) {
+    asm_mov_imm(a, RAX, fn);
+    emit(a, 0xff);
+    emit(a, 0xd0);
+}
+
+// Jumps return the offset of their target, to be set with `asm_bind`.
+static size_t asm_jcc(Asm* a, int cc) {
+    emit(a, 0x0f);
+    emit(a, 0x80 | cc);
+    emit32(a, 0);
+    return a->size - 4;
+}
+
+static size_t asm_jmp(Asm* a) {
+    emit(a, 0xe9);
+    emit32(a, 0);
+    return a->size - 4;
+}
+
+// Points the jump at `at` to the current position.
+static void asm_bind(Asm* a, size_t at) {
+    uint32_t rel = a->size - (at + 4);
+    memcpy(a->buf + at, &rel, 4);
+}
+
+// The compiler.
+
+typedef struct Jit {
+    Interp* interp;
+    Asm a;
+    Val* params;
+    int global;
+    int slots;
+    int failed;
+} Jit;
+
+#define JIT_CAR offsetof(Val, car)
+#define JIT_CDR offsetof(Val, cdr)
+#define JIT_NUM offsetof(Val, num)
+#define JIT_TY  offsetof(Val, ty)
+
+static void jit_expr(Jit* j, Val* form, int d);
+
+// Claims slot (and native stack local) `d`.
+static int jit_slot(Jit* j, int d) {
+    if (d >= JIT_DEPTH_MAX) {
+        j->failed = 1;
+        return 0;
+    }
+    if (d + 1 > j->slots) {
+        j->slots = d + 1;
+    }
+    return 8 * d;
+}
+
+// `rax = eval(form, env)`.
+static void jit_eval(Jit* j, Val* form) {
+    asm_mov(&j->a, RDI, R12);
+    asm_mov_imm(&j->a, RSI, form);
+    asm_mov(&j->a, RDX, R13);
+    asm_call(&j->a, eval);
+}
+
+// Raises a type error for `proc` unless the value in rax has type `ty`.
+static void jit_check_typ(Jit* j, char* proc, Type ty) {
+    asm_cmp_mem_imm32(&j->a, RAX, JIT_TY, ty);
+    size_t ok = asm_jcc(&j->a, CC_E);
+    asm_mov(&j->a, RDI, R12);
+    asm_mov_imm(&j->a, RSI, proc);
+    asm_call(&j->a, jit_type_error);
+    asm_bind(&j->a, ok);
+}
+
+// `rax = var`. Variables are found without a lookup for as long as the frame
+// still has the shape it had on entry (internal definitions change it).
+static void jit_variable(Jit* j, Val* var) {
+    Asm* a = &j->a;
+    int pos = 0;
+    Val* p = j->params;
+    for (; p->ty == TY_PAIR && p->car != var; p = p->cdr) {
+        pos++;
+    }
+    Val* binding = NULL;
+    if (p->ty != TY_PAIR && j->global) {
+        binding = find_binding(var, j->interp->global_env);
+    }
+    if (len(j->params) >= 0 && (p->ty == TY_PAIR || binding)) {
+        asm_load(a, RAX, R13, JIT_CAR);
+        asm_mov_imm(a, RCX, j->params);
+        asm_cmp_mem(a, RAX, JIT_CAR, RCX);
+        size_t slow = asm_jcc(a, CC_NE);
+        if (p->ty == TY_PAIR) {
+            asm_load(a, RAX, RAX, JIT_CDR);
+            for (int i = 0; i < pos; i++) {
+                asm_load(a, RAX, RAX, JIT_CDR);
+            }
+            asm_load(a, RAX, RAX, JIT_CAR);
+        } else {
+            asm_mov_imm(a, RAX, binding);
+            asm_load(a, RAX, RAX, JIT_CAR);
+        }
+        size_t done = asm_jmp(a);
+        asm_bind(a, slow);
+        asm_mov(a, RDI, R12);
+        asm_mov_imm(a, RSI, var);
+        asm_mov(a, RDX, R13);
+        asm_call(a, lookup_variable);
+        asm_bind(a, done);
+        return;
+    }
+    asm_mov(a, RDI, R12);
+    asm_mov_imm(a, RSI, var);
+    asm_mov(a, RDX, R13);
+    asm_call(a, lookup_variable);
+}
+
+// Evaluates `args` into slots `d`...
+static void jit_args(Jit* j, Val* args, int d) {
+    for (; args != EMPTY_LIST; args = args->cdr, d++) {
+        jit_expr(j, args->car, d);
+        asm_store(&j->a, RBX, jit_slot(j, d), RAX);
+    }
+}
+
+// Clears slots `d`... so that they don't keep dead values alive (for as long
+// as the calling code runs).
+static void jit_clear(Jit* j, int d, int n) {
+    asm_mov_imm(&j->a, RCX, VOID);
+    for (int i = 0; i < n; i++) {
+        asm_store(&j->a, RBX, jit_slot(j, d + i), RCX);
+    }
+}
+
+// Arithmetic on `args`, accumulated in local `d`.
+static void jit_arith(Jit* j, PrimProc* proc, char* name, Val* args, int d) {
+    Asm* a = &j->a;
+    int acc = jit_slot(j, d);
+    jit_expr(j, args->car, d + 1);
+    jit_check_typ(j, name, TY_INT);
+    asm_load32(a, RCX, RAX, JIT_NUM);
+    asm_store32(a, RSP, acc, RCX);
+    if (proc == prim_sub && args->cdr == EMPTY_LIST) {
+        asm_op_mem(a, 0, 0xf7, 3, RSP, acc); // neg
+    }
+    for (args = args->cdr; args != EMPTY_LIST; args = args->cdr) {
+        jit_expr(j, args->car, d + 1);
+        jit_check_typ(j, name, TY_INT);
+        asm_load32(a, RCX, RAX, JIT_NUM);
+        if (proc == prim_add) {
+            asm_op_mem(a, 0, 0x01, RCX, RSP, acc); // add
+        } else if (proc == prim_sub) {
+            asm_op_mem(a, 0, 0x29, RCX, RSP, acc); // sub
+        } else {
+            asm_op_mem(a, 0, 0x0faf, RCX, RSP, acc); // imul
+            asm_store32(a, RSP, acc, RCX);
+        }
+    }
+    asm_mov(a, RDI, R12);
+    asm_load32(a, RSI, RSP, acc);
+    asm_call(a, jit_make_int);
+}
+
+// A comparison chain. As in `compare`, later operands aren't evaluated once
+// the result is known.
+static void jit_compare(Jit* j, int fail_cc, char* name, Val* args, int d) {
+    Asm* a = &j->a;
+    int prev = jit_slot(j, d);
+    size_t fails[JIT_DEPTH_MAX];
+    int n = 0;
+    jit_expr(j, args->car, d + 1);
+    jit_check_typ(j, name, TY_INT);
+    asm_load32(a, RCX, RAX, JIT_NUM);
+    asm_store32(a, RSP, prev, RCX);
+    for (args = args->cdr; args != EMPTY_LIST; args = args->cdr) {
+        jit_expr(j, args->car, d + 1);
+        jit_check_typ(j, name, TY_INT);
+        asm_load32(a, RCX, RAX, JIT_NUM);
+        asm_load32(a, RDX, RSP, prev);
+        asm_cmp(a, 0, RDX, RCX);
+        if (n == JIT_DEPTH_MAX) {
+            j->failed = 1;
+            return;
+        }
+        fails[n++] = asm_jcc(a, fail_cc);
+        asm_store32(a, RSP, prev, RCX);
+    }
+    asm_mov_imm(a, RAX, TRUE);
+    size_t done = asm_jmp(a);
+    for (int i = 0; i < n; i++) {
+        asm_bind(a, fails[i]);
+    }
+    asm_mov_imm(a, RAX, FALSE);
+    asm_bind(a, done);
+}
+
+// Compiles a call to primitive `proc` in place (see `is_compiled_prim`).
+static void jit_prim(Jit* j, PrimProc* proc, Val* args, int d) {
+    Asm* a = &j->a;
+    int n = len(args);
+    if (proc == prim_quote) {
+        asm_mov_imm(a, RAX, args->car);
+    } else if (proc == prim_if) {
+        jit_expr(j, args->car, d);
+        asm_mov_imm(a, RCX, FALSE);
+        asm_cmp(a, 1, RAX, RCX);
+        size_t altern = asm_jcc(a, CC_E);
+        jit_expr(j, args->cdr->car, d);
+        size_t done = asm_jmp(a);
+        asm_bind(a, altern);
+        if (n == 3) {
+            jit_expr(j, args->cdr->cdr->car, d);
+        } else {
+            asm_mov_imm(a, RAX, VOID);
+        }
+        asm_bind(a, done);
+    } else if (proc == prim_begin) {
+        asm_mov_imm(a, RAX, VOID);
+        for (; args != EMPTY_LIST; args = args->cdr) {
+            jit_expr(j, args->car, d);
+        }
+    } else if (proc == prim_or) {
+        size_t dones[JIT_DEPTH_MAX];
+        asm_mov_imm(a, RAX, FALSE);
+        for (int i = 0; args != EMPTY_LIST; args = args->cdr, i++) {
+            jit_expr(j, args->car, d);
+            asm_mov_imm(a, RCX, FALSE);
+            asm_cmp(a, 1, RAX, RCX);
+            dones[i] = asm_jcc(a, CC_NE);
+        }
+        for (int i = 0; i < n; i++) {
+            asm_bind(a, dones[i]);
+        }
+    } else if (proc == prim_add || proc == prim_mul) {
+        jit_arith(j, proc, proc == prim_add ? PRIM_ADD : PRIM_MUL, args, d);
+    } else if (proc == prim_sub) {
+        jit_arith(j, proc, PRIM_SUB, args, d);
+    } else if (proc == prim_lt) {
+        jit_compare(j, CC_GE, PRIM_LT, args, d);
+    } else if (proc == prim_lte) {
+        jit_compare(j, CC_G, PRIM_LTE, args, d);
+    } else if (proc == prim_gt) {
+        jit_compare(j, CC_LE, PRIM_GT, args, d);
+    } else if (proc == prim_gte) {
+        jit_compare(j, CC_L, PRIM_GTE, args, d);
+    } else if (proc == prim_num_eq) {
+        jit_compare(j, CC_NE, PRIM_NUM_EQ, args, d);
+    } else if (proc == prim_car || proc == prim_cdr) {
+        jit_expr(j, args->car, d);
+        jit_check_typ(j, proc == prim_car ? PRIM_CAR : PRIM_CDR, TY_PAIR);
+        asm_load(a, RAX, RAX, proc == prim_car ? JIT_CAR : JIT_CDR);
+    } else {
+        // Both operands stay in slots while `cons` allocates.
+        jit_args(j, args, d);
+        asm_load(a, proc == prim_cons ? RSI : RDI, RBX, jit_slot(j, d));
+        asm_load(a, proc == prim_cons ? RDX : RSI, RBX, jit_slot(j, d + 1));
+        if (proc == prim_cons) {
+            asm_mov(a, RDI, R12);
+            asm_call(a, jit_cons);
+        } else {
+            asm_call(a, jit_eq);
+        }
+        jit_clear(j, d, 2);
+    }
+}
+
+// Calls the compound procedure in rax (kept in slot `d`) with `args`.
+static void jit_apply(Jit* j, Val* args, int d) {
+    Asm* a = &j->a;
+    asm_store(a, RBX, jit_slot(j, d), RAX);
+    jit_args(j, args, d + 1);
+    asm_mov(a, RDI, R12);
+    asm_load(a, RSI, RBX, jit_slot(j, d));
+    asm_mov_imm32(a, RDX, len(args));
+    asm_op_mem(a, 1, 0x8d, RCX, RBX, jit_slot(j, d + 1)); // lea
+    asm_call(a, jit_call);
+    jit_clear(j, d, len(args) + 1);
+}
+
+static void jit_combination(Jit* j, Val* form, int d) {
+    Asm* a = &j->a;
+    Val* op = form->car;
+    Val* args = form->cdr;
+    if (op->ty == TY_PRIM_PROC && is_compiled_prim(op->proc, len(args))) {
+        jit_prim(j, op->proc, args, d);
+        return;
+    }
+    if (op->ty != TY_SYMBOL) {
+        jit_eval(j, form);
+        return;
+    }
+
+    // The operator is a variable. Code specialized to its current (global)
+    // value is guarded by a check that it still has that value.
+    Val* binding = find_binding(op, j->interp->global_env);
+    Val* expected = binding ? binding->car : NULL;
+    if (expected && expected->ty == TY_PRIM_PROC &&
+        !is_compiled_prim(expected->proc, len(args))) {
+        // `eval` can handle it just as well.
+        jit_eval(j, form);
+        return;
+    }
+    jit_variable(j, op);
+    size_t fallback;
+    size_t done;
+    if (expected && (expected->ty & (TY_PRIM_PROC | TY_COMP_PROC))) {
+        jit_keep(j->interp, expected);
+        asm_mov_imm(a, RCX, expected);
+        asm_cmp(a, 1, RAX, RCX);
+        fallback = asm_jcc(a, CC_NE);
+        if (expected->ty == TY_COMP_PROC) {
+            jit_apply(j, args, d);
+        } else {
+            jit_prim(j, expected->proc, args, d);
+        }
+    } else {
+        asm_cmp_mem_imm32(a, RAX, JIT_TY, TY_COMP_PROC);
+        fallback = asm_jcc(a, CC_NE);
+        jit_apply(j, args, d);
+    }
+    done = asm_jmp(a);
+    asm_bind(a, fallback);
+    jit_eval(j, form);
+    asm_bind(a, done);
+}
+
+static void jit_expr(Jit* j, Val* form, int d) {
+    Asm* a = &j->a;
+    if (j->failed) {
+        return;
+    }
+    switch (form->ty) {
+    case TY_SYMBOL:
+        jit_variable(j, form);
+        break;
+    case TY_PAIR:
+        if (len(form) < 0) {
+            jit_eval(j, form);
+        } else {
+            jit_combination(j, form, d);
+        }
+        break;
+    case TY_GUARD: {
+        asm_mov_imm(a, RDI, form);
+        asm_call(a, guard_holds);
+        emit(a, 0x85); // test eax, eax
+        emit(a, 0xc0);
+        size_t slow = asm_jcc(a, CC_E);
+        jit_expr(j, form->fast, d);
+        size_t done = asm_jmp(a);
+        asm_bind(a, slow);
+        jit_expr(j, form->slow, d);
+        asm_bind(a, done);
+        break;
+    }
+    case TY_EMPTY_LIST:
+        jit_eval(j, form);
+        break;
+    default:
+        asm_mov_imm(a, RAX, form);
+        break;
+    }
+}
+
+// Compiles the body of `proc` into `e`.
+static void jit_compile(Interp* interp, JitEntry* e, Val* proc) {
+    Jit j = {
+        .interp = interp,
+        .params = proc->params,
+        .global = proc->env == interp->global_env,
+        .slots = 1,
+    };
+    Asm* a = &j.a;
+    jit_keep(interp, proc->params);
+
+    // Prologue: rbx = slots, r12 = interp, r13 = env. The frame size is
+    // filled in once it is known.
+    emit(a, 0x55);                 // push rbp
+    asm_mov(a, RBP, RSP);
+    emit(a, 0x53);                 // push rbx
+    emit(a, 0x41); emit(a, 0x54);  // push r12
+    emit(a, 0x41); emit(a, 0x55);  // push r13
+    emit(a, 0x41); emit(a, 0x56);  // push r14
+    emit(a, 0x48); emit(a, 0x81); emit(a, 0xec); // sub rsp, imm32
+    size_t frame_size = a->size;
+    emit32(a, 0);
+    asm_mov(a, R12, RDI);
+    asm_mov(a, R13, RSI);
+    asm_mov(a, RBX, RDX);
+
+    asm_mov_imm(a, RAX, VOID);
+    for (Val* b = proc->body; b != EMPTY_LIST; b = b->cdr) {
+        jit_expr(&j, b->car, 0);
+    }
+
+    // Epilogue.
+    emit32(a, 0xe0658d48);         // lea rsp, [rbp - 32]
+    emit(a, 0x41); emit(a, 0x5e);  // pop r14
+    emit(a, 0x41); emit(a, 0x5d);  // pop r13
+    emit(a, 0x41); emit(a, 0x5c);  // pop r12
+    emit(a, 0x5b);                 // pop rbx
+    emit(a, 0x5d);                 // pop rbp
+    emit(a, 0xc3);                 // ret
+
+    uint32_t size = (8 * j.slots + 15) & ~15;
+    memcpy(a->buf + frame_size, &size, 4);
+
+    void* code = MAP_FAILED;
+    if (!j.failed) {
+        code = mmap(NULL, a->size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if (code != MAP_FAILED) {
+        memcpy(code, a->buf, a->size);
+        if (mprotect(code, a->size, PROT_READ | PROT_EXEC) == 0) {
+            e->code = (PonyoCode*)code;
+            e->code_size = a->size;
+            perf_map_add(interp, code, a->size, proc);
+            e->slots = j.slots;
+            e->global = j.global;
+        } else {
+            munmap(code, a->size);
+        }
+    }
+    e->failed = !e->code;
+    free(a->buf);
+}
+
+#else
+
+static void jit_compile(Interp* interp, JitEntry* e, Val* proc) {
+    e->failed = 1;
+}
+
+#endif
+
+// Returns the compiled entry for `proc` if it should run as native code,
+// counting the call (and compiling the procedure once it is hot) otherwise.
+// Code registered by a compiled program runs whether or not the JIT is on.
+static JitEntry* jit_lookup(Interp* interp, Val* proc) {
+    JitEntry* e = interp->jit_threshold > 0
+                ? jit_entry(interp, proc->body)
+                : jit_find(interp, proc->body);
+    if (!e) {
+        return NULL;
+    }
+    if (!e->code) {
+        if (interp->jit_threshold == 0 || e->failed ||
+            ++e->calls < interp->jit_threshold) {
+            return NULL;
+        }
+        jit_compile(interp, e, proc);
+        if (!e->code) {
+            return NULL;
+        }
+    }
+    if (e->global && proc->env != interp->global_env) {
+        return NULL;
+    }
+    return e;
+}
+
+// Runs compiled code in `frame` (which the caller keeps rooted).
+static Val* jit_run(Interp* interp, JitEntry* e, Val* frame) {
+    Val* slots[e->slots];
+    for (int i = 0; i < e->slots; i++) {
+        slots[i] = VOID;
+        push_root(interp, &slots[i]);
+    }
+    Val* result = e->code(interp, frame, slots);
+    interp->roots_size -= e->slots;
+    return result;
+}
+
+// Applies `proc` to the `argc` evaluated arguments in `args` (which are
+// slots of the calling code).
+static Val* jit_call(Interp* interp, Val* proc, int argc, Val** args) {
+    DEF_ROOT1(frame);
+    frame = EMPTY_LIST;
+    for (int i = argc - 1; i >= 0; i--) {
+        frame = cons(interp, args[i], frame);
+    }
+    frame = bind_params(interp, proc->params, frame, proc->env);
+    Val* result = run_body(interp, proc, frame);
+    POP_ROOT1();
+    return result;
+}
+
+static void jit_free(Interp* interp) {
+    for (int i = 0; i < interp->jit_entries_cap; i++) {
+        JitEntry* e = interp->jit_entries[i];
+        if (e) {
+            if (e->code_size > 0) {
+                munmap((void*)e->code, e->code_size);
+            }
+            free(e);
+        }
+    }
+    free(interp->jit_entries);
+}
+
+/*------------------------------------------------------------------------------
+ | C BACKEND
+ |
+ | `ponyo --emit-c file.scm` translates a program (and the prelude) into C, to
+ | be compiled and linked against the runtime (libponyo.a, see ponyo-rt.h).
+ |
+ | The program's source is embedded in the C file and loaded as usual when the
+ | program runs. What is compiled is every procedure body, the same way (and
+ | with the same guards) as the JIT compiles them: as each top-level form is
+ | read, compiled code for the bodies in it is registered in place of
+ | interpreting them (see `link_form`). Compiled code refers to parts of the
+ | form by their position in a preorder walk of it.
+ -----------------------------------------------------------------------------*/
+
+// Writes the values in `form` to `nodes` (if not NULL) in preorder, returning
+// how many there are.
+static int preorder(Val* form, Val** nodes) {
+    int n = 0;
+    for (;;) {
+        if (nodes) {
+            nodes[n] = form;
+        }
+        n++;
+        if (form->ty != TY_PAIR) {
+            return n;
+        }
+        n += preorder(form->car, nodes ? nodes + n : NULL);
+        form = form->cdr;
+    }
+}
+
+// The rest of the backend is only needed by `ponyo` itself.
+#ifndef PONYO_NO_MAIN
+
+typedef struct Emit {
+    Interp* interp;
+    // Static declarations, compiled bodies and `link` cases.
+    FILE* decls;
+    FILE* bodies;
+    FILE* links;
+    // The body being compiled.
+    FILE* out;
+    int indent;
+    Val* params;
+    int global;
+    int slots;
+    int failed;
+    // The top-level form being compiled.
+    int form;
+    Val** nodes;
+    int nodes_size;
+    int links_size;
+    // For naming.
+    int bodies_size;
+    int caches_size;
+    char refs[4][32];
+    int refs_next;
+} Emit;
+
+static void emit_line(Emit* e, char* fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void emit_line(Emit* e, char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    fprintf(e->out, "%*s", 4 * e->indent, "");
+    vfprintf(e->out, fmt, ap);
+    fprintf(e->out, "\n");
+    va_end(ap);
+}
+
+// The C expression for `val`, a value in the form being compiled.
+static char* emit_ref(Emit* e, Val* val) {
+    char* ref = e->refs[e->refs_next++ % 4];
+    if (val == FALSE) {
+        return "&ponyo_false";
+    } else if (val == TRUE) {
+        return "&ponyo_true";
+    } else if (val == EMPTY_LIST) {
+        return "&ponyo_empty_list";
+    }
+    int i = 0;
+    while (e->nodes[i] != val) {
+        i++;
+    }
+    snprintf(ref, sizeof(e->refs[0]), "n%d[%d]", e->form, i);
+    return ref;
+}
+
+static int emit_slot(Emit* e, int d) {
+    if (d >= JIT_DEPTH_MAX) {
+        e->failed = 1;
+    } else if (d + 1 > e->slots) {
+        e->slots = d + 1;
+    }
+    return d;
+}
+
+static void emit_expr(Emit* e, Val* form, int d);
+
+static void emit_eval(Emit* e, Val* form) {
+    emit_line(e, "r = ponyo_eval(interp, %s, env);", emit_ref(e, form));
+}
+
+static void emit_check_typ(Emit* e, char* proc, char* ty) {
+    emit_line(e, "if (r->ty != %s) {", ty);
+    emit_line(e, "    ponyo_type_error(interp, \"%s\");", proc);
+    emit_line(e, "}");
+}
+
+// As `jit_variable`.
+static void emit_variable(Emit* e, Val* var) {
+    int pos = 0;
+    Val* p = e->params;
+    for (; p->ty == TY_PAIR && p->car != var; p = p->cdr) {
+        pos++;
+    }
+    if (len(e->params) >= 0 && p->ty == TY_PAIR) {
+        emit_line(e, "if (env->car->car == %s) {", emit_ref(e, e->params));
+        fprintf(e->out, "%*s    r = env->car->cdr", 4 * e->indent, "");
+        for (int i = 0; i < pos; i++) {
+            fprintf(e->out, "->cdr");
+        }
+        fprintf(e->out, "->car;\n");
+        emit_line(e, "} else {");
+    } else if (len(e->params) >= 0 && e->global) {
+        int g = e->caches_size++;
+        fprintf(e->decls, "static Val* g%d;\n", g);
+        emit_line(e, "if (env->car->car == %s &&", emit_ref(e, e->params));
+        emit_line(e, "    (g%d || (g%d = ponyo_global(interp, %s)))) {",
+                  g, g, emit_ref(e, var));
+        emit_line(e, "    r = g%d->car;", g);
+        emit_line(e, "} else {");
+    } else {
+        emit_line(e, "r = ponyo_lookup(interp, %s, env);", emit_ref(e, var));
+        return;
+    }
+    emit_line(e, "    r = ponyo_lookup(interp, %s, env);", emit_ref(e, var));
+    emit_line(e, "}");
+}
+
+static void emit_args(Emit* e, Val* args, int d) {
+    for (; args != EMPTY_LIST; args = args->cdr, d++) {
+        emit_expr(e, args->car, d);
+        emit_line(e, "slots[%d] = r;", emit_slot(e, d));
+    }
+}
+
+static void emit_clear(Emit* e, int d, int n) {
+    for (int i = 0; i < n; i++) {
+        emit_line(e, "slots[%d] = &ponyo_void;", emit_slot(e, d + i));
+    }
+}
+
+static void emit_arith(Emit* e, PrimProc* proc, char* name, Val* args,
+                       int d) {
+    char* op = proc == prim_add ? "+" : proc == prim_sub ? "-" : "*";
+    emit_slot(e, d);
+    emit_expr(e, args->car, d + 1);
+    emit_check_typ(e, name, "TY_INT");
+    emit_line(e, "l[%d] = r->num;", d);
+    if (proc == prim_sub && args->cdr == EMPTY_LIST) {
+        emit_line(e, "l[%d] = -l[%d];", d, d);
+    }
+    for (args = args->cdr; args != EMPTY_LIST; args = args->cdr) {
+        emit_expr(e, args->car, d + 1);
+        emit_check_typ(e, name, "TY_INT");
+        emit_line(e, "l[%d] %s= r->num;", d, op);
+    }
+    emit_line(e, "r = ponyo_make_int(interp, l[%d]);", d);
+}
+
+static void emit_compare(Emit* e, char* op, char* name, Val* args, int d) {
+    emit_slot(e, d);
+    emit_line(e, "do {");
+    e->indent++;
+    emit_expr(e, args->car, d + 1);
+    emit_check_typ(e, name, "TY_INT");
+    emit_line(e, "l[%d] = r->num;", d);
+    for (args = args->cdr; args != EMPTY_LIST; args = args->cdr) {
+        emit_expr(e, args->car, d + 1);
+        emit_check_typ(e, name, "TY_INT");
+        emit_line(e, "if (!(l[%d] %s r->num)) {", d, op);
+        emit_line(e, "    r = &ponyo_false;");
+        emit_line(e, "    break;");
+        emit_line(e, "}");
+        emit_line(e, "l[%d] = r->num;", d);
+    }
+    emit_line(e, "r = &ponyo_true;");
+    e->indent--;
+    emit_line(e, "} while (0);");
+}
+
+// As `jit_prim`.
+static void emit_prim(Emit* e, PrimProc* proc, Val* args, int d) {
+    int n = len(args);
+    if (proc == prim_quote) {
+        emit_line(e, "r = %s;", emit_ref(e, args->car));
+    } else if (proc == prim_if) {
+        emit_expr(e, args->car, d);
+        emit_line(e, "if (r != &ponyo_false) {");
+        e->indent++;
+        emit_expr(e, args->cdr->car, d);
+        e->indent--;
+        emit_line(e, "} else {");
+        e->indent++;
+        if (n == 3) {
+            emit_expr(e, args->cdr->cdr->car, d);
+        } else {
+            emit_line(e, "r = &ponyo_void;");
+        }
+        e->indent--;
+        emit_line(e, "}");
+    } else if (proc == prim_begin) {
+        emit_line(e, "r = &ponyo_void;");
+        for (; args != EMPTY_LIST; args = args->cdr) {
+            emit_expr(e, args->car, d);
+        }
+    } else if (proc == prim_or) {
+        emit_line(e, "r = &ponyo_false;");
+        emit_line(e, "do {");
+        e->indent++;
+        for (; args != EMPTY_LIST; args = args->cdr) {
+            emit_expr(e, args->car, d);
+            emit_line(e, "if (r != &ponyo_false) {");
+            emit_line(e, "    break;");
+            emit_line(e, "}");
+        }
+        e->indent--;
+        emit_line(e, "} while (0);");
+    } else if (proc == prim_add || proc == prim_mul) {
+        emit_arith(e, proc, proc == prim_add ? PRIM_ADD : PRIM_MUL, args, d);
+    } else if (proc == prim_sub) {
+        emit_arith(e, proc, PRIM_SUB, args, d);
+    } else if (proc == prim_lt) {
+        emit_compare(e, "<", PRIM_LT, args, d);
+    } else if (proc == prim_lte) {
+        emit_compare(e, "<=", PRIM_LTE, args, d);
+    } else if (proc == prim_gt) {
+        emit_compare(e, ">", PRIM_GT, args, d);
+    } else if (proc == prim_gte) {
+        emit_compare(e, ">=", PRIM_GTE, args, d);
+    } else if (proc == prim_num_eq) {
+        emit_compare(e, "==", PRIM_NUM_EQ, args, d);
+    } else if (proc == prim_car || proc == prim_cdr) {
+        emit_expr(e, args->car, d);
+        emit_check_typ(e, proc == prim_car ? PRIM_CAR : PRIM_CDR, "TY_PAIR");
+        emit_line(e, "r = r->%s;", proc == prim_car ? "car" : "cdr");
+    } else if (proc == prim_cons) {
+        emit_args(e, args, d);
+        emit_line(e, "r = ponyo_cons(interp, slots[%d], slots[%d]);", d,
+                  d + 1);
+        emit_clear(e, d, 2);
+    } else {
+        emit_args(e, args, d);
+        emit_line(e, "if (slots[%d]->ty == TY_INT && "
+                     "slots[%d]->ty == TY_INT) {", d, d + 1);
+        emit_line(e, "    r = slots[%d]->num == slots[%d]->num "
+                     "? &ponyo_true : &ponyo_false;", d, d + 1);
+        emit_line(e, "} else {");
+        emit_line(e, "    r = slots[%d] == slots[%d] "
+                     "? &ponyo_true : &ponyo_false;", d, d + 1);
+        emit_line(e, "}");
+        emit_clear(e, d, 2);
+    }
+}
+
+static int prim_index(PrimProc* proc) {
+    for (int i = 0; i < PRIM_PROCS_SIZE; i++) {
+        if (prim_procs[i].proc == proc) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// As `jit_combination`, except that only primitives are called directly:
+// other values don't survive into the compiled program.
+static void emit_combination(Emit* e, Val* form, int d) {
+    Val* op = form->car;
+    Val* args = form->cdr;
+    if (op->ty != TY_SYMBOL) {
+        emit_eval(e, form);
+        return;
+    }
+    Val* binding = find_binding(op, e->interp->global_env);
+    Val* expected = binding ? binding->car : NULL;
+    if (expected && expected->ty == TY_PRIM_PROC &&
+        !is_compiled_prim(expected->proc, len(args))) {
+        emit_eval(e, form);
+        return;
+    }
+    emit_variable(e, op);
+    if (expected && expected->ty == TY_PRIM_PROC) {
+        emit_line(e, "if (r->ty == TY_PRIM_PROC && r->proc == prims[%d]) {",
+                  prim_index(expected->proc));
+        e->indent++;
+        emit_prim(e, expected->proc, args, d);
+    } else {
+        emit_line(e, "if (r->ty == TY_COMP_PROC) {");
+        e->indent++;
+        emit_line(e, "slots[%d] = r;", emit_slot(e, d));
+        emit_args(e, args, d + 1);
+        emit_line(e, "r = ponyo_call(interp, slots[%d], %d, slots + %d);",
+                  d, len(args), emit_slot(e, d + 1));
+        emit_clear(e, d, len(args) + 1);
+    }
+    e->indent--;
+    emit_line(e, "} else {");
+    e->indent++;
+    emit_eval(e, form);
+    e->indent--;
+    emit_line(e, "}");
+}
+
+static void emit_expr(Emit* e, Val* form, int d) {
+    switch (form->ty) {
+    case TY_SYMBOL:
+        emit_variable(e, form);
+        break;
+    case TY_PAIR:
+        if (len(form) < 0) {
+            emit_eval(e, form);
+        } else {
+            emit_combination(e, form, d);
+        }
+        break;
+    case TY_EMPTY_LIST:
+        emit_eval(e, form);
+        break;
+    default:
+        emit_line(e, "r = %s;", emit_ref(e, form));
+        break;
+    }
+}
+
+// Compiles a procedure body, and registers it when its form is linked.
+static void emit_body(Emit* e, Val* params, Val* body, int global) {
+    if (body->ty != TY_PAIR || len(body) < 0) {
+        return;
+    }
+    char* text;
+    size_t size;
+    e->out = open_memstream(&text, &size);
+    assert(e->out);
+    e->indent = 1;
+    e->params = params;
+    e->global = global;
+    e->slots = 1;
+    e->failed = 0;
+    for (Val* b = body; b != EMPTY_LIST; b = b->cdr) {
+        emit_expr(e, b->car, 0);
+    }
+    fclose(e->out);
+
+    if (!e->failed) {
+        int b = e->bodies_size++;
+        fprintf(e->bodies,
+                "static Val* b%d(PonyoInterp* interp, Val* env, "
+                "Val** slots) {\n"
+                "    Val* r = &ponyo_void;\n"
+                "    int l[%d];\n"
+                "    (void)l;\n"
+                "%s"
+                "    return r;\n"
+                "}\n\n",
+                b, e->slots, text);
+        if (e->links_size++ == 0) {
+            fprintf(e->links, "    case %d:\n", e->form);
+            fprintf(e->links, "        memcpy(n%d, nodes, sizeof(n%d));\n",
+                    e->form, e->form);
+        }
+        fprintf(e->links, "        ponyo_register(interp, %s, b%d, %d, %d);\n",
+                emit_ref(e, body), b, e->slots, global);
+    }
+    free(text);
+}
+
+// Finds the procedure bodies in `form`. Procedures defined at the top level
+// are closed over the global environment.
+static void emit_bodies(Emit* e, Val* form, int top) {
+    if (form->ty != TY_PAIR || len(form) < 0) {
+        return;
+    }
+    Interp* interp = e->interp;
+    Val* op = form->car;
+    if (op == intern_symbol(interp, PRIM_QUOTE)) {
+        return;
+    }
+    int n = len(form);
+    if (op == intern_symbol(interp, PRIM_LAMBDA) && n > 2) {
+        emit_body(e, form->cdr->car, form->cdr->cdr, top);
+    } else if (op == intern_symbol(interp, PRIM_DEFINE) && n > 2 &&
+               form->cdr->car->ty == TY_PAIR) {
+        emit_body(e, form->cdr->car->cdr, form->cdr->cdr, top);
+    } else if (op == intern_symbol(interp, PRIM_DEFINE) && n == 3 && top) {
+        // `(define name (lambda ...))`.
+        emit_bodies(e, form->cdr->cdr->car, 1);
+        return;
+    }
+    for (; form != EMPTY_LIST; form = form->cdr) {
+        emit_bodies(e, form->car, 0);
+    }
+}
+
+// Writes `text` as a C string literal.
+static void emit_string(FILE* out, char* text) {
+    fprintf(out, "    \"");
+    for (char* c = text; *c; c++) {
+        if (*c == '\n') {
+            fprintf(out, "\\n\"\n    \"");
+        } else if (*c == '\\' || *c == '"' || *c == '?') {
+            fprintf(out, "\\%c", *c);
+        } else if (isprint((unsigned char)*c)) {
+            fputc(*c, out);
+        } else {
+            fprintf(out, "\\%03o", (unsigned char)*c);
+        }
+    }
+    fprintf(out, "\"");
+}
+
+static char* read_text(Interp* interp, const char* path) {
+    FILE* fp = fopen(path, "r");
+    if (!fp) {
+        ERROR("could not load '%s'", path);
+    }
+    char* text;
+    size_t size;
+    FILE* out = open_memstream(&text, &size);
+    assert(out);
+    int c;
+    while ((c = fgetc(fp)) != EOF) {
+        fputc(c, out);
+    }
+    fclose(out);
+    fclose(fp);
+    return text;
+}
+
+// Compiles each form in `text` that can be read (the program stops at the
+// same place when it runs).
+static void emit_unit(Emit* e, char* text) {
+    Interp* interp = e->interp;
+    if (*text == '\0') {
+        return;
+    }
+    FILE* fp = fmemopen(text, strlen(text), "r");
+    assert(fp);
+    jmp_buf on_error;
+    jmp_buf* prev = interp->on_error;
+    int roots_size = interp->roots_size;
+    interp->on_error = &on_error;
+    if (setjmp(on_error) == 0) {
+        DEF_ROOT1(form);
+        for (form = read(interp, fp); form; form = read(interp, fp)) {
+            e->nodes_size = preorder(form, NULL);
+            e->nodes = malloc(e->nodes_size * sizeof(Val*));
+            assert(e->nodes);
+            preorder(form, e->nodes);
+            e->links_size = 0;
+            emit_bodies(e, form, 1);
+            if (e->links_size > 0) {
+                fprintf(e->decls, "static Val* n%d[%d];\n", e->form,
+                        e->nodes_size);
+                fprintf(e->links, "        break;\n");
+            }
+            free(e->nodes);
+            e->form++;
+        }
+        POP_ROOT1();
+    } else {
+        interp->roots_size = roots_size;
+    }
+    interp->on_error = prev;
+    fclose(fp);
+}
+
+// Writes the C translation of the program at `path` (run after `prelude`).
+static void emit_c(Interp* interp, const char* prelude, const char* path,
+                   FILE* out) {
+    char* prelude_text = read_text(interp, prelude);
+    char* text = read_text(interp, path);
+    char* decls_text;
+    char* bodies_text;
+    char* links_text;
+    size_t size;
+    Emit e = {
+        .interp = interp,
+        .decls = open_memstream(&decls_text, &size),
+        .bodies = open_memstream(&bodies_text, &size),
+        .links = open_memstream(&links_text, &size),
+    };
+    assert(e.decls && e.bodies && e.links);
+    emit_unit(&e, prelude_text);
+    emit_unit(&e, text);
+    fclose(e.decls);
+    fclose(e.bodies);
+    fclose(e.links);
+
+    fprintf(out, "// Generated by `ponyo --emit-c %s`.\n\n", path);
+    fprintf(out, "#include <string.h>\n\n#include \"ponyo-rt.h\"\n\n");
+    fprintf(out, "static PrimProc* prims[%d];\n", PRIM_PROCS_SIZE);
+    fprintf(out, "%s\n%s", decls_text, bodies_text);
+    fprintf(out, "static void link(PonyoInterp* interp, int form, "
+                 "Val** nodes) {\n"
+                 "    switch (form) {\n"
+                 "%s"
+                 "    }\n"
+                 "}\n\n", links_text);
+    fprintf(out, "static const char prelude[] =\n");
+    emit_string(out, prelude_text);
+    fprintf(out, ";\n\nstatic const char source[] =\n");
+    emit_string(out, text);
+    fprintf(out, ";\n\nint main(int argc, char** argv) {\n");
+    for (int i = 0; i < PRIM_PROCS_SIZE; i++) {
+        fprintf(out, "    prims[%d] = ponyo_prim(\"%s\");\n", i,
+                prim_procs[i].name);
+    }
+    fprintf(out, "    static const PonyoProgram program = "
+                 "{ prelude, source, link };\n"
+                 "    return ponyo_program_main(&program, argc, argv);\n"
+                 "}\n");
+    free(prelude_text);
+    free(text);
+    free(decls_text);
+    free(bodies_text);
+    free(links_text);
+}
+
+#endif
+
+/*------------------------------------------------------------------------------
+ | PRINTER
+ -----------------------------------------------------------------------------*/
+
+static void print_list(Interp* interp, Val* list) {
+    fprintf(interp->out, "(");
+    print(interp, list->car);
+    for (list = list->cdr; list->ty == TY_PAIR; list = list->cdr) {
+        fprintf(interp->out, " ");
+        print(interp, list->car);
+    }
+    if (list != EMPTY_LIST) {
+        fprintf(interp->out, " . ");
+        print(interp, list);
+    }
+    fprintf(interp->out, ")");
+}
+
+static void print_string(Interp* interp, Val* str) {
+    fprintf(interp->out, "\"");
+    for (char* c = str->str; *c != '\0'; c++) {
+        switch (*c) {
+        case '\t':
+            fprintf(interp->out, "\\t");
+            break;
+        case '\r':
+            fprintf(interp->out, "\\r");
+            break;
+        case '\n':
+            fprintf(interp->out, "\\n");
+            break;
+        case '\\':
+            fprintf(interp->out, "\\\\");
+            break;
+        case '"':
+            fprintf(interp->out, "\\\"");
+            break;
+        default:
+            fprintf(interp->out, "%c", *c);
+            break;
+        }
+    }
+    fprintf(interp->out, "\"");
+}
+
+static void print(Interp* interp, Val* val) {
+    switch (val->ty) {
+    case TY_FALSE:
+        fprintf(interp->out, "#f");
+        break;
+    case TY_TRUE:
+        fprintf(interp->out, "#t");
+        break;
+    case TY_EMPTY_LIST:
+        fprintf(interp->out, "()");
+        break;
+    case TY_COMP_PROC:
+        fprintf(interp->out, "#<compound-procedure>");
+        break;
+    case TY_MACRO:
+        fprintf(interp->out, "#<macro>");
+        break;
+    case TY_GUARD:
+        print(interp, val->slow);
+        break;
+    case TY_INT:
+        fprintf(interp->out, "%d", val->num);
+        break;
+    case TY_PAIR:
+        print_list(interp, val);
+        break;
+    case TY_PRIM_PROC:
+        fprintf(interp->out, "#<primitive-procedure>");
+        break;
+    case TY_STRING:
+        print_string(interp, val);
+        break;
+    case TY_SYMBOL:
+        fprintf(interp->out, "%s", val->str);
+        break;
+    case TY_VOID:
+        fprintf(interp->out, "#<void>");
+        break;
+    case TY_PORT:
+        fprintf(interp->out, "#<input-port>");
+        break;
+    case TY_EOF:
+        fprintf(interp->out, "#<eof>");
+        break;
+    case TY_THREAD:
+        fprintf(interp->out, "#<thread>");
+        break;
+    case TY_CHANNEL:
+        fprintf(interp->out, "#<channel>");
+        break;
+    case TY_FUTURE:
+        fprintf(interp->out, "#<future>");
+        break;
+    case TY_PROMISE:
+        fprintf(interp->out, "#<promise>");
+        break;
+    case TY_BYTEVECTOR:
+        fprintf(interp->out, "#u8(");
+        for (int i = 0; i < val->bytes_size; i++) {
+            fprintf(interp->out, i ? " %d" : "%d", val->bytes[i]);
+        }
+        fprintf(interp->out, ")");
+        break;
+    case TY_RECORD:
+        fprintf(interp->out, "#<%s %s>",
+                val->type == interp->record_type ? "record-type" : "record",
+                val->type == interp->record_type ? val->slots[0]->str
+                                                 : val->type->slots[0]->str);
+        break;
+    }
+}
+
+/*------------------------------------------------------------------------------
+ | PIPELINED LOADING
+ |
+ | With `--pipeline`, a file that `load` reads is parsed on a thread of its own
+ | while the forms already parsed are evaluated, so that loading a large file
+ | takes about as long as the slower of the two rather than both. The reader
+ | keeps up to `READ_AHEAD` forms queued. It allocates the way the threads
+ | running futures do, from a buffer of its own that it takes from (and leaves
+ | to) the instance's heap, and it parks for collections like they do.
+ |
+ | Only regular files are read ahead, as reading a terminal or a pipe ahead of
+ | time could block, or take input meant for the code being loaded. Errors
+ | the reader runs into are reported when the loading thread reaches them, as
+ | they would have been without it.
+ -----------------------------------------------------------------------------*/
+
+#define READ_AHEAD 64
+
+static void* reader_main(void* arg) {
+    Reader* r = arg;
+    Interp* interp = r->interp;
+    FuturePool* pool = interp->futures;
+    jmp_buf on_error;
+    int failed = 0;
+    interp->on_error = &on_error;
+    if (setjmp(on_error) == 0) {
+        DEF_ROOT2(form, entry);
+        for (;;) {
+            form = read(interp, r->fp);
+            entry = form ? cons(interp, form, EMPTY_LIST) : NULL;
+            pthread_mutex_lock(&pool->lock);
+            while (entry && r->count == READ_AHEAD && !r->closing) {
+                pool_wait(pool);
+            }
+            if (!entry || r->closing) {
+                pthread_mutex_unlock(&pool->lock);
+                break;
+            }
+            if (r->forms_end) {
+                r->forms_end->cdr = entry;
+            } else {
+                r->forms = entry;
+            }
+            r->forms_end = entry;
+            r->count++;
+            pthread_cond_broadcast(&pool->changed);
+            pthread_mutex_unlock(&pool->lock);
+        }
+        POP_ROOT2();
+    } else {
+        failed = 1;
+    }
+    pthread_mutex_lock(&pool->lock);
+    r->failed = failed;
+    r->done = 1;
+    pool->mutators--;
+    pthread_cond_broadcast(&pool->changed);
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+// Whether `load` can read ahead from `fp`.
+static int can_pipeline(Interp* interp, FILE* fp) {
+    struct stat st;
+    int fd = fileno(fp);
+    return interp->pipeline && interp->future_depth == 0 && fd >= 0 &&
+           fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+// Starts reading from `fp` ahead of the calling thread. Returns NULL if no
+// thread could be started.
+static Reader* start_reader(Interp* interp, FILE* fp) {
+    if (!interp->futures) {
+        start_futures(interp);
+    }
+    FuturePool* pool = interp->futures;
+    Reader* r = calloc(1, sizeof(Reader));
+    assert(r);
+    r->fp = fp;
+    r->interp = new_worker(interp, pool);
+    r->interp->defer_errors = 1;
+    r->interp->budgeted = 0;
+    pthread_mutex_lock(&pool->lock);
+    while (pool->stopping) {
+        pool_wait(pool);
+    }
+    pool->mutators++;
+    r->next = pool->readers;
+    pool->readers = r;
+    pthread_mutex_unlock(&pool->lock);
+    if (pthread_create(&r->thread, NULL, reader_main, r) != 0) {
+        pthread_mutex_lock(&pool->lock);
+        pool->mutators--;
+        pool->readers = r->next;
+        pthread_cond_broadcast(&pool->changed);
+        pthread_mutex_unlock(&pool->lock);
+        free_worker(r->interp);
+        free(r);
+        return NULL;
+    }
+    return r;
+}
+
+// Stops the reader (if it hasn't stopped already), and frees it.
+static void stop_reader(Interp* interp, Reader* r) {
+    FuturePool* pool = interp->futures;
+    pthread_mutex_lock(&pool->lock);
+    r->closing = 1;
+    pthread_cond_broadcast(&pool->changed);
+    while (!r->done) {
+        pool_wait(pool);
+    }
+    Reader** p = &pool->readers;
+    while (*p != r) {
+        p = &(*p)->next;
+    }
+    *p = r->next;
+    pthread_mutex_unlock(&pool->lock);
+    pthread_join(r->thread, NULL);
+    free_worker(r->interp);
+    free(r);
+}
+
+// The next form the reader has read, or NULL at the end of the file.
+static Val* reader_next(Interp* interp, Reader* r) {
+    FuturePool* pool = interp->futures;
+    pthread_mutex_lock(&pool->lock);
+    while (!r->forms && !r->done) {
+        pool_wait(pool);
+    }
+    Val* form = NULL;
+    if (r->forms) {
+        form = r->forms->car;
+        r->forms = r->forms->cdr == EMPTY_LIST ? NULL : r->forms->cdr;
+        if (!r->forms) {
+            r->forms_end = NULL;
+        }
+        r->count--;
+        pthread_cond_broadcast(&pool->changed);
+    }
+    int failed = !form && r->failed;
+    pthread_mutex_unlock(&pool->lock);
+    if (failed) {
+        ERROR("%s", r->interp->error);
+    }
+    return form;
+}
+
+/*------------------------------------------------------------------------------
+ | LOADING
+ -----------------------------------------------------------------------------*/
+
+// Registers the compiled code for the procedure bodies in `form`, a
+// top-level form of a compiled program (see `emit_c`).
+static void link_form(Interp* interp, Val* form) {
+    int size = preorder(form, NULL);
+    Val** nodes = malloc(size * sizeof(Val*));
+    assert(nodes);
+    preorder(form, nodes);
+    interp->program->link(interp, interp->program_forms++, nodes);
+    free(nodes);
+}
+
+static void load_form_budgeted(Interp* interp, Val* form, char print_vals,
+                               Val* env);
+
+// Whether `form` (a top-level form, as optimized) defines something, and so
+// has code that's likely to stay (see `promote`).
+static int is_definition(Interp* interp, Val* form) {
+    while (form->ty == TY_GUARD) {
+        form = form->fast;
+    }
+    if (form->ty != TY_PAIR) {
+        return 0;
+    }
+    Val* op = operator_value(interp, form->car);
+    if (is_syntax(op, prim_begin)) {
+        for (Val* f = form->cdr; f->ty == TY_PAIR; f = f->cdr) {
+            if (is_definition(interp, f->car)) {
+                return 1;
+            }
+        }
+        return 0;
+    }
+    return is_syntax(op, prim_define) || is_syntax(op, prim_define_macro);
+}
+
+// Expands, optimizes and evaluates a top-level form.
+static void load_form(Interp* interp, Val* form, char print_vals, Val* env) {
+    if (!interp->budgeted && has_budgets(interp)) {
+        load_form_budgeted(interp, form, print_vals, env);
+        return;
+    }
+    DEF_ROOT1(val);
+    val = form;
+    expand(interp, val);
+    if (interp->optimize) {
+        val = optimize(interp, val);
     }
-    return TRUE;
+    // Compiled programs keep their code for the bodies they were read with
+    // (see `link_form`), so their forms are left where they are.
+    if (env == interp->global_env && interp->future_depth == 0 &&
+        !interp->program && is_definition(interp, val)) {
+        val = promote(interp, val);
+    }
+    if (env == interp->global_env) {
+        capture(interp, val);
+    }
+    val = eval(interp, val, env);
+    if (print_vals && val != VOID) {
+        print(interp, val);
+        fprintf(interp->out, "\n");
+    }
+    POP_ROOT1();
 }
 
-static Val* prim_lt(Val* args, Val* env) {
-    return compare(PRIM_LT, args, env, gte);
+// Runs `load_form` for a top-level form under the budgets. If the form
+// exceeds one, it is abandoned, and loading goes on; other errors unwind
+// further.
+static void load_form_budgeted(Interp* interp, Val* form, char print_vals,
+                               Val* env) {
+    jmp_buf on_error;
+    jmp_buf* prev = interp->on_error;
+    int roots_size = interp->roots_size;
+    Val* running = interp->running;
+    PerfFrame* perf_frame = interp->perf_frame;
+    int kont_size = interp->kont_size;
+    budget_reset(interp);
+    interp->on_error = &on_error;
+    int unwound = setjmp(on_error);
+    if (unwound == 0) {
+        load_form(interp, form, print_vals, env);
+    } else {
+        interp->roots_size = roots_size;
+        interp->running = running;
+        interp->perf_frame = perf_frame;
+        kont_unwind(interp, kont_size);
+    }
+    interp->budgeted = 0;
+    interp->on_error = prev;
+    if (unwound == UNWIND_BUDGET) {
+        interp->over_budget = 1;
+    } else if (unwound && prev) {
+        longjmp(*prev, unwound);
+    } else if (unwound) {
+        exit(1);
+    }
 }
 
-static Val* prim_lte(Val* args, Val* env) {
-    return compare(PRIM_LTE, args, env, gt);
+// The next form to load from `fp`, or NULL at the end, taken from `r` if it
+// is reading ahead.
+static Val* next_form(Interp* interp, FILE* fp, Reader* r) {
+    return r ? reader_next(interp, r) : read(interp, fp);
 }
 
-static Val* prim_gt(Val* args, Val* env) {
-    return compare(PRIM_GT, args, env, lte);
+// Loads the forms `fp` reads, read ahead by `r` if it isn't NULL. If `forms`
+// isn't NULL, it is set to a list of (copies of) them as they were read.
+static void load_forms(Interp* interp, FILE* fp, Reader* r, char print_vals,
+                       Val* env, Val** forms) {
+    DEF_ROOT2(val, copy);
+    if (forms) {
+        *forms = EMPTY_LIST;
+    }
+    for (val = next_form(interp, fp, r); val;
+         val = next_form(interp, fp, r)) {
+        if (fp == interp->program_fp) {
+            link_form(interp, val);
+        }
+        if (forms) {
+            // Loading the form may change it (see `expand_macro`).
+            copy = copy_tree(interp, val);
+            *forms = cons(interp, copy, *forms);
+        }
+        load_form(interp, val, print_vals, env);
+    }
+    if (forms) {
+        *forms = rev(*forms);
+    }
+    POP_ROOT2();
 }
 
-static Val* prim_gte(Val* args, Val* env) {
-    return compare(PRIM_GTE, args, env, lt);
+// Loads the forms `fp` reads, reading ahead of them if it can (see
+// `start_reader`). If `forms` isn't NULL, it is set to a list of (copies of)
+// them as they were read.
+static void load(Interp* interp, FILE* fp, char print_vals, Val* env,
+                 Val** forms) {
+    Reader* r = can_pipeline(interp, fp) ? start_reader(interp, fp) : NULL;
+    if (!r) {
+        load_forms(interp, fp, NULL, print_vals, env, forms);
+        return;
+    }
+    jmp_buf on_error;
+    jmp_buf* prev = interp->on_error;
+    interp->on_error = &on_error;
+    int unwound = setjmp(on_error);
+    if (unwound == 0) {
+        load_forms(interp, fp, r, print_vals, env, forms);
+    }
+    interp->on_error = prev;
+    stop_reader(interp, r);
+    if (unwound && prev) {
+        longjmp(*prev, unwound);
+    } else if (unwound) {
+        exit(1);
+    }
 }
 
-static Val* prim_num_eq(Val* args, Val* env) {
-    return compare(PRIM_NUM_EQ, args, env, neq);
-}
+/*------------------------------------------------------------------------------
+ | LOAD CACHE
+ |
+ | With a cache directory (`--load-cache`), each file that `load` reads is
+ | cached there as the list of forms read from it, in the FASL format, so that
+ | the next load of an unchanged file doesn't have to parse it again. (What
+ | macros the forms are expanded with can change from one load to the next,
+ | so expansion, and what follows it, is still done each time.)
+ |
+ | An entry is named after a hash of the file's absolute path, and is used if
+ | the file still has the size and modification time it had when the entry
+ | was written, or failing that, the same contents (by hash). A file is only
+ | cached once it has loaded without errors.
+ |
+ |   entry := "PLDC" version mtime-sec mtime-nsec size hash path-length path
+ |            fasl
+ |
+ | where the numbers are 64 bits (32 for `path-length`), in native byte order.
+ -----------------------------------------------------------------------------*/
 
-static Val* prim_eq(Val* args, Val* env) {
-    check_len(PRIM_EQ, args, eq, 2);
-    Val* l = eval(args->car, env);
-    Val* r = eval(args->cdr->car, env);
-    if (l->ty == TY_INT && r->ty == TY_INT) {
-        return l->num == r->num ? TRUE : FALSE;
-    } else {
-        return l == r ? TRUE : FALSE;
+#define LOAD_CACHE_MAGIC   "PLDC"
+#define LOAD_CACHE_VERSION 1
+
+typedef struct LoadCacheHeader {
+    uint64_t mtime_sec;
+    uint64_t mtime_nsec;
+    uint64_t size;
+    uint64_t hash;
+} LoadCacheHeader;
+
+// FNV-1a.
+static uint64_t hash_bytes(const unsigned char* data, size_t size) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ data[i]) * 0x100000001b3ULL;
     }
+    return hash;
 }
 
-static Val* prim_car(Val* args, Val* env) {
-    check_len(PRIM_CAR, args, eq, 1);
-    Val* list = eval(args->car, env);
-    check_typ(PRIM_CAR, list, TY_PAIR);
-    return list->car;
+// Writes the entry for the file at `path` (with header `h`) holding `forms`.
+// Failing to is not an error: the file is just read again next time.
+static void write_cache_entry(Interp* interp, const char* entry,
+                              const char* path, LoadCacheHeader* h,
+                              Val* forms) {
+    size_t size;
+    Val* bad;
+    unsigned char* data = fasl_encode(interp, forms, &size, &bad);
+    if (!data) {
+        return;
+    }
+    // Written under a temporary name and renamed into place, so that a
+    // reader never sees a partial entry.
+    size_t dir = strlen(interp->load_cache);
+    char* temp = malloc(dir + sizeof("/tmp-XXXXXX"));
+    assert(temp);
+    sprintf(temp, "%s/tmp-XXXXXX", interp->load_cache);
+    int fd = mkstemp(temp);
+    FILE* fp = fd >= 0 ? fdopen(fd, "wb") : NULL;
+    uint32_t path_size = strlen(path);
+    int ok = fp &&
+        fwrite(LOAD_CACHE_MAGIC, strlen(LOAD_CACHE_MAGIC), 1, fp) == 1 &&
+        fputc(LOAD_CACHE_VERSION, fp) != EOF &&
+        fwrite(h, sizeof(*h), 1, fp) == 1 &&
+        fwrite(&path_size, sizeof(path_size), 1, fp) == 1 &&
+        fwrite(path, 1, path_size, fp) == path_size &&
+        fwrite(data, 1, size, fp) == size;
+    ok = fp && fclose(fp) == 0 && ok;
+    if (ok) {
+        ok = rename(temp, entry) == 0;
+    }
+    if (!ok && fd >= 0) {
+        remove(temp);
+    }
+    free(temp);
+    free(data);
 }
 
-static Val* prim_cdr(Val* args, Val* env) {
-    check_len(PRIM_CDR, args, eq, 1);
-    Val* list = eval(args->car, env);
-    check_typ(PRIM_CDR, list, TY_PAIR);
-    return list->cdr;
-}
+// Loads the file at `path` (open as `fp`) from its entry in the cache if it
+// has an up-to-date one, and otherwise as usual, adding an entry for it.
+static void load_cached(Interp* interp, FILE* fp, const char* path,
+                        char print_vals, Val* env) {
+    struct stat st;
+    char abs_path[PATH_MAX];
+    if (fstat(fileno(fp), &st) != 0 || !realpath(path, abs_path)) {
+        load(interp, fp, print_vals, env, NULL);
+        return;
+    }
+    mkdir(interp->load_cache, 0777);
+    char entry[strlen(interp->load_cache) + sizeof("/0123456789abcdef.pfsl")];
+    sprintf(entry, "%s/%016llx.pfsl", interp->load_cache,
+            (unsigned long long)hash_bytes((unsigned char*)abs_path,
+                                           strlen(abs_path)));
+    LoadCacheHeader h = {
+        .mtime_sec = st.st_mtim.tv_sec,
+        .mtime_nsec = st.st_mtim.tv_nsec,
+        .size = st.st_size,
+    };
 
-static Val* prim_cons(Val* args, Val* env) {
-    check_len(PRIM_CONS, args, eq, 2);
-    DEF_ROOT2(car, cdr);
-    car = eval(args->car, env);
-    cdr = eval(args->cdr->car, env);
-    Val* pair = cons(car, cdr);
-    POP_ROOT2();
-    return pair;
-}
+    size_t size = 0;
+    unsigned char* data = NULL;
+    FILE* entry_fp = fopen(entry, "rb");
+    if (entry_fp) {
+        data = read_all(entry_fp, &size);
+        fclose(entry_fp);
+    }
+    size_t magic = strlen(LOAD_CACHE_MAGIC);
+    size_t path_size = strlen(abs_path);
+    size_t fasl = magic + 1 + sizeof(h) + sizeof(uint32_t) + path_size;
+    LoadCacheHeader cached;
+    uint32_t cached_path_size = 0;
+    if (data && size >= fasl) {
+        memcpy(&cached, data + magic + 1, sizeof(cached));
+        memcpy(&cached_path_size, data + magic + 1 + sizeof(cached),
+               sizeof(cached_path_size));
+    }
+    int valid = data && size >= fasl &&
+        memcmp(data, LOAD_CACHE_MAGIC, magic) == 0 &&
+        data[magic] == LOAD_CACHE_VERSION &&
+        cached_path_size == path_size &&
+        memcmp(data + fasl - path_size, abs_path, path_size) == 0 &&
+        cached.size == h.size;
+    if (valid && (cached.mtime_sec != h.mtime_sec ||
+                  cached.mtime_nsec != h.mtime_nsec)) {
+        // Touched, but maybe not changed.
+        size_t source_size;
+        unsigned char* source = read_all(fp, &source_size);
+        valid = hash_bytes(source, source_size) == cached.hash;
+        free(source);
+        rewind(fp);
+    }
 
-static Val* prim_cond(Val* args, Val* env) {
-    check_len(PRIM_COND, args, gt, 0);
-    for (Val* a = args; a != EMPTY_LIST; a = a->cdr) {
-        check_typ(PRIM_COND, a->car, TY_PAIR);
-        Val* test = a->car->car;
-        Val* exps = a->car->cdr;
-        if (test == intern_symbol("else")) {
-            if (a->cdr != EMPTY_LIST) {
-                ERROR("%s: else clause must be last", PRIM_COND);
-            }
-        } else {
-            if (eval(test, env) == FALSE) {
-                continue;
-            }
-        }
-        Val* result = VOID;
-        for (; exps != EMPTY_LIST; exps = exps->cdr) {
-            result = eval(exps->car, env);
+    DEF_ROOT2(forms, form);
+    if (valid && fasl_decode(interp, data + fasl, size - fasl, &forms)) {
+        free(data);
+        for (; forms->ty == TY_PAIR; forms = forms->cdr) {
+            // The cached list is only read, so a form can be loaded as is.
+            form = forms->car;
+            load_form(interp, form, print_vals, env);
         }
-        return result;
+    } else {
+        free(data);
+        size_t source_size;
+        unsigned char* source = read_all(fp, &source_size);
+        h.hash = hash_bytes(source, source_size);
+        free(source);
+        rewind(fp);
+        load(interp, fp, print_vals, env, &forms);
+        write_cache_entry(interp, entry, abs_path, &h, forms);
     }
-    return VOID;
+    POP_ROOT2();
 }
 
-// Note: only `#f` is considered false in conditional expressions.
-static Val* prim_if(Val* args, Val* env) {
-    check_len(PRIM_IF, args, gt, 1);
-    Val* test = eval(args->car, env);
-    if (test != FALSE) {
-        Val* conseq = args->cdr;
-        return eval(conseq->car, env);
+// Loads the forms `fp` reads from the file at `path` (or from elsewhere, if
+// `path` is NULL), through the load cache if there is one.
+static void load_source(Interp* interp, FILE* fp, const char* path,
+                        char print_vals, Val* env) {
+    if (path && interp->load_cache) {
+        load_cached(interp, fp, path, print_vals, env);
     } else {
-        // If test yields a false value and no alternate is specified, the
-        // result of the expression is unspecified.
-        Val* altern = args->cdr->cdr;
-        return altern == EMPTY_LIST ? VOID : eval(altern->car, env);
+        load(interp, fp, print_vals, env, NULL);
     }
 }
 
-static Val* prim_and(Val* args, Val* env) {
-    Val* result = TRUE;
-    for (; args != EMPTY_LIST; args = args->cdr) {
-        result = eval(args->car, env);
-        if (result == FALSE) {
-            break;
-        }
+static void load_file(Interp* interp, char* path, char print_vals, Val* env) {
+    FILE* fp = fopen(path, "r");
+    if (!fp) {
+        ERROR("could not load '%s'", path);
     }
-    return result;
+    PROBE1(load__start, path);
+    load_source(interp, fp, path, print_vals, env);
+    PROBE1(load__done, path);
+    fclose(fp);
 }
 
-static Val* prim_or(Val* args, Val* env) {
-    Val* result = FALSE;
-    for (; args != EMPTY_LIST; args = args->cdr) {
-        result = eval(args->car, env);
-        if (result != FALSE) {
-            break;
+/*------------------------------------------------------------------------------
+ | EMBEDDING API
+ -----------------------------------------------------------------------------*/
+
+// Runs `load_source` with errors unwinding back to here rather than exiting.
+static int load_protected(Interp* interp, FILE* fp, const char* path,
+                          char print_vals) {
+    jmp_buf on_error;
+    jmp_buf* prev = interp->on_error;
+    int roots_size = interp->roots_size;
+    Val* running = interp->running;
+    PerfFrame* perf_frame = interp->perf_frame;
+    int kont_size = interp->kont_size;
+    int status = 0;
+    futures_enter(interp);
+    interp->over_budget = 0;
+    interp->on_error = &on_error;
+    if (setjmp(on_error) == 0) {
+        load_source(interp, fp, path, print_vals, interp->global_env);
+        if (interp->over_budget) {
+            status = -1;
         }
+    } else {
+        interp->roots_size = roots_size;
+        interp->running = running;
+        interp->perf_frame = perf_frame;
+        kont_unwind(interp, kont_size);
+        status = -1;
     }
-    return result;
+    interp->on_error = prev;
+    futures_leave(interp);
+    fflush(interp->out);
+    return status;
 }
 
-static void define_proc(Val* args, Val* env) {
-    Val* name = args->car->car;
-    Val* params = args->car->cdr;
-    Val* body = args->cdr;
+PonyoInterp* ponyo_new(const PonyoConfig* config) {
+    Interp* interp = calloc(1, sizeof(Interp));
+    if (!interp) {
+        return NULL;
+    }
+    interp->heap_size = HEAP_SIZE;
+    interp->gc_threads = 1;
+    interp->future_threads = get_nprocs();
+    interp->out = stdout;
+    if (config && config->heap_size > 0) {
+        interp->heap_size = config->heap_size;
+    }
+    if (config && config->gc_threads > 1) {
+        interp->gc_threads = config->gc_threads < GC_THREADS_MAX
+                           ? config->gc_threads
+                           : GC_THREADS_MAX;
+    }
+    if (config && config->future_threads > 0) {
+        interp->future_threads = config->future_threads;
+    }
+    if (interp->future_threads < 1) {
+        interp->future_threads = 1;
+    } else if (interp->future_threads > FUTURE_THREADS_MAX) {
+        interp->future_threads = FUTURE_THREADS_MAX;
+    }
+    if (config && config->out) {
+        interp->out = config->out;
+    }
+    if (config) {
+        interp->optimize = config->optimize;
+        interp->jit_threshold = config->jit_threshold;
+        interp->cek = config->cek;
+        interp->max_steps = config->max_steps;
+        interp->max_cells = config->max_cells;
+        interp->max_depth = config->max_depth;
+        interp->max_time = config->max_time;
+        interp->pipeline = config->pipeline;
+        interp->perf = config->perf;
+        if (interp->perf) {
+            perf_map_open(interp);
+        }
+        if (config->load_cache) {
+            interp->load_cache = strdup(config->load_cache);
+            assert(interp->load_cache);
+        }
+        if (config->profile_alloc) {
+            interp->profile = new_profile();
+        }
+    }
 
-    check_typ(PRIM_DEFINE, name, TY_SYMBOL);
-    // Type checks both proper and improper lists.
-    Val* p = params;
-    for (; p->ty == TY_PAIR; p = p->cdr) {
-        check_typ(PRIM_DEFINE, p->car, TY_SYMBOL);
+    interp->heap = calloc(interp->heap_size, sizeof(Val));
+    interp->roots = calloc(ROOTS_MAX, sizeof(Val**));
+    if (!interp->heap || !interp->roots || !init_immortal(interp)) {
+        free(interp->heap);
+        free(interp->roots);
+        free(interp);
+        return NULL;
     }
-    if (p != EMPTY_LIST) {
-        check_typ(PRIM_DEFINE, p, TY_SYMBOL);
+    init_heap(interp);
+
+    PUSH_ROOT(interp->symbol_list);
+    PUSH_ROOT(interp->global_env);
+    interp->symbol_list = EMPTY_LIST;
+    interp->global_env = EMPTY_LIST;
+    interp->global_env = extend_env(interp, EMPTY_LIST, EMPTY_LIST,
+                                    interp->global_env);
+    define_prim_procs(interp, interp->global_env);
+    PUSH_ROOT(interp->begin);
+    PUSH_ROOT(interp->quote);
+    PUSH_ROOT(interp->jit_roots);
+    interp->jit_roots = EMPTY_LIST;
+    interp->begin = lookup_variable(interp, intern_symbol(interp, PRIM_BEGIN),
+                                    interp->global_env);
+    interp->quote = lookup_variable(interp, intern_symbol(interp, PRIM_QUOTE),
+                                    interp->global_env);
+    PUSH_ROOT(interp->record_type);
+    interp->record_type = make_record(interp, NULL, 2);
+    interp->record_type->type = interp->record_type;
+    interp->record_type->slots[0] = intern_symbol(interp, "record-type");
+    interp->record_type->slots[1] = EMPTY_LIST;
+    interp->record_type->slots[1] =
+        cons(interp, intern_symbol(interp, "fields"),
+             interp->record_type->slots[1]);
+    interp->record_type->slots[1] = cons(interp, intern_symbol(interp, "name"),
+                                         interp->record_type->slots[1]);
+
+    if (config && config->prelude &&
+        ponyo_load_file(interp, config->prelude) != 0) {
+        ponyo_free(interp);
+        return NULL;
     }
+    return interp;
+}
 
-    DEF_ROOT1(proc);
-    proc = make_comp_proc(params, body, env);
-    define_variable(name, proc, env);
-    POP_ROOT1();
+void ponyo_free(PonyoInterp* interp) {
+    free_futures(interp);
+    if (interp->profile) {
+        mark_all(interp);
+        sweep(interp);
+        profile_report(interp, stderr);
+        free_profile(interp->profile);
+    }
+    stop_mark_pool(interp);
+    free_heap(interp);
+    free_immortal(interp);
+    if (interp->perf_map) {
+        fclose(interp->perf_map);
+    }
+    jit_free(interp);
+    capture_free(interp);
+    free_threads(interp);
+    free(interp->kont);
+    free(interp->scope);
+    free(interp->roots);
+    free(interp->mark_stack.items);
+    free(interp->load_cache);
+    free(interp);
 }
 
-static Val* prim_define(Val* args, Val* env) {
-    check_len(PRIM_DEFINE, args, gt, 1);
-    Val* var = args->car;
-    if (var->ty == TY_SYMBOL) {
-        check_len(PRIM_DEFINE, args->cdr, eq, 1);
-        DEF_ROOT1(val);
-        val = eval(args->cdr->car, env);
-        define_variable(var, val, env);
-        POP_ROOT1();
-    } else if (var->ty == TY_PAIR) {
-        define_proc(args, env);
-    } else {
-        ERROR("%s: argument is not a symbol or a pair", PRIM_DEFINE);
+int ponyo_load_file(PonyoInterp* interp, const char* path) {
+    FILE* fp = fopen(path, "r");
+    if (!fp) {
+        fprintf(stderr, "error: could not load '%s'\n", path);
+        return -1;
     }
-    return VOID;
+    int status = load_protected(interp, fp, path, 0);
+    fclose(fp);
+    return status;
 }
 
-static Val* prim_lambda(Val* args, Val* env) {
-    check_len(PRIM_LAMBDA, args, gt, 1);
-    Val* params = args->car;
+int ponyo_load_stream(PonyoInterp* interp, FILE* fp, int print_vals) {
+    return load_protected(interp, fp, NULL, print_vals);
+}
 
-    // Type checks both proper and improper lists.
-    Val* p = params;
-    for (; p->ty == TY_PAIR; p = p->cdr) {
-        check_typ(PRIM_LAMBDA, p->car, TY_SYMBOL);
+int ponyo_eval_string(PonyoInterp* interp, const char* src) {
+    size_t size = strlen(src);
+    if (size == 0) {
+        return 0;
     }
-    if (p != EMPTY_LIST) {
-        check_typ(PRIM_LAMBDA, p, TY_SYMBOL);
+    FILE* fp = fmemopen((char*)src, size, "r");
+    if (!fp) {
+        return -1;
     }
-
-    Val* body = args->cdr;
-    return make_comp_proc(params, body, env);
+    int status = load_protected(interp, fp, NULL, 1);
+    fclose(fp);
+    return status;
 }
 
-// Desugars `(let ((var val)) body)` to `((lambda (var) body) val)`.
-static Val* prim_let(Val* args, Val* env) {
-    check_len(PRIM_LET, args, gt, 1);
-    DEF_ROOT3(vars, vals, lambda);
-    vars = EMPTY_LIST;
-    vals = EMPTY_LIST;
-    for (Val* b = args->car; b != EMPTY_LIST; b = b->cdr) {
-        check_typ(PRIM_LET, b->car, TY_PAIR);
-        check_len(PRIM_LET, b->car, eq, 2);
-
-        Val* var = b->car->car;
-        check_typ(PRIM_LET, var, TY_SYMBOL);
-        vars = cons(var, vars);
+/*------------------------------------------------------------------------------
+ | COMPILED PROGRAMS
+ |
+ | The runtime entry points for programs compiled by the C backend (see
+ | ponyo-rt.h), and the options they share with `ponyo`.
+ -----------------------------------------------------------------------------*/
 
-        Val* val = b->car->cdr->car;
-        vals = cons(val, vals);
+#define OPTIONS_USAGE                                                        \
+    "  --gc-threads N   mark the heap with N threads (default 1)\n"          \
+    "  --heap-size N    size of the heap in cells (default %d)\n"            \
+    "  --jit            compile hot procedures to native code\n"             \
+    "  --jit-threshold N\n"                                                  \
+    "                   compile procedures on their Nth call (default %d\n"  \
+    "                   with --jit)\n"                                       \
+    "  --profile-alloc  report where cells are allocated on exit\n"          \
+    "  --cek            evaluate without recursing on the C stack\n"         \
+    "  --future-threads N\n"                                                 \
+    "                   run futures on N threads (default one per core)\n"  \
+    "  --load-cache DIR keep files loaded by `load`, parsed, in DIR\n"       \
+    "  --pipeline       read files on another thread as they are loaded\n"   \
+    "  --max-steps N    abandon a top-level form after N steps\n"          \
+    "  --max-cells N    abandon a top-level form after N cells allocated\n" \
+    "  --max-depth N    abandon a top-level form on calls nested N deep\n"  \
+    "  --max-time MS    abandon a top-level form after MS milliseconds\n"  \
+    "  --perf           keep a shadow stack and symbol map for perf\n"
+
+static int parse_count(char* opt, char* arg, int min, int max) {
+    char* end;
+    long n = arg ? strtol(arg, &end, 10) : 0;
+    if (!arg || *end != '\0' || n < min || n > max) {
+        raise_error(NULL, "%s: expected an integer between %d and %d",
+                    opt, min, max);
     }
-    Val* body = args->cdr;
-    lambda = make_comp_proc(vars, body, env);
-    Val* let = cons(lambda, vals);
-    POP_ROOT3();
-    return eval(let, env);
+    return (int)n;
 }
 
-static Val* prim_quote(Val* args, Val* env) {
-    check_len(PRIM_QUOTE, args, eq, 1);
-    return args->car;
+// Parses the option at `argv[i]` into `config`, returning the number of
+// arguments it takes up (0 if it isn't an option in `OPTIONS_USAGE`).
+static int parse_option(char** argv, int i, PonyoConfig* config) {
+    if (strcmp(argv[i], "--gc-threads") == 0) {
+        config->gc_threads =
+            parse_count(argv[i], argv[i + 1], 1, GC_THREADS_MAX);
+        return 2;
+    } else if (strcmp(argv[i], "--heap-size") == 0) {
+        config->heap_size = parse_count(argv[i], argv[i + 1], 1, 1 << 30);
+        return 2;
+    } else if (strcmp(argv[i], "--jit") == 0) {
+        config->jit_threshold = JIT_THRESHOLD;
+        return 1;
+    } else if (strcmp(argv[i], "--jit-threshold") == 0) {
+        config->jit_threshold = parse_count(argv[i], argv[i + 1], 1, 1 << 30);
+        return 2;
+    } else if (strcmp(argv[i], "--profile-alloc") == 0) {
+        config->profile_alloc = 1;
+        return 1;
+    } else if (strcmp(argv[i], "--cek") == 0) {
+        config->cek = 1;
+        return 1;
+    } else if (strcmp(argv[i], "--future-threads") == 0) {
+        config->future_threads =
+            parse_count(argv[i], argv[i + 1], 1, FUTURE_THREADS_MAX);
+        return 2;
+    } else if (strcmp(argv[i], "--load-cache") == 0 && argv[i + 1]) {
+        config->load_cache = argv[i + 1];
+        return 2;
+    } else if (strcmp(argv[i], "--pipeline") == 0) {
+        config->pipeline = 1;
+        return 1;
+    } else if (strcmp(argv[i], "--perf") == 0) {
+        config->perf = 1;
+        return 1;
+    } else if (strcmp(argv[i], "--max-steps") == 0) {
+        config->max_steps = parse_count(argv[i], argv[i + 1], 1, INT_MAX);
+        return 2;
+    } else if (strcmp(argv[i], "--max-cells") == 0) {
+        config->max_cells = parse_count(argv[i], argv[i + 1], 1, INT_MAX);
+        return 2;
+    } else if (strcmp(argv[i], "--max-depth") == 0) {
+        config->max_depth = parse_count(argv[i], argv[i + 1], 1, INT_MAX);
+        return 2;
+    } else if (strcmp(argv[i], "--max-time") == 0) {
+        config->max_time = parse_count(argv[i], argv[i + 1], 1, INT_MAX);
+        return 2;
+    }
+    return 0;
 }
 
-static Val* prim_set(Val* args, Val* env) {
-    check_len(PRIM_SET, args, eq, 2);
-    Val* var = args->car;
-    check_typ(PRIM_SET, var, TY_SYMBOL);
-    Val* val = eval(args->cdr->car, env);
-    set_variable(var, val, env);
-    return VOID;
+Val* ponyo_eval(Interp* interp, Val* form, Val* env) {
+    return eval(interp, form, env);
 }
 
-static Val* prim_set_car(Val* args, Val* env) {
-    check_len(PRIM_SET_CAR, args, eq, 2);
-    Val* var = eval(args->car, env);
-    check_typ(PRIM_SET_CAR, var, TY_PAIR);
-    Val* val = eval(args->cdr->car, env);
-    var->car = val;
-    return VOID;
+Val* ponyo_lookup(Interp* interp, Val* var, Val* env) {
+    return lookup_variable(interp, var, env);
 }
 
-static Val* prim_set_cdr(Val* args, Val* env) {
-    check_len(PRIM_SET_CDR, args, eq, 2);
-    Val* var = eval(args->car, env);
-    check_typ(PRIM_SET_CDR, var, TY_PAIR);
-    Val* val = eval(args->cdr->car, env);
-    var->cdr = val;
-    return VOID;
+Val* ponyo_global(Interp* interp, Val* var) {
+    return find_binding(var, interp->global_env);
 }
 
-static Val* prim_is_type(Val* args, Val* env, char* proc, Type ty) {
-    check_len(proc, args, eq, 1);
-    Val* val = eval(args->car, env);
-    return val->ty & ty ? TRUE : FALSE;
+Val* ponyo_call(Interp* interp, Val* proc, int argc, Val** args) {
+    return jit_call(interp, proc, argc, args);
 }
 
-static Val* prim_is_int(Val* args, Val* env) {
-    return prim_is_type(args, env, PRIM_IS_INT, TY_INT);
+Val* ponyo_cons(Interp* interp, Val* car, Val* cdr) {
+    return cons(interp, car, cdr);
 }
 
-static Val* prim_is_list(Val* args, Val* env) {
-    check_len(PRIM_IS_LIST, args, eq, 1);
-    Val* val = eval(args->car, env);
-    return len(val) < 0 ? FALSE : TRUE;
+Val* ponyo_make_int(Interp* interp, int num) {
+    return make_int(interp, num);
 }
 
-static Val* prim_is_pair(Val* args, Val* env) {
-    return prim_is_type(args, env, PRIM_IS_PAIR, TY_PAIR);
+void ponyo_type_error(Interp* interp, char* proc) {
+    ERROR("%s: incorrect argument type", proc);
 }
 
-static Val* prim_is_proc(Val* args, Val* env) {
-    return prim_is_type(args, env, PRIM_IS_PROC, TY_COMP_PROC | TY_PRIM_PROC);
+PrimProc* ponyo_prim(const char* name) {
+    for (int i = 0; i < PRIM_PROCS_SIZE; i++) {
+        if (strcmp(prim_procs[i].name, name) == 0) {
+            return prim_procs[i].proc;
+        }
+    }
+    return NULL;
 }
 
-static Val* prim_is_str(Val* args, Val* env) {
-    return prim_is_type(args, env, PRIM_IS_STR, TY_STRING);
+void ponyo_register(Interp* interp, Val* body, PonyoCode* code, int slots,
+                    int global) {
+    JitEntry* e = jit_entry(interp, body);
+    e->code = code;
+    e->slots = slots;
+    e->global = global;
 }
 
-static Val* prim_is_sym(Val* args, Val* env) {
-    return prim_is_type(args, env, PRIM_IS_SYM, TY_SYMBOL);
+// Loads one part of a compiled program, linking its forms as they are read.
+static int load_program(Interp* interp, const char* text, int print_vals) {
+    size_t size = strlen(text);
+    if (size == 0) {
+        return 0;
+    }
+    FILE* fp = fmemopen((char*)text, size, "r");
+    if (!fp) {
+        return -1;
+    }
+    interp->program_fp = fp;
+    int status = load_protected(interp, fp, NULL, print_vals);
+    interp->program_fp = NULL;
+    fclose(fp);
+    return status;
 }
 
-static void print(Val* val);
+int ponyo_program_main(const PonyoProgram* program, int argc, char** argv) {
+    PonyoConfig config = { 0 };
+    for (int i = 1; i < argc;) {
+        int used = parse_option(argv, i, &config);
+        if (!used) {
+            fprintf(stderr, "usage: %s [options]\n" OPTIONS_USAGE, argv[0],
+                    HEAP_SIZE, JIT_THRESHOLD);
+            return 1;
+        }
+        i += used;
+    }
 
-static Val* prim_display(Val* args, Val* env) {
-    check_len(PRIM_DISPLAY, args, eq, 1);
-    Val* val = eval(args->car, env);
-    if (val->ty == TY_STRING) {
-        printf("%s", val->str);
-    } else {
-        print(val);
+    PonyoInterp* interp = ponyo_new(&config);
+    if (!interp) {
+        return 1;
     }
-    return VOID;
+    interp->program = program;
+    int status = load_program(interp, program->prelude, 0);
+    if (status == 0) {
+        status = load_program(interp, program->source, 1);
+    }
+    ponyo_free(interp);
+    return status == 0 ? 0 : 1;
 }
 
-static void load_file(char* path, char print_vals, Val* env);
+#ifndef PONYO_NO_MAIN
 
-static Val* prim_load(Val* args, Val* env) {
-    check_len(PRIM_LOAD, args, eq, 1);
-    check_typ(PRIM_LOAD, args->car, TY_STRING);
-    load_file(args->car->str, 0, env);
-    return VOID;
-}
+/*------------------------------------------------------------------------------
+ | EVALUATION SERVER
+ |
+ | `ponyo --serve PATH` creates an instance (loading the prelude) once, then
+ | forks a pool of workers from it that share its heap copy-on-write. Each
+ | worker waits for a connection on the Unix socket at PATH, runs one job and
+ | exits, and the server forks another in its place. So every job starts from
+ | the state the prelude left, without paying to get there.
+ |
+ | A client (`ponyo --connect PATH`) sends its working directory, and its
+ | standard input, output and error as file descriptors. The worker runs the
+ | job on them as `ponyo` would run standard input, so output goes straight
+ | to the client's terminal or pipes, then sends back the exit status.
+ -----------------------------------------------------------------------------*/
 
-// Partial implementation. Doesn't support input ports.
-static Val* prim_read(Val* args, Val* env) {
-    check_len(PRIM_READ, args, eq, 0);
-    return read(stdin);
+#define SERVE_WORKERS_MAX 256
+// Standard input, output and error.
+#define SERVE_FDS 3
+
+// Fills in the address of the socket at `path`. Returns 0 if it can't.
+static int socket_address(struct sockaddr_un* addr, const char* path) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "error: socket path too long: '%s'\n", path);
+        return 0;
+    }
+    strcpy(addr->sun_path, path);
+    return 1;
 }
 
-static Val* collect_operands(Val* args, Val* env) {
-    DEF_ROOT3(sym, operands, quoted);
-    sym = intern_symbol("quote");
-
-    operands = EMPTY_LIST;
-    for (; args->cdr != EMPTY_LIST; args = args->cdr) {
-        operands = cons(args->car, operands);
+// Runs the job of the client connected on `conn`, returning its status.
+static int serve_job(PonyoInterp* interp, int conn) {
+    char cwd[PATH_MAX];
+    int fds[SERVE_FDS];
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(fds))];
+    } control;
+    struct iovec iov = { cwd, sizeof(cwd) - 1 };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+    ssize_t n = recvmsg(conn, &msg, 0);
+    struct cmsghdr* c = n > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (!c || c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS ||
+        c->cmsg_len != CMSG_LEN(sizeof(fds))) {
+        return 1;
     }
-    // Quote the elements of the (unwrapped) list. This is to inhibit their
-    // evaluation when they are passed in as arguments to the procedure that
-    // is invoked by `apply`. Feels rather janky.
-    Val* end_list = eval(args->car, env);
-    check_typ(PRIM_APPLY, end_list, TY_EMPTY_LIST | TY_PAIR);
-    for (; end_list != EMPTY_LIST; end_list = end_list->cdr) {
-        quoted = cons(end_list->car, EMPTY_LIST);
-        quoted = cons(sym, quoted);
-        operands = cons(quoted, operands);
+    memcpy(fds, CMSG_DATA(c), sizeof(fds));
+    cwd[n] = '\0';
+    for (int i = 0; i < SERVE_FDS; i++) {
+        dup2(fds[i], i);
+        close(fds[i]);
     }
-    operands = rev(operands);
-    POP_ROOT3();
-    return operands;
-}
-
-static Val* prim_apply(Val* args, Val* env) {
-    check_len(PRIM_APPLY, args, gt, 1);
-    DEF_ROOT2(proc, operands);
-    proc = eval(args->car, env);
-    check_typ(PRIM_APPLY, proc, TY_COMP_PROC | TY_PRIM_PROC);
-    operands = collect_operands(args->cdr, env);
-    Val* result = apply(proc, operands, env);
-    POP_ROOT2();
-    return result;
+    if (chdir(cwd) != 0) {
+        fprintf(stderr, "error: could not change directory to '%s'\n", cwd);
+        return 1;
+    }
+    return ponyo_load_stream(interp, stdin, 1) == 0 ? 0 : 1;
 }
 
-static void add_prim_proc(char* name, PrimProc* p, Val* env) {
-    DEF_ROOT2(sym, proc);
-    sym = intern_symbol(name);
-    proc = make_prim_proc(p);
-    define_variable(sym, proc, env);
-    POP_ROOT2();
+static void serve_worker(PonyoInterp* interp, int sock)
+    __attribute__((noreturn));
+
+// Where a worker starts: serves one connection, and exits.
+static void serve_worker(PonyoInterp* interp, int sock) {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigprocmask(SIG_SETMASK, &signals, NULL);
+    if (interp->perf_map) {
+        // The map is named after the process.
+        fclose(interp->perf_map);
+        perf_map_open(interp);
+    }
+    int conn;
+    do {
+        conn = accept(sock, NULL, NULL);
+    } while (conn < 0 && errno == EINTR);
+    if (conn < 0) {
+        exit(1);
+    }
+    close(sock);
+    unsigned char status = serve_job(interp, conn);
+    fflush(stdout);
+    fflush(stderr);
+    send(conn, &status, 1, MSG_NOSIGNAL);
+    exit(status);
 }
 
-static void define_prim_procs(Val* env) {
-    add_prim_proc(PRIM_ADD, prim_add, env);
-    add_prim_proc(PRIM_SUB, prim_sub, env);
-    add_prim_proc(PRIM_MUL, prim_mul, env);
-    add_prim_proc(PRIM_DIV, prim_div, env);
-
-    add_prim_proc(PRIM_LT, prim_lt, env);
-    add_prim_proc(PRIM_LTE, prim_lte, env);
-    add_prim_proc(PRIM_GT, prim_gt, env);
-    add_prim_proc(PRIM_GTE, prim_gte, env);
-    add_prim_proc(PRIM_NUM_EQ, prim_num_eq, env);
-    add_prim_proc(PRIM_EQ, prim_eq, env);
-
-    add_prim_proc(PRIM_CAR, prim_car, env);
-    add_prim_proc(PRIM_CDR, prim_cdr, env);
-    add_prim_proc(PRIM_CONS, prim_cons, env);
-
-    add_prim_proc(PRIM_COND, prim_cond, env);
-    add_prim_proc(PRIM_IF, prim_if, env);
-    add_prim_proc(PRIM_AND, prim_and, env);
-    add_prim_proc(PRIM_OR, prim_or, env);
-
-    add_prim_proc(PRIM_DEFINE, prim_define, env);
-    add_prim_proc(PRIM_LAMBDA, prim_lambda, env);
-    add_prim_proc(PRIM_LET, prim_let, env);
-    add_prim_proc(PRIM_QUOTE, prim_quote, env);
-
-    add_prim_proc(PRIM_SET, prim_set, env);
-    add_prim_proc(PRIM_SET_CAR, prim_set_car, env);
-    add_prim_proc(PRIM_SET_CDR, prim_set_cdr, env);
-
-    add_prim_proc(PRIM_IS_INT, prim_is_int, env);
-    add_prim_proc(PRIM_IS_LIST, prim_is_list, env);
-    add_prim_proc(PRIM_IS_PAIR, prim_is_pair, env);
-    add_prim_proc(PRIM_IS_PROC, prim_is_proc, env);
-    add_prim_proc(PRIM_IS_STR, prim_is_str, env);
-    add_prim_proc(PRIM_IS_SYM, prim_is_sym, env);
-
-    add_prim_proc(PRIM_DISPLAY, prim_display, env);
-
-    add_prim_proc(PRIM_LOAD, prim_load, env);
-    add_prim_proc(PRIM_READ, prim_read, env);
-
-    add_prim_proc(PRIM_APPLY, prim_apply, env);
+static pid_t fork_worker(PonyoInterp* interp, int sock) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        serve_worker(interp, sock);
+    } else if (pid < 0) {
+        fprintf(stderr, "error: could not fork a worker\n");
+    }
+    return pid;
 }
 
-/*------------------------------------------------------------------------------
- | PRINTER
- -----------------------------------------------------------------------------*/
-
-static void print_list(Val* list) {
-    printf("(");
-    print(list->car);
-    for (list = list->cdr; list->ty == TY_PAIR; list = list->cdr) {
-        printf(" ");
-        print(list->car);
+// Serves jobs on the socket at `path` with `workers` workers, until
+// interrupted or terminated.
+static int serve(PonyoInterp* interp, const char* path, int workers) {
+    struct sockaddr_un addr;
+    if (!socket_address(&addr, path)) {
+        return 1;
     }
-    if (list != EMPTY_LIST) {
-        printf(" . ");
-        print(list);
+    // A socket left behind by a server that didn't exit cleanly.
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        remove(path);
+    }
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (sock < 0 || bind(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        listen(sock, SOMAXCONN) != 0) {
+        fprintf(stderr, "error: could not listen on '%s'\n", path);
+        return 1;
     }
-    printf(")");
-}
 
-static void print_string(Val* str) {
-    printf("\"");
-    for (char* c = str->str; *c != '\0'; c++) {
-        switch (*c) {
-        case '\t':
-            printf("\\t");
-            break;
-        case '\r':
-            printf("\\r");
-            break;
-        case '\n':
-            printf("\\n");
-            break;
-        case '\\':
-            printf("\\\\");
-            break;
-        case '"':
-            printf("\\\"");
-            break;
-        default:
-            printf("%c", *c);
+    // Only the forking thread carries on in a worker, so the instance's other
+    // threads are stopped first (they start again when they're needed).
+    stop_mark_pool(interp);
+    free_futures(interp);
+    fflush(stdout);
+    fflush(stderr);
+
+    // Signals are taken synchronously, so that none is missed between
+    // replacing one worker and waiting for the next to exit.
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGCHLD);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigprocmask(SIG_BLOCK, &signals, NULL);
+    pid_t pids[SERVE_WORKERS_MAX];
+    int status = 0;
+    for (int i = 0; i < workers; i++) {
+        pids[i] = fork_worker(interp, sock);
+        status |= pids[i] < 0;
+    }
+    while (status == 0) {
+        int sig;
+        sigwait(&signals, &sig);
+        if (sig != SIGCHLD) {
             break;
         }
+        pid_t pid;
+        while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+            for (int i = 0; i < workers; i++) {
+                if (pids[i] == pid) {
+                    pids[i] = fork_worker(interp, sock);
+                    status |= pids[i] < 0;
+                }
+            }
+        }
+    }
+
+    for (int i = 0; i < workers; i++) {
+        if (pids[i] > 0) {
+            kill(pids[i], SIGTERM);
+        }
     }
-    printf("\"");
+    while (waitpid(-1, NULL, 0) > 0) {
+    }
+    close(sock);
+    remove(path);
+    return status;
 }
 
-static void print(Val* val) {
-    switch (val->ty) {
-    case TY_FALSE:
-        printf("#f");
-        break;
-    case TY_TRUE:
-        printf("#t");
-        break;
-    case TY_EMPTY_LIST:
-        printf("()");
-        break;
-    case TY_COMP_PROC:
-        printf("#<compound-procedure>");
-        break;
-    case TY_INT:
-        printf("%d", val->num);
-        break;
-    case TY_PAIR:
-        print_list(val);
-        break;
-    case TY_PRIM_PROC:
-        printf("#<primitive-procedure>");
-        break;
-    case TY_STRING:
-        print_string(val);
-        break;
-    case TY_SYMBOL:
-        printf("%s", val->str);
-        break;
-    case TY_VOID:
-        printf("#<void>");
-        break;
+// Runs standard input as a job on the server at `path`, returning its status.
+static int connect_server(const char* path) {
+    struct sockaddr_un addr;
+    if (!socket_address(&addr, path)) {
+        return 1;
     }
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (sock < 0 ||
+        connect(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "error: could not connect to '%s'\n", path);
+        return 1;
+    }
+    char cwd[PATH_MAX];
+    if (!getcwd(cwd, sizeof(cwd))) {
+        fprintf(stderr, "error: could not get the working directory\n");
+        return 1;
+    }
+    int fds[SERVE_FDS] = { 0, 1, 2 };
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(fds))];
+    } control;
+    struct iovec iov = { cwd, strlen(cwd) };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+    struct cmsghdr* c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(c), fds, sizeof(fds));
+    unsigned char status;
+    ssize_t n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    if (n > 0) {
+        do {
+            n = recv(sock, &status, 1, 0);
+        } while (n < 0 && errno == EINTR);
+    }
+    close(sock);
+    if (n != 1) {
+        fprintf(stderr, "error: lost the connection to '%s'\n", path);
+        return 1;
+    }
+    return status;
 }
 
 /*------------------------------------------------------------------------------
  | PONYO!
  -----------------------------------------------------------------------------*/
 
-static void load(FILE* fp, char print_vals, Val* env) {
-    DEF_ROOT1(val);
-    for (val = read(fp); val; val = read(fp)) {
-        val = eval(val, env);
-        if (print_vals && val != VOID) {
-            print(val);
-            printf("\n");
-        }
-    }
-    POP_ROOT1();
+static void usage(void) {
+    fprintf(stderr,
+            "usage: ponyo [options]\n"
+            "       ponyo --emit-c file.scm\n"
+            OPTIONS_USAGE
+            "  -O, --optimize   optimize loaded code\n"
+            "  --emit-c FILE    write FILE (and the prelude) translated to C\n"
+            "  --serve PATH     run jobs sent to the socket at PATH\n"
+            "  --serve-workers N\n"
+            "                   keep N workers waiting for jobs (default one\n"
+            "                   per core)\n"
+            "  --connect PATH   run standard input as a job on the server at\n"
+            "                   PATH\n",
+            HEAP_SIZE, JIT_THRESHOLD);
+    exit(1);
 }
 
-static void load_file(char* path, char print_vals, Val* env) {
-    FILE* fp = fopen(path, "r");
-    if (!fp) {
-        ERROR("could not load '%s'", path);
+int main(int argc, char** argv) {
+    PonyoConfig config = { .prelude = "stdlib.scm" };
+    char* emit_path = NULL;
+    char* serve_path = NULL;
+    int serve_workers = get_nprocs() < SERVE_WORKERS_MAX ? get_nprocs()
+                                                      : SERVE_WORKERS_MAX;
+    for (int i = 1; i < argc;) {
+        int used = parse_option(argv, i, &config);
+        if (used) {
+            i += used;
+        } else if (strcmp(argv[i], "-O") == 0 ||
+                   strcmp(argv[i], "--optimize") == 0) {
+            config.optimize = 1;
+            i++;
+        } else if (strcmp(argv[i], "--emit-c") == 0 && i + 1 < argc) {
+            emit_path = argv[i + 1];
+            i += 2;
+        } else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+            serve_path = argv[i + 1];
+            i += 2;
+        } else if (strcmp(argv[i], "--serve-workers") == 0) {
+            serve_workers =
+                parse_count(argv[i], argv[i + 1], 1, SERVE_WORKERS_MAX);
+            i += 2;
+        } else if (strcmp(argv[i], "--connect") == 0 && i + 1 < argc) {
+            // Everything else is up to the server.
+            return connect_server(argv[i + 1]);
+        } else {
+            usage();
+        }
     }
-    load(fp, print_vals, env);
-    fclose(fp);
-}
-
-int main(void) {
-    init_heap();
 
-    PUSH_ROOT(symbol_list);
-    PUSH_ROOT(global_env);
-    symbol_list = EMPTY_LIST;
-    global_env = EMPTY_LIST;
-    global_env = extend_env(EMPTY_LIST, EMPTY_LIST, global_env);
-
-    define_prim_procs(global_env);
-    // Load `stdlib.scm` by default.
-    load_file("stdlib.scm", 0, global_env);
-    load(stdin, 1, global_env);
+    if (emit_path) {
+        // The prelude is read, rather than loaded, along with the program.
+        const char* prelude = config.prelude;
+        config.prelude = NULL;
+        PonyoInterp* interp = ponyo_new(&config);
+        if (!interp) {
+            return 1;
+        }
+        emit_c(interp, prelude, emit_path, stdout);
+        ponyo_free(interp);
+        return 0;
+    }
 
-    return 0;
+    PonyoInterp* interp = ponyo_new(&config);
+    if (!interp) {
+        return 1;
+    }
+    int status = serve_path ? serve(interp, serve_path, serve_workers)
+                            : ponyo_load_stream(interp, stdin, 1);
+    ponyo_free(interp);
+    return status == 0 ? 0 : 1;
 }
+
+#endif
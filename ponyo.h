@@ -0,0 +1,84 @@
+#ifndef PONYO_H
+#define PONYO_H
+
+#include <stdio.h>
+
+/*------------------------------------------------------------------------------
+ | EMBEDDING API
+ |
+ | Each interpreter instance has its own heap, symbol table and global
+ | environment. Instances share no mutable state, so independent instances can
+ | be used concurrently from separate threads (though any one instance must only
+ | be used by one thread at a time).
+ |
+ | Functions that evaluate code return 0 on success and -1 if an error occurred.
+ | Errors are reported on `stderr`; the instance remains usable afterwards.
+ -----------------------------------------------------------------------------*/
+
+typedef struct Interp PonyoInterp;
+
+typedef struct PonyoConfig {
+    // Size of the heap in cells. 0 for the default.
+    int heap_size;
+    // Number of threads used to mark the heap. 0 or 1 to mark on the calling
+    // thread only.
+    int gc_threads;
+    // Whether to optimize code as it is loaded.
+    int optimize;
+    // Compound procedures are compiled to native code on this call (so 1
+    // compiles every procedure that is called). 0 disables the JIT.
+    int jit_threshold;
+    // Whether to evaluate with an explicit continuation stack rather than by
+    // recursion on the C stack, so that deep recursion only runs out of heap.
+    // Procedures are then always interpreted.
+    int cek;
+    // Number of threads that run futures. 0 for one per core.
+    int future_threads;
+    // A directory to cache files loaded by `load` in, parsed, so that
+    // unchanged files needn't be parsed again. NULL to parse them each time.
+    const char* load_cache;
+    // Whether to read files (though not streams that might block, such as
+    // terminals and pipes) on a thread of their own while their forms are
+    // evaluated. Code being loaded must then not read from the same file.
+    int pipeline;
+    // Limits on what each top-level form may use: evaluation steps, cells
+    // allocated, depth of nested procedure calls, and milliseconds of
+    // wall-clock time. 0 for no limit. A form that exceeds a limit is
+    // abandoned with an error, and loading goes on with the next form (though
+    // the load still returns -1).
+    int max_steps;
+    int max_cells;
+    int max_depth;
+    int max_time;
+    // Whether to keep a shadow stack of the procedures being called, for
+    // tracers, and list code the JIT compiles in /tmp/perf-<pid>.map, for
+    // `perf`.
+    int perf;
+    // Whether to record where cells are allocated. The profile is written to
+    // `stderr` when the instance is freed.
+    int profile_alloc;
+    // Where `display` and printed values are written. NULL for `stdout`.
+    FILE* out;
+    // A file to load when the instance is created (usually "stdlib.scm").
+    // NULL to load nothing.
+    const char* prelude;
+} PonyoConfig;
+
+// Creates an instance. `config` may be NULL. Returns NULL on failure.
+PonyoInterp* ponyo_new(const PonyoConfig* config);
+
+// Destroys an instance, releasing its heap and GC threads.
+void ponyo_free(PonyoInterp* interp);
+
+// Evaluates every form in the file at `path`.
+int ponyo_load_file(PonyoInterp* interp, const char* path);
+
+// Evaluates every form read from `fp`. If `print_vals` is set, the value of
+// each form is written to the instance's output (as the REPL does).
+int ponyo_load_stream(PonyoInterp* interp, FILE* fp, int print_vals);
+
+// Evaluates every form in `src`, writing the value of each form to the
+// instance's output.
+int ponyo_eval_string(PonyoInterp* interp, const char* src);
+
+#endif
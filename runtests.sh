@@ -1,6 +1,16 @@
 #!/bin/bash
 
 prog=ponyo
+# With --aot, each test is compiled with `ponyo --emit-c` and run as a program.
+aot=0
+if [ "$1" = "--aot" ]; then
+    aot=1
+    shift
+    tmp=$(mktemp -d)
+fi
+# Any other arguments are passed through to every invocation of the
+# interpreter.
+prog_args=("$@")
 
 green='\033[0;32m'
 red='\033[0;31m'
@@ -17,12 +27,23 @@ function run_test() {
     printf 'testing %s %s ' "$1" "${padding:${#1}}"
 
     exp=$(printf '%b' "$3")
-    act=$(printf '%b' "$2" | ./"$prog" 2>&1)
+    if [ "$aot" -eq 1 ]; then
+        act=
+        printf '%b' "$2" > "$tmp/test.scm"
+        ./"$prog" --emit-c "$tmp/test.scm" > "$tmp/test.c" 2>/dev/null &&
+            "${CC:-cc}" -I. -pthread "$tmp/test.c" libponyo.a -o "$tmp/test" &&
+            act=$("$tmp/test" "${prog_args[@]}" < /dev/null 2>&1)
+    else
+        act=$(printf '%b' "$2" | ./"$prog" "${prog_args[@]}" 2>&1)
+    fi
 }
 
 function test() {
     run_test "$1" "$2" "$3"
+    check_result
+}
 
+function check_result() {
     if [ "$exp" = "$act" ]; then
         println_green 'ok'
     else
@@ -59,6 +80,73 @@ function test_fail() {
     fi
 }
 
+# Runs `$2`, which should exhaust the heap, and checks the first line of the
+# heap dump it writes against `$3`.
+function test_dump() {
+    run_test "$1" "$2" "$3"
+    act=$(printf '%s\n' "$act" | grep -m 1 '^heap dump:')
+    check_result
+}
+
+# Runs a test function (`test`, `test_fail`, ...), given after `--`, with the
+# arguments before it added to the others, e.g.
+# `with_args --heap-size 20000 -- test name input expected`.
+function with_args() {
+    local saved=("${prog_args[@]}")
+    while [ "$1" != "--" ]; do
+        prog_args+=("$1")
+        shift
+    done
+    shift
+    "$@"
+    prog_args=("${saved[@]}")
+}
+
+# Runs `$2` with --perf and every procedure compiled by the JIT, and checks
+# the names listed in the symbol map it leaves against `$3`.
+function test_perf_map() {
+    printf 'testing %s %s ' "$1" "${padding:${#1}}"
+    printf '%b' "$2" | ./"$prog" --perf --jit-threshold 1 > /dev/null 2>&1 &
+    local pid=$!
+    wait "$pid"
+    act=$(cut -d ' ' -f 3 "/tmp/perf-$pid.map" 2>&1)
+    rm -f "/tmp/perf-$pid.map"
+    exp=$(printf '%b' "$3")
+    check_result
+}
+
+# Starts a server with the other arguments, and waits for its socket.
+function start_server() {
+    ./"$prog" "${prog_args[@]}" --serve "$serve_dir/socket" \
+        --serve-workers 2 &
+    server=$!
+    for _ in $(seq 100); do
+        [ -S "$serve_dir/socket" ] && break
+        sleep 0.05
+    done
+}
+
+function stop_server() {
+    kill "$server"
+    wait "$server"
+}
+
+# Files that tests write and read back.
+files=$(mktemp -d)
+
+# Runs a test with files loaded by `load` cached in a fresh directory, which
+# is kept until the next call with `$1` set to "fresh".
+load_cache=$(mktemp -d)
+serve_dir=$(mktemp -d)
+trap 'rm -rf "$files" "$load_cache" "$serve_dir" ${tmp:+"$tmp"}' EXIT
+function test_load_cache() {
+    if [ "$1" = "fresh" ]; then
+        rm -rf "${load_cache:?}"/*
+    fi
+    shift
+    with_args --load-cache "$load_cache" -- test "$@"
+}
+
 println
 test whitespace-1 '; this is a comment' ''
 test whitespace-2 '  #t  \r\n\t#f  ' '#t\n#f'
@@ -318,6 +406,25 @@ test_fail proc-varargs-fail-1 '(define (f x . args) 1) (f)'
 test_fail proc-varargs-fail-2 '(define (f x y . args) 1) (f)'
 test_fail proc-varargs-fail-3 '(define (f x y . args) 1) (f 1)'
 
+println
+test closure-1 '(define (adder x) (lambda (y) (+ x y))) ((adder 3) 4)' '7'
+test closure-2 '(define (counter) (define n 0) (lambda () (set! n (+ n 1)) n))
+    (define c (counter)) (c) (c)' '1\n2'
+test closure-3 '(define (f x) (list (lambda () x) (lambda (v) (set! x v))))
+    (define p (f 1)) ((cadr p) 2) ((car p))' '2'
+test closure-4 '(define (f)
+    (define (g) (lambda () (h))) (define k (g)) (define (h) 5) (k)) (f)' '5'
+test closure-5 '(define (f a) (let ((b 2)) (lambda (c) (lambda () (list a b c)))))
+    (((f 1) 3))' '(1 2 3)'
+test closure-6 '(define (f list) (lambda () (list 1))) ((f (lambda (x) (+ x 1))))' '2'
+test closure-7 '(define (f) (lambda () (g 1))) (define (g x) (+ x 1)) ((f))' '2'
+# Closures only keep the variables they refer to, so the lists here are
+# garbage once each closure is made.
+with_args --heap-size 20000 -- test closure-8 '(define (build n acc) (if (= n 0) acc (build (- n 1) (cons n acc))))
+    (define (make i) (let ((big (build 300 (quote ())))) (lambda () i)))
+    (define (collect n acc) (if (= n 0) acc (collect (- n 1) (cons (make n) acc))))
+    (define cs (collect 100 (quote ()))) ((car cs))' '1'
+
 println
 test listproc-1 '(list)' '()'
 test listproc-2 '(list 1 2)' '(1 2)'
@@ -501,6 +608,285 @@ test map-4 "(let ((count 0))
                      count)
                    '(a b)))" '(1 2)'
 
+println
+test begin-1 '(begin 1 2 3)' '3'
+test begin-2 '(begin)' ''
+test begin-3 '(define x 1) (begin (set! x 2) x)' '2'
+
+println
+test macro-1 "(define-macro (swap! a b) (list 'let (list (list 'tmp a))
+                (list 'set! a b) (list 'set! b 'tmp)))
+              (define x 1) (define y 2) (swap! x y) (list x y)" '(2 1)'
+test macro-2 '(define-macro (five) 5) (five)' '5'
+test macro-3 "(define-macro (my-if c a b) (list 'cond (list c a) (list 'else b)))
+              (my-if #f 1 2)" '2'
+test macro-4 '(define n 0) (define-macro (m) (set! n (+ n 1)) 42)
+              (define (f) (m)) (f) (f) (f) n' '42\n42\n42\n1'
+test macro-5 '(define n 0) (define-macro (m) (set! n (+ n 1)) 42)
+              (define (f) (m)) n' '1'
+test macro-6 "(define-macro (m x) (list 'quote x)) (m (a b))" '(a b)'
+test macro-7 '(define (f) (m)) (define-macro (m) 7) (f)' '7'
+test macro-8 "(let ((if list)) (cond (#f 1) (else 2)))" '2'
+test macro-9 "(let ((and list)) (and 1 2))" '(1 2)'
+test macro-10 '(define-macro (m) 1) m' '#<macro>'
+test_fail macro-fail-1 '(define-macro)'
+test_fail macro-fail-2 '(define-macro m 1)'
+test_fail macro-fail-3 '(define-macro (m x) x) (m)'
+test_fail macro-fail-4 '(define-macro (1 x) x)'
+
+println
+test_fail error-1 '(error "boom")'
+test_fail error-2 "(error \"boom\" 1 '(2))"
+test_fail error-3 '(error)'
+test_fail cond-fail-2 "(cond (else 1) (#t 2))"
+test_fail let-fail-6 '(let ((x 1 2)) x)'
+
+println
+test opt-1 "(define (f) (car '(1 2))) (f) (define (car x) 'mine) (f)" '1\nmine'
+test opt-2 '(define (f) (+ 1 2)) (f) (define (+ . xs) 0) (f)' '3\n0'
+test opt-3 "(define (f) (if (< 1 2) 'yes 'no)) (f) (set! < >) (f)" 'yes\nno'
+test opt-4 "(define (f x) (cadr x)) (f '(1 2)) (define (cadr x) x) (f '(1 2))" \
+    '2\n(1 2)'
+test opt-5 "(define (f x) (not x)) (f #f) (set! not list) (f #f)" '#t\n(#f)'
+test opt-6 '(define (f car) (car 1)) (f -)' '-1'
+test opt-7 "(define (sq x) (* x x)) (define (f) (sq (begin (display 1) 2))) (f)" \
+    '14'
+test opt-8 '(define (f) (if #f #f)) (f)' ''
+# Arguments with effects are evaluated once, before the body runs.
+test opt-9 '(define (f c x) (if c x 0)) (f #f (display 5))' '50'
+test opt-10 '(define (f x) (begin (display 1) x)) (f (display 2)) (display 3)' '213'
+test opt-11 "(define (f x k) (begin (k) x)) (define (g y) (f y (lambda () (set! y 2)))) (g 1)" '1'
+test opt-12 "(define (f x) (not (null? (cadr x)))) (f (begin (display 1) '(1 2)))" '1#t'
+# Unless the parameter is used once, before anything else, when the call is
+# inlined all the same: here `f` then calls only `list`. (The CEK machine
+# limits the depth of its continuation rather than of calls, and compiled
+# programs aren't optimized.)
+if [ "$aot" -eq 0 ] && [[ " ${prog_args[*]} " != *" --cek "* ]]; then
+    with_args -O --max-depth 1 -- test opt-13 "(define (f x) (list (not (null? x)))) (f (begin (display 1) '(1)))" '1(#t)'
+fi
+test_fail opt-fail-1 '(define (f) (/ 1 0)) (f)'
+
+println
+test jit-1 "(define (f x) (+ x 1)) (f 1) (f 2) (define (+ . xs) 'plus) (f 3)" \
+    '2\n3\nplus'
+test jit-2 '(define y 10) (define (f x) (define y x) y) (f 1) (f 2) y' \
+    '1\n2\n10'
+test jit-3 "(define (f x) (< 1 x (car x))) (f 0) (f 0)" '#f\n#f'
+test jit-4 '(define (mk x) (lambda (y) (+ x y))) ((mk 1) 2) ((mk 3) 4)' '3\n7'
+test jit-5 '(define (f x) (set! x (* x 2)) (- x)) (f 2) (f 3)' '-4\n-6'
+test jit-6 "(define (f . xs) (cons 1 xs)) (f) (f 2 3)" '(1)\n(1 2 3)'
+test_fail jit-fail-1 "(define (f x) (car x)) (f '(1)) (f 1)"
+test_fail jit-fail-2 "(define (f x) (+ 1 x)) (f 1) (f 'a)"
+
+println
+test port-1 "(define p (open-input-file \"LICENSE\")) (read-line p) (read-line p) (read p)" "\"MIT License\"\n\"\"\nCopyright"
+test port-2 "(define p (open-input-file \"LICENSE\")) (peek-char p) (read-char p) (read-char p)" "\"M\"\n\"M\"\n\"I\""
+test port-3 "(define p (open-input-file \"metac.scm\")) (read p) (read p)" "(define true #t)\n(define false #f)"
+test port-4 "(define p (open-input-file \"metac.scm\"))
+(define (count n) (if (eof-object? (read p)) n (count (+ n 1))))
+(> (count 0) 10) (eof-object? (read p)) (eof-object? (read-char p)) (eof-object? (read-line p))" "#t\n#t\n#t\n#t"
+test port-5 "(eof-object? 1) (open-input-file \"LICENSE\")" "#f\n#<input-port>"
+test_fail port-fail-1 "(open-input-file \"no-such-file\")"
+test_fail port-fail-2 "(define p (open-input-file \"LICENSE\")) (close-port p) (read p)"
+test_fail port-fail-3 "(read-char 1)"
+
+println
+test_fail profile-fail-1 "(alloc-profile)"
+
+test heap-dump-1 "(define xs '(1 2 3)) (heap-dump \"$files/heap-dump\")
+(define p (open-input-file \"$files/heap-dump\")) (read p) (read p)
+(define counts (read-line p)) (read-line p)" "heap\ndump:\n\"live cells by type:\""
+test_fail heap-dump-fail-1 "(heap-dump \"/no-such-dir/dump\")"
+test_fail heap-dump-fail-2 "(heap-dump 1)"
+
+println
+# The heap is made big enough for deep recursion.
+with_args --cek --heap-size 1000000 -- test cek-1 "(define (count n) (if (= n 0) 0 (+ 1 (count (- n 1))))) (count 100000)" '100000'
+with_args --cek --heap-size 1000000 -- test cek-2 "(define (loop n) (if (= n 0) 'done (loop (- n 1)))) (loop 1000000)" 'done'
+with_args --cek --heap-size 1000000 -- test cek-3 "(define (iota n) (if (= n 0) '() (cons n (iota (- n 1)))))
+(length (map (lambda (x) (* x x)) (iota 50000)))" '50000'
+with_args --cek --heap-size 1000000 -- test cek-4 "(apply + 1 2 '(3 4)) (apply apply (list + '(1 2)))" '10\n3'
+with_args --cek --heap-size 1000000 -- test cek-5 "(define x 1) (set! x (+ x 1)) x (or #f (< 3 x (car x)))" '2\n#f'
+# Most of what is live is held by the continuation.
+with_args --cek --heap-size 20000 -- test_dump cek-6 "(define (count n) (if (= n 0) 0 (+ 1 (count (- n 1))))) (count 100000)" 'heap dump: 20000 of 20000 cells live'
+# Data nested this deeply is collected without recursing on the C stack.
+with_args --cek --heap-size 2000000 -- test cek-7 "(define (tree n) (if (= n 0) '() (cons (tree (- n 1)) '())))
+(define (depth t) (if (null? t) 0 (+ 1 (depth (car t)))))
+(define t (tree 300000)) (null? (tree 300000)) (null? (tree 300000)) (null? (tree 300000)) (depth t)" '#f\n#f\n#f\n300000'
+
+println
+test thread-1 "(define t (spawn (lambda () (+ 1 2)))) (join t) (join t)" '3\n3'
+test thread-2 "(define (ping s n) (if (> n 0) (begin (display s) (yield) (ping s (- n 1)))))
+(define a (spawn (lambda () (ping 1 3)))) (define b (spawn (lambda () (ping 2 3))))
+(join a) (join b) (newline)" '121212'
+test thread-3 "(define ch (make-channel 2))
+(define (produce n) (channel-send ch n) (if (> n 0) (produce (- n 1))))
+(define (consume acc) (define n (channel-receive ch)) (if (= n 0) acc (consume (+ acc n))))
+(define p (spawn (lambda () (produce 100)))) (define c (spawn (lambda () (consume 0))))
+(join c)" '5050'
+test thread-4 "(yield) (define ch (make-channel 1)) (channel-send ch 'a) (channel-receive ch)" 'a'
+test_fail thread-fail-1 "(join (spawn (lambda () (car '()))))"
+test_fail thread-fail-2 "(channel-receive (make-channel 1))"
+test_fail thread-fail-3 "(define ch (make-channel 1)) (join (spawn (lambda () (channel-receive ch))))"
+test_fail thread-fail-4 "(make-channel 0)"
+
+println
+test future-1 "(define f (future (lambda () (+ 1 2)))) (touch f) (touch f) f" '3\n3\n#<future>'
+# Futures are spread over several threads, however many cores there are.
+with_args --future-threads 4 -- test future-2 "(define (fib n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))
+(pmap fib '(15 10 5 1))" '(610 55 5 1)'
+with_args --future-threads 4 -- test future-3 "(define (iota n) (if (= n 0) '() (cons n (iota (- n 1)))))
+(define (sum l) (if (null? l) 0 (+ (car l) (sum (cdr l)))))
+(define (loop k acc) (if (= k 0) acc (loop (- k 1) (+ acc (sum (pmap (lambda (n) (sum (iota n))) '(50 100 150 200)))))))
+(loop 20 0)" '755000'
+with_args --future-threads 4 -- test future-4 "(pmap (lambda (n) (pmap (lambda (m) (* n m)) '(1 2 3))) '(1 2))" '((1 2 3) (2 4 6))'
+with_args --future-threads 4 -- test future-5 "(eq? 'fresh (touch (future (lambda () 'fresh))))" '#t'
+test_fail future-fail-1 "(touch (future (lambda () (car '()))))"
+test_fail future-fail-2 "(touch (future (lambda () (yield))))"
+test_fail future-fail-3 "(define f (future (lambda () (touch f)))) (touch f)"
+test_fail future-fail-4 "(touch 1)"
+
+println
+test fasl-1 "(write-fasl '(a \"b\" (1 -2 2147483647 -2147483648) #t #f () a) \"$files/fasl\")
+(read-fasl \"$files/fasl\")" '(a "b" (1 -2 2147483647 -2147483648) #t #f () a)'
+test fasl-2 "(define s (list 1 2)) (write-fasl (list s s) \"$files/fasl\")
+(define x (read-fasl \"$files/fasl\")) x (eq? (car x) (cadr x))
+(write-fasl '(fresh) \"$files/fasl\") (eq? 'fresh (car (read-fasl \"$files/fasl\")))" '((1 2) (1 2))\n#t\n#t'
+test fasl-3 "(define c (list 1 2)) (set-cdr! (cdr c) c) (write-fasl c \"$files/fasl\")
+(define d (read-fasl \"$files/fasl\")) (car (cddr d)) (eq? d (cddr d))" '1\n#t'
+test fasl-4 "(define s (list \"s\")) (define (mk n) (if (= n 0) '() (cons (list n 'a s) (mk (- n 1)))))
+(write-fasl (mk 100) \"$files/fasl\") (define x (read-fasl \"$files/fasl\"))
+(length x) (car x) (eq? (caddr (car x)) (caddr (car (reverse x))))" '100\n(100 a ("s"))\n#t'
+test_fail fasl-fail-1 "(write-fasl (list car) \"$files/fasl\")"
+test_fail fasl-fail-2 "(read-fasl \"LICENSE\")"
+test_fail fasl-fail-3 "(read-fasl \"/no-such-file\")"
+
+println
+point="(define-record-type point (make-point x y) point? (x point-x set-point-x!) (y point-y))"
+test record-1 "$point (define p (make-point 1 2)) (point-x p) (point-y p)
+(set-point-x! p 3) (point-x p) (point? p) (point? (list 'point 1 2))" '1\n2\n3\n#t\n#f'
+test record-2 "$point (make-point 1 2) point" '#<record point>\n#<record-type point>'
+test record-3 "$point (define-record-type node (make-node val) node? (val node-val) (next node-next set-node-next!))
+(define n (make-node 1)) (node-next n) (set-node-next! n n) (node-val (node-next n)) (point? n)" '#f\n1\n#f'
+test_fail record-fail-1 "$point (point-x (list 1 2))"
+test_fail record-fail-2 "$point (make-point 1)"
+test_fail record-fail-3 "(define-record-type point (make-point z) point? (x point-x))"
+test_fail record-fail-4 "$point (write-fasl (make-point 1 2) \"$files/fasl\")"
+with_args --heap-size 20000 -- test record-4 "$point (define (points n) (if (= n 0) '() (cons (make-point n (list n)) (points (- n 1)))))
+(define (churn n acc) (if (= n 0) acc (churn (- n 1) (+ acc (length (points 100))))))
+(define ps (points 3)) (churn 300 0) (map point-y ps)" '30000\n((3) (2) (1))'
+
+println
+test bytevector-1 "(define b (make-bytevector 3 7)) b (bytevector-u8-set! b 0 255) (bytevector-u8-ref b 0)
+(bytevector-length b) (bytevector? b) (bytevector? '(1 2))" '#u8(7 7 7)\n255\n3\n#t\n#f'
+test bytevector-2 "(define b (bytevector 1 2 3 4 5)) (bytevector-copy b 1 3) (bytevector-copy! b 0 b 2) b
+(bytevector-fill! b 0 3) b (bytevector-copy (make-bytevector 0))" '#u8(2 3)\n#u8(3 4 5 4 5)\n#u8(3 4 5 0 0)\n#u8()'
+test bytevector-3 "(bytevector=? (bytevector 1 0 2) (bytevector 1 0 2)) (bytevector=? (bytevector 1 0 2) (bytevector 1 0))
+(bytevector=? (bytevector 1 0 2) (bytevector 1 0 3))" '#t\n#f\n#f'
+test bytevector-4 "(write-bytevector (bytevector 0 1 0 255 10) \"$files/bytevector\")
+(read-bytevector \"$files/bytevector\")
+(write-bytevector (bytevector 0 1 0 255 10) \"$files/bytevector\" 1 4)
+(read-bytevector \"$files/bytevector\")" '#u8(0 1 0 255 10)\n#u8(1 0 255)'
+test_fail bytevector-fail-1 "(bytevector-u8-ref (bytevector 1 2) 2)"
+test_fail bytevector-fail-2 "(make-bytevector 2 256)"
+test_fail bytevector-fail-3 "(bytevector-copy! (make-bytevector 2) 1 (bytevector 1 2))"
+test_fail bytevector-fail-4 "(bytevector-copy (bytevector 1 2) 2 1)"
+test_fail bytevector-fail-5 "(read-bytevector \"/no-such-file\")"
+test_fail bytevector-fail-6 "(bytevector 1 . 2)"
+
+println
+test promise-1 "(define n 0) (define p (delay (begin (set! n (+ n 1)) n))) p (force p) (force p) n" '#<promise>\n1\n1\n1'
+test promise-2 "(force (make-promise 7)) (force 5) (promise? (delay 1)) (promise? (lambda () 1))" '7\n5\n#t\n#f'
+test promise-3 "(define (integers-from k) (cons-stream k (integers-from (+ k 1))))
+(define s (integers-from 1)) (stream-car (stream-cdr (stream-cdr s)))
+(stream-null? (stream-cdr s)) (stream-null? the-empty-stream)" '3\n#f\n#t'
+test_fail promise-fail-1 "(force (delay (car '())))"
+# Forced promises drop their thunks, so the lists these close over (more than
+# the heap holds, all told) can be collected.
+with_args --heap-size 20000 -- test promise-4 "(define (build n) (if (= n 0) '() (cons n (build (- n 1)))))
+(define (lazy-length n) (let ((xs (build n))) (delay (length xs))))
+(define (force-all k acc) (if (= k 0) acc (let ((p (lazy-length 1500))) (force p) (force-all (- k 1) (cons p acc)))))
+(map force (force-all 8 '()))" '(1500 1500 1500 1500 1500 1500 1500 1500)'
+with_args --heap-size 20000 -- test promise-5 "(define (integers-from k) (cons-stream k (integers-from (+ k 1))))
+(define (sum s n acc) (if (= n 0) acc (sum (stream-cdr s) (- n 1) (+ acc (stream-car s)))))
+(define (churn k acc) (if (= k 0) acc (churn (- k 1) (+ acc (sum (integers-from 1) 500 0)))))
+(churn 100 0)" '12525000'
+
+println
+printf '(define x 1) (display "loaded")' > "$files/load.scm"
+test_load_cache fresh load-cache-1 "(load \"$files/load.scm\") (load \"$files/load.scm\") x" 'loadedloaded1'
+test_load_cache kept load-cache-2 "(load \"$files/load.scm\") x" 'loaded1'
+printf '(define x 22) (display "changed")' > "$files/load.scm"
+test_load_cache kept load-cache-3 "(load \"$files/load.scm\") x" 'changed22'
+printf '(define x 3) (car (quote ()))' > "$files/load.scm"
+test_load_cache kept load-cache-4 "(load \"$files/load.scm\")" 'error: car: incorrect argument type'
+printf '(define x 4)' > "$files/load.scm"
+test_load_cache kept load-cache-5 "(load \"$files/load.scm\") x" '4'
+
+println
+with_args --max-steps 2000 -- test budget-1 "(define (loop n) (if (= n 0) 'done (loop (- n 1))))
+(loop 1000000) (loop 10)" 'error: step budget exceeded\ndone'
+with_args --max-cells 1000 -- test budget-2 "(define (build n) (if (= n 0) '() (cons n (build (- n 1)))))
+(build 100000) (build 3)" 'error: allocation budget exceeded\n(3 2 1)'
+with_args --max-depth 200 -- test budget-3 "(define (deep n) (if (= n 0) 0 (+ 1 (deep (- n 1)))))
+(deep 10) (deep 100000) (deep 20)" 'error: depth budget exceeded\n10\n20'
+with_args --max-time 100 -- test budget-4 "(define (fib n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))
+(fib 40) 'after" 'error: time budget exceeded\nafter'
+with_args --max-steps 2000 -- test budget-5 "(define (loop n) (if (= n 0) 'done (loop (- n 1))))
+(touch (future (lambda () (loop 1000000)))) (touch (future (lambda () (loop 10))))" 'error: step budget exceeded\nerror: future budget exceeded\ndone'
+with_args --max-steps 2000 -- test budget-6 "(define (loop n) (if (= n 0) 'done (loop (- n 1))))
+(define t (spawn (lambda () (loop 10)))) (join t) (loop 1000000) (join t)" 'error: step budget exceeded\ndone\ndone'
+
+println
+# Definitions are promoted out of the heap, so what's stored into their
+# constants (and the code macros expand them to) must survive collections.
+with_args --heap-size 20000 -- test immortal-1 "(define (build n) (if (= n 0) '() (cons n (build (- n 1)))))
+(define (churn n) (if (= n 0) 'done (begin (build 100) (churn (- n 1)))))
+(define (cell) '(0))
+(set-car! (cell) (list 1 (list 2 3)))
+(churn 2000) (cell)" 'done\n((1 (2 3)))'
+with_args --heap-size 20000 -- test immortal-2 "(define (build n) (if (= n 0) '() (cons n (build (- n 1)))))
+(define (f n) (let ((xs (build n))) (length xs)))
+(define (churn n acc) (if (= n 0) acc (churn (- n 1) (+ acc (f 200)))))
+(churn 300 0)" '60000'
+
+println
+for i in $(seq 1 2000); do
+    printf '(define x%d (list %d "s%d" (quote (a b))))\n' $((i % 10)) "$i" "$i"
+done > "$files/pipeline.scm"
+with_args --pipeline -- test pipeline-1 "(load \"$files/pipeline.scm\") x0 x9" '(2000 "s2000" (a b))\n(1999 "s1999" (a b))'
+printf '(display "one") (display "two") (display (quote (a b)' > "$files/pipeline.scm"
+with_args --pipeline -- test pipeline-2 "(load \"$files/pipeline.scm\")" 'error: unterminated list\nonetwo'
+printf '(display "one") (car (quote ())) (display "two")' > "$files/pipeline.scm"
+with_args --pipeline -- test pipeline-3 "(load \"$files/pipeline.scm\")" 'error: car: incorrect argument type\none'
+
+println
+with_args --perf -- test perf-1 "(define (f n) (if (= n 0) (car '()) (+ 1 (f (- n 1)))))
+(define (g n) (if (= n 0) 'done (g (- n 1))))
+(g 10) (join (spawn (lambda () (g 5)))) (f 10)" 'error: car: incorrect argument type\ndone\ndone'
+with_args --perf --cek -- test perf-3 "(define (f n) (if (= n 0) (car '()) (+ 1 (f (- n 1)))))
+(define (g n) (if (= n 0) 'done (g (- n 1))))
+(g 10) (join (spawn (lambda () (g 5)))) (touch (future (lambda () (f 3))))" 'error: car: incorrect argument type\nerror: touch: future failed\ndone\ndone'
+test_perf_map perf-2 "(define (fib n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))
+(define sq (lambda (x) (* x x))) (define sq2 sq)
+(fib 5) (sq2 2) ((lambda (y) y) 3)" 'scheme:fib\nscheme:sq\nscheme:lambda'
+
+# Jobs are run by the interpreter, so there's nothing to compile.
+if [ "$aot" -eq 0 ]; then
+    println
+    start_server
+    saved=("${prog_args[@]}")
+    prog_args=(--connect "$serve_dir/socket")
+    test serve-1 '(define x 5) (display "hi") (+ x 1)' 'hi6'
+    # Each job starts afresh from the prelude.
+    test_fail serve-2 'x'
+    test serve-3 "(define (build n) (if (= n 0) '() (cons n (build (- n 1)))))
+(length (build 200)) (touch (future (lambda () (length (build 100)))))" '200\n100'
+    test serve-4 '(car 1) 2' 'error: car: incorrect argument type'
+    prog_args=("${saved[@]}")
+    stop_server
+fi
+
 println
 if [ "$errors" -gt 0 ]; then
     println_red "test result: $errors failed"
@@ -106,6 +106,92 @@
       (map1 ls)
       (map-more ls more)))
 
+;;; Like `map` over one list, but with `proc` applied to the elements in
+;;; parallel (see `future`).
+(define (pmap proc ls)
+  (map touch (map (lambda (x) (future (lambda () (proc x)))) ls)))
+
+;;;-----------------------------------------------------------------------------
+;;; DERIVED SYNTAX
+;;;-----------------------------------------------------------------------------
+
+;;; Expansions refer to primitives such as `if` and `lambda` by value rather
+;;; than by name, so they mean the same thing wherever they are used, even where
+;;; the names are shadowed.
+
+(define-macro (let bindings . body)
+  (define (check binding)
+    (if (not (= (length binding) 2))
+        (error "let: incorrect argument count")))
+  (map check bindings)
+  (cons (cons lambda (cons (map car bindings) body))
+        (map cadr bindings)))
+
+(define-macro (cond clause . clauses)
+  (define (expand clause clauses)
+    (if (eq? (car clause) 'else)
+        (if (null? clauses)
+            (cons begin (cdr clause))
+            (error "cond: else clause must be last"))
+        (if (null? clauses)
+            (list if (car clause) (cons begin (cdr clause)))
+            (list if (car clause) (cons begin (cdr clause))
+                  (expand (car clauses) (cdr clauses))))))
+  (expand clause clauses))
+
+(define-macro (and . tests)
+  (cond ((null? tests) #t)
+        ((null? (cdr tests)) (car tests))
+        (else (list if (car tests) (cons and (cdr tests)) #f))))
+
+;;; The record type is made when the definition is expanded, and each field's
+;;; index into the record is worked out then too, so an accessor does no more
+;;; than `record-ref`. Fields the constructor doesn't take start out as #f.
+(define-macro (define-record-type type constructor predicate . fields)
+  (define names (map car fields))
+  (define record-type (make-record-type type names))
+  (define (index name)
+    (- (length names) (length (memq name names))))
+  (define (init name)
+    (if (memq name (cdr constructor)) name #f))
+  (define (check name)
+    (if (not (memq name names))
+        (error "define-record-type: not a field:" name)))
+  (define (procs field)
+    (define i (index (car field)))
+    (define get (list define (list (cadr field) 'record)
+                      (list record-ref 'record record-type i)))
+    (if (null? (cddr field))
+        (list get)
+        (list get (list define (list (caddr field) 'record 'value)
+                        (list record-set! 'record record-type i 'value)))))
+  (map check (cdr constructor))
+  (cons begin
+        (append (list (list define type record-type)
+                      (list define constructor
+                            (cons make-record
+                                  (cons record-type (map init names))))
+                      (list define (list predicate 'obj)
+                            (list record? 'obj record-type)))
+                (apply append (map procs fields)))))
+
+;;; The expression is put in a procedure of its own, so the promise only keeps
+;;; the variables it refers to, and only until it is forced (see `force`).
+(define-macro (delay expr)
+  (list make-lazy-promise (list lambda '() expr)))
+
+(define-macro (cons-stream a b)
+  (list cons a (list delay b)))
+
+;;;-----------------------------------------------------------------------------
+;;; STREAMS
+;;;-----------------------------------------------------------------------------
+
+(define the-empty-stream '())
+(define stream-null? null?)
+(define (stream-car stream) (car stream))
+(define (stream-cdr stream) (force (cdr stream)))
+
 ;;;-----------------------------------------------------------------------------
 ;;; INPUT AND OUTPUT
 ;;;-----------------------------------------------------------------------------